@@ -0,0 +1,59 @@
+#pragma once
+
+#include <pthread.h>
+#include "common.h"
+#include "gb.h"
+
+struct rom_image;
+struct gb_pool;
+
+// one instance, on its own cache lines
+struct batch_slot {
+    _Alignas(CACHE_LINE) struct gb *gb;
+    uint64_t cycles;    // run by batch_run() so far
+};
+
+struct batch;
+
+// a queue of slot indices, the owner takes from the tail and thieves from the head
+struct batch_worker {
+    _Alignas(CACHE_LINE) pthread_mutex_t lock;
+    int *tasks;
+    int head;
+    int tail;
+    int first;          // slots [first, last) are created by this worker and queued to it first
+    int last;
+    uint64_t steals;
+    pthread_t thread;
+    struct batch *batch;
+};
+
+typedef enum BATCH_JOB {
+    BATCH_CREATE,
+    BATCH_RUN,
+    BATCH_STOP,
+} batch_job_t;
+
+struct batch {
+    struct batch_slot *slots;
+    int count;
+    struct batch_worker *workers;
+    int threads;
+    struct rom_image *rom;
+    struct gb_pool *pool;   // holds the instances
+    cpu_backend_t backend;
+    struct gb_config config;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    uint64_t round;     // bumped to hand the workers a new job
+    batch_job_t job;
+    uint64_t frames;    // per instance in this round
+    int active;         // workers still in this round
+};
+
+struct batch *batch_create(struct rom_image *rom, int count, int threads, cpu_backend_t backend,
+                           const struct gb_config *config);
+void batch_destroy(struct batch *batch);
+uint64_t batch_run(struct batch *batch, uint64_t frames);
+struct gb *batch_instance(struct batch *batch, int index);
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "common.h"
+#include "gb.h"
+#include "cpu.h"
+
+#define BLOCK_MAX_OPS       32
+#define BLOCK_CACHE_SLOTS   1024
+#define BLOCK_NONE          (-1)
+
+struct micro_op {
+    cpu_op_fn fn;
+    uint8_t fetches;    // 1 for plain opcodes, 2 for CB-prefixed ones
+};
+
+struct block {
+    bool valid;
+    uint8_t n_ops;
+    uint16_t bank;
+    uint16_t start;
+    uint16_t end;       // one past the last byte of the block
+    uint16_t cycles;    // M-cycles for one pass with no branch taken
+    int16_t page_next;  // next block filed under the same 256-byte page
+    void *host;         // translated code, see jit.c
+    struct micro_op ops[BLOCK_MAX_OPS];
+};
+
+struct block_cache {
+    struct block slots[BLOCK_CACHE_SLOTS];
+    int16_t page_head[256];
+    uint8_t max_ops;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t invalidations;
+};
+
+struct block_cache *block_cache_create(void);
+void block_cache_destroy(struct block_cache *cache);
+void block_cache_flush(struct block_cache *cache);
+void block_invalidate(struct gb *gb, uint16_t addr);
+void block_invalidate_page(struct gb *gb, uint8_t page);
+struct block *block_lookup(struct gb *gb, uint16_t pc);
+uint16_t block_op_end(struct gb *gb, uint16_t pc);
+uint64_t block_exec(struct gb *gb, struct block *block, uint64_t count);
+uint64_t block_step(struct gb *gb);
+uint64_t block_run(struct gb *gb, uint64_t count);
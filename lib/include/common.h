@@ -8,9 +8,20 @@
 
 #define GB_MEM_SIZE         0x10000
 #define CPU_FREQ            4194304
+#define FRAME_CYCLES        70224
 #define SCREEN_WIDTH        160
 #define SCREEN_HEIGHT       144
+#define CACHE_LINE          64
 
 #define TO_U16(lsb, msb) (((uint16_t)(msb) << 8) | (uint16_t)(lsb))
 #define MSB(nn)          (((nn) >> 8) & 0xff)
-#define LSB(nn)          ((nn) & 0xff)
\ No newline at end of file
+#define LSB(nn)          ((nn) & 0xff)
+
+#if defined(__GNUC__)
+#define ALWAYS_INLINE    inline __attribute__((always_inline))
+#define FLATTEN          __attribute__((flatten))
+#define HAVE_COMPUTED_GOTO
+#else
+#define ALWAYS_INLINE    inline
+#define FLATTEN
+#endif
\ No newline at end of file
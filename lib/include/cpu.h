@@ -46,7 +46,17 @@ typedef enum CPU_OPERATOR {
     XOR,
 } cpu_operator_t;
 
+typedef void (*cpu_op_fn)(struct gb *gb);
+
+extern const cpu_op_fn cpu_ops[256];
+extern const cpu_op_fn cpu_cb_ops[256];
+
 void cpu_step(struct gb *gb);
-void tick(struct gb *gb);
+uint64_t cpu_run(struct gb *gb, uint64_t count);
+uint64_t cpu_run_until(struct gb *gb, uint64_t cycle);
 void cpu_cycle(struct gb *gb);
-void cpu_init(struct gb *gb);
\ No newline at end of file
+void cpu_cycles(struct gb *gb, unsigned int n);
+void cpu_flush_flags(struct gb *gb);
+void cpu_request_interrupt(struct gb *gb, interrupt_t irq);
+void cpu_check_interrupts(struct gb *gb);
+void cpu_init(struct gb *gb, cpu_backend_t backend);
\ No newline at end of file
@@ -8,6 +8,13 @@ typedef enum CPU_MODE {
     STOP,
 } cpu_mode_t;
 
+typedef enum CPU_BACKEND {
+    BACKEND_SWITCH,
+    BACKEND_THREADED,
+    BACKEND_CACHED,
+    BACKEND_JIT,
+} cpu_backend_t;
+
 struct cpu_register {
     uint8_t a;
     uint8_t b;
@@ -21,9 +28,281 @@ struct cpu_register {
     uint16_t sp;
 };
 
+typedef enum FLAGS_OP {
+    FLAGS_NONE,     // regs.f is up to date
+    FLAGS_ADD,
+    FLAGS_SUB,
+    FLAGS_AND,
+    FLAGS_LOGIC,
+    FLAGS_INC,
+    FLAGS_DEC,
+    FLAGS_ADD16,
+    FLAGS_SHIFT,
+    FLAGS_BIT,
+} cpu_flags_op_t;
+
+struct lazy_flags {
+    cpu_flags_op_t op;
+    uint16_t x;
+    uint16_t y;
+    uint32_t result;
+    uint8_t carry;
+};
+
+typedef enum INTERRUPT {
+    INT_VBLANK = (1U << 0),
+    INT_STAT = (1U << 1),
+    INT_TIMER = (1U << 2),
+    INT_SERIAL = (1U << 3),
+    INT_JOYPAD = (1U << 4),
+} interrupt_t;
+
+typedef enum SCHED_EVENT {
+    SCHED_TIMER,
+    SCHED_SAVE,
+    SCHED_PPU,
+    SCHED_EVENT_COUNT,
+} sched_event_t;
+
+struct sched_entry {
+    uint64_t when;
+    sched_event_t event;
+};
+
+struct scheduler {
+    uint64_t now;       // T-cycles since power on
+    uint64_t next;      // deadline of the earliest pending event
+    struct sched_entry heap[SCHED_EVENT_COUNT];
+    int8_t slot[SCHED_EVENT_COUNT];     // heap index of each event, -1 if idle
+    int size;
+};
+
+struct timer {
+    uint64_t div_base;  // cycle at which the internal divider was last reset
+    uint64_t tima_sync; // cycle up to which tima has been counted
+    uint8_t tima;
+    uint8_t tma;
+    uint8_t tac;
+};
+
+struct gb;
+
+typedef uint8_t (*mmu_read_fn)(struct gb *gb, uint16_t addr);
+typedef void (*mmu_write_fn)(struct gb *gb, uint16_t addr, uint8_t val);
+
+#define MMU_PAGES           256
+
+struct mmu_shared;
+
+struct mmu {
+    uint8_t *read[MMU_PAGES];       // host memory behind each 256-byte page, NULL to use read_fn
+    uint8_t *write[MMU_PAGES];      // same for writes, also NULL while the page holds cached code
+    uint8_t *ram[MMU_PAGES];        // writable host memory of the page even when write[] is NULL
+    uint8_t *cow[MMU_PAGES];        // where a page read from shared copies itself on its first write
+    bool code[MMU_PAGES];
+    mmu_read_fn read_fn[MMU_PAGES];
+    mmu_write_fn write_fn[MMU_PAGES];
+    struct mmu_shared *shared;      // pages frozen by gb_fork(), see mmu.c
+    uint64_t cow_copies;
+};
+
+typedef enum PPU_MODE {
+    PPU_HBLANK,
+    PPU_VBLANK,
+    PPU_OAM,
+    PPU_DRAW,
+} ppu_mode_t;
+
+typedef enum PPU_RENDERER {
+    PPU_SCANLINE,   // whole lines at the end of mode 3, fastest
+    PPU_FIFO,       // dot by dot pixel FIFO, for mid-line raster effects
+} ppu_renderer_t;
+
+typedef enum PPU_FORMAT {
+    PPU_FORMAT_SHADE,       // one byte per pixel, shades 0 (white) to 3 (black)
+    PPU_FORMAT_RGBA8888,    // bytes R, G, B, A in memory order
+    PPU_FORMAT_XRGB8888,    // native 32-bit 0xffRRGGBB
+    PPU_FORMAT_RGB565,      // native 16-bit
+} ppu_format_t;
+
+// where finished lines go, stride in bytes
+struct ppu_output {
+    void *pixels;
+    size_t stride;
+    ppu_format_t format;
+    uint32_t colors[4];     // shades in the output format
+};
+
+typedef enum PPU_OBS_FORMAT {
+    PPU_OBS_SHADE,      // shades 0-3
+    PPU_OBS_GRAY,       // 255 (white) to 0 (black)
+} ppu_obs_format_t;
+
+typedef enum PPU_OBS_FILTER {
+    PPU_OBS_NEAREST,    // one source pixel per output pixel
+    PPU_OBS_AREA,       // average of the source area an output pixel covers
+} ppu_obs_filter_t;
+
+// downscaled frames written into a caller's ring, one byte per pixel
+struct ppu_observation {
+    uint8_t *ring;
+    int depth;          // frames in the ring
+    uint64_t count;     // frames completed, the next one goes to slot count % depth
+    int width;
+    int height;
+    ppu_obs_format_t format;
+    ppu_obs_filter_t filter;
+    int row;            // next output row
+    uint8_t value[4];   // output value of each shade
+    // per source column and line: output pixel and how much of it overlaps the
+    // next output pixel (area), or source pixel of each output column and output
+    // row of each source line (nearest)
+    uint8_t map_x[SCREEN_WIDTH];
+    uint8_t weight_x[SCREEN_WIDTH];
+    uint8_t map_y[SCREEN_HEIGHT];
+    uint8_t weight_y[SCREEN_HEIGHT];
+    uint32_t acc[2][SCREEN_WIDTH];  // per column sums of the current and next output rows
+};
+
+#define PPU_TILES           384
+#define PPU_OBJ_PER_LINE    10
+
+struct ppu_sprite {
+    uint8_t y;
+    uint8_t x;
+    uint8_t tile;
+    uint8_t attr;
+};
+
+struct ppu_fifo {
+    uint64_t cycle;     // cycle up to which mode 3 has been run
+    bool done;          // all 160 pixels of the line are out
+    bool window;        // the fetcher has switched to the window
+    uint8_t x;          // next pixel to output
+    uint8_t delay;      // dots of the first, discarded tile fetch still to go
+    uint8_t discard;    // pixels still to drop for SCX & 7
+    uint8_t fetch_step; // dots into the current tile fetch, 6 when it waits to push
+    uint8_t fetch_x;    // tile map column being fetched
+    uint8_t tile_id;
+    uint8_t bg[8];
+    uint8_t bg_head;
+    uint8_t bg_size;
+    uint8_t obj_color[8];   // indexed from the next pixel to output
+    uint8_t obj_attr[8];
+    uint8_t sprite_dots;    // dots into the current sprite fetch
+    uint8_t n_sprites;
+    uint8_t next_sprite;
+    struct ppu_sprite sprites[PPU_OBJ_PER_LINE];
+};
+
+struct pixel_kernels;
+
+struct ppu {
+    ppu_renderer_t renderer;
+    const struct pixel_kernels *kernels;
+    uint8_t lcdc;
+    uint8_t stat;       // interrupt enables only, mode and coincidence are worked out on read
+    uint8_t scy;
+    uint8_t scx;
+    uint8_t ly;
+    uint8_t lyc;
+    uint8_t bgp;
+    uint8_t obp[2];
+    uint8_t wy;
+    uint8_t wx;
+    ppu_mode_t mode;
+    uint8_t window_line;    // lines of the window drawn so far this frame
+    bool stat_line;     // level of the STAT interrupt line, it fires on a rising edge
+    uint64_t line_start;    // cycle at which the current line began
+    uint64_t frames;
+    bool render;        // draw every frame, off for headless runs
+    bool render_once;   // draw the next frame even with render off
+    bool drawing;       // pixels are being generated for the current frame
+    uint8_t tiles[PPU_TILES][8][8];     // 0x8000-0x97ff decoded to colour indices
+    uint8_t framebuffer[SCREEN_HEIGHT][SCREEN_WIDTH];   // default output, shades 0-3
+    struct ppu_output output;   // frame being drawn
+    struct ppu_output next_output;  // switched to when the next frame starts
+    bool output_pending;
+    uint8_t line[SCREEN_WIDTH];     // shades of a line waiting for conversion
+    struct ppu_observation obs;
+    uint64_t line_hash[SCREEN_HEIGHT];  // shades last drawn on each line
+    uint8_t dirty[SCREEN_HEIGHT / 8];   // lines that changed in the last complete frame, bit y % 8 of byte y / 8
+    uint8_t dirty_next[SCREEN_HEIGHT / 8];  // the same for the frame being drawn
+    struct ppu_fifo fifo;
+};
+
+#define IDLE_CACHE_SIZE     64
+
+struct idle {
+    bool enabled;
+    uint32_t rejected[IDLE_CACHE_SIZE];     // start << 16 | end of loops that are not idle
+    uint32_t last_key;  // loop seen by the previous check, when and until when it was stable
+    uint64_t last_now;
+    uint64_t last_deadline;
+    uint64_t until;     // skips end before this cycle, set by the current cpu run
+    uint64_t skipped;   // T-cycles fast-forwarded
+    uint64_t skips;
+};
+
+struct block_cache;
+struct jit;
+
 struct cpu {
     struct cpu_register regs;
-    cpu_mode_t mode;
+    struct lazy_flags flags;
+    cpu_mode_t mode;    // IME: interrupt entry or the EI delay is due before the next instruction
+    bool ime;
+    bool ei_delay;      // EI was the last instruction
+    uint64_t halt_cycles;   // T-cycles skipped while halted
+    cpu_backend_t backend;
+    struct block_cache *blocks;
+    struct jit *jit;
+    bool block_exit;    // set by writes that must end the current block
+};
+
+typedef enum MBC_TYPE {
+    MBC_NONE,
+    MBC_1,
+    MBC_3,
+    MBC_5,
+} mbc_type_t;
+
+typedef enum RTC_REGISTER {
+    RTC_S,
+    RTC_M,
+    RTC_H,
+    RTC_DL,
+    RTC_DH,
+    RTC_REGS,
+} rtc_register_t;
+
+struct rtc {
+    uint8_t regs[RTC_REGS];     // running clock
+    uint8_t latched[RTC_REGS];  // what the CPU reads
+    uint8_t latch;      // last value written to the latch register
+    uint64_t sync;      // cycle up to which regs have been counted
+};
+
+#define MBC_NO_RAM          0xffff
+
+struct mbc {
+    mbc_type_t type;
+    bool battery;
+    bool has_rtc;
+    bool ram_enabled;
+    uint8_t mode;       // MBC1 banking mode
+    uint16_t rom_select;    // ROM bank register as written
+    uint8_t ram_select;     // RAM bank register: MBC1 upper bits, MBC3 RAM bank or RTC register
+    uint16_t rom_bank0;     // banks currently mapped at 0x0000, 0x4000 and 0xa000
+    uint16_t rom_bank;
+    uint16_t ram_bank;      // MBC_NO_RAM when the window is disabled or shows the RTC
+    uint32_t rom_banks;
+    uint8_t *ram;
+    uint32_t ram_size;
+    uint8_t *save;      // mapped .sav file, RAM followed by the RTC footer, NULL without one
+    uint32_t save_size;
+    uint64_t flushes;
+    struct rtc rtc;
 };
 
 struct rom_info {
@@ -31,16 +310,38 @@ struct rom_info {
     bool loaded;
 };
 
+struct rom_image;
+
 struct rom {
-    uint8_t *data;
+    uint8_t *data;      // read-only, owned by image when there is one
+    struct rom_image *image;
     struct rom_info info;
 };
 
+struct gb_pool;
+
 struct gb {
-    uint8_t mem[GB_MEM_SIZE];
+    uint8_t mem[GB_MEM_SIZE];   // VRAM, WRAM, OAM, I/O and HRAM behind the page table
+    struct mmu mmu;
     struct cpu cpu;
+    struct scheduler sched;
+    struct timer timer;
+    struct ppu ppu;
+    struct idle idle;
     struct rom rom;
+    struct mbc mbc;
+    struct gb_pool *pool;       // where the instance lives, NULL for the heap
+};
+
+/* Options fixed for the lifetime of an instance */
+struct gb_config {
+    ppu_renderer_t renderer;
 };
 
 struct gb *gb_create(void);
+struct gb *gb_create_config(const struct gb_config *config);
+struct gb *gb_create_from_rom(struct rom_image *image, const struct gb_config *config);
+struct gb *gb_create_in(struct gb_pool *pool, const struct gb_config *config);
+struct gb *gb_fork(struct gb *parent);
+bool gb_reset_from(struct gb *gb, const struct gb *template);
 void gb_destroy(struct gb *gb);
\ No newline at end of file
@@ -0,0 +1,9 @@
+#pragma once
+
+#include "common.h"
+#include "gb.h"
+
+#define IDLE_MAX_LEN        16
+
+void idle_init(struct gb *gb);
+void idle_check(struct gb *gb, uint16_t end);
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "common.h"
+#include "gb.h"
+#include "block.h"
+
+#define JIT_CODE_SIZE   (1U << 20)
+
+typedef uint32_t (*jit_block_fn)(struct gb *gb);
+
+struct jit {
+    uint8_t *code;
+    size_t used;
+};
+
+struct jit *jit_create(void);
+void jit_destroy(struct jit *jit);
+uint64_t jit_run(struct gb *gb, uint64_t count);
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "common.h"
+#include "gb.h"
+
+void mbc_init(struct gb *gb);
+void mbc_destroy(struct gb *gb);
+bool mbc_open_save(struct gb *gb, const char *sav_path);
+void mbc_flush(struct gb *gb);
+void mbc_save_event(struct gb *gb, uint64_t late);
+void mbc_restore(struct gb *gb);
+bool mbc_fork(struct gb *child, struct gb *parent);
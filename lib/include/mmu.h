@@ -1,7 +1,58 @@
 #pragma once
 
+#include <stdatomic.h>
 #include "common.h"
 #include "gb.h"
 
-void mmu_write(struct gb *gb, uint16_t addr, uint8_t val);
-uint8_t mmu_read(struct gb *gb, uint16_t addr);
\ No newline at end of file
+/* Contents of gb->mem frozen by gb_fork(), read by the parent and its children */
+struct mmu_shared {
+    atomic_int refs;
+    uint8_t data[GB_MEM_SIZE];
+};
+
+void mmu_init(struct gb *gb);
+void mmu_map_flat(struct gb *gb);
+void mmu_map_rom(struct gb *gb, uint8_t page, int count, uint32_t offset);
+void mmu_map(struct gb *gb, uint8_t page, uint8_t *read, uint8_t *write);
+void mmu_trap_code(struct gb *gb, uint8_t page);
+void mmu_untrap_code(struct gb *gb);
+void mmu_write_slow(struct gb *gb, uint16_t addr, uint8_t val);
+uint16_t mmu_bank(struct gb *gb, uint16_t addr);
+uint64_t mmu_next_change(struct gb *gb, uint16_t addr);
+bool mmu_share(struct gb *gb);
+void mmu_rebase(struct gb *gb, const struct gb *from);
+void mmu_fork(struct gb *child, struct gb *parent);
+void mmu_unshare(struct gb *gb, uint8_t page);
+const uint8_t *mmu_mem_page(struct gb *gb, uint8_t page);
+int mmu_shared_pages(struct gb *gb);
+void mmu_destroy(struct gb *gb);
+
+// HRAM shares page 0xff with the I/O registers but is plain memory that is never shared
+static ALWAYS_INLINE bool mmu_is_hram(uint16_t addr)
+{
+    return addr >= 0xff80 && addr != 0xffff;
+}
+
+static ALWAYS_INLINE uint8_t mmu_read(struct gb *gb, uint16_t addr)
+{
+    const uint8_t *page = gb->mmu.read[addr >> 8];
+
+    if (page)
+        return page[addr & 0xff];
+    if (mmu_is_hram(addr))
+        return gb->mem[addr];
+    return gb->mmu.read_fn[addr >> 8](gb, addr);
+}
+
+// code cached in HRAM still goes through mmu_write_slow() to be invalidated
+static ALWAYS_INLINE void mmu_write(struct gb *gb, uint16_t addr, uint8_t val)
+{
+    uint8_t *page = gb->mmu.write[addr >> 8];
+
+    if (page)
+        page[addr & 0xff] = val;
+    else if (mmu_is_hram(addr) && !gb->mmu.code[0xff])
+        gb->mem[addr] = val;
+    else
+        mmu_write_slow(gb, addr, val);
+}
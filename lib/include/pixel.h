@@ -0,0 +1,34 @@
+#pragma once
+
+#include "common.h"
+
+/*
+ * Pixel kernels used by the PPU. Each set works on rows of colour indices
+ * (0-3) and writes shades (0-3); pixel_kernels() picks the widest set the
+ * host CPU supports.
+ */
+
+// the 8 pixels of a tile row from its two bitplanes
+typedef void (*pixel_decode_fn)(uint8_t *out, uint8_t lo, uint8_t hi);
+// out[x] = shade of idx[x] through palette pal
+typedef void (*pixel_palette_fn)(uint8_t *out, const uint8_t *idx, uint8_t pal, int count);
+// BG/window and sprite pixels combined, sprites hidden behind non-zero BG when attr bit 7 is set
+typedef void (*pixel_merge_fn)(uint8_t *out, const uint8_t *bg, const uint8_t *obj, const uint8_t *attr,
+                               uint8_t bgp, const uint8_t *obp, int count);
+
+struct pixel_kernels {
+    const char *name;
+    pixel_decode_fn decode;
+    pixel_palette_fn palette;
+    pixel_merge_fn merge;
+};
+
+extern const struct pixel_kernels pixel_scalar;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_PIXEL_SIMD
+extern const struct pixel_kernels pixel_sse2;
+extern const struct pixel_kernels pixel_avx2;
+#endif
+
+const struct pixel_kernels *pixel_kernels(void);
+bool pixel_supported(const struct pixel_kernels *kernels);
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <pthread.h>
+#include "common.h"
+#include "gb.h"
+
+#define POOL_HUGE_PAGE      (2U << 20)
+
+/* Fixed room for instances in one mapping, huge pages when the system has them */
+struct gb_pool {
+    uint8_t *base;
+    size_t size;        // of the mapping
+    size_t slot_size;   // sizeof(struct gb) rounded up to whole pages
+    int capacity;
+    int *free;          // stack of free slot indices
+    int n_free;
+    bool huge;          // explicit huge pages, otherwise transparent ones were asked for
+    pthread_mutex_t lock;
+};
+
+struct gb_pool *gb_pool_create(int capacity);
+void gb_pool_destroy(struct gb_pool *pool);
+struct gb *gb_pool_get(struct gb_pool *pool);
+void gb_pool_put(struct gb_pool *pool, struct gb *gb);
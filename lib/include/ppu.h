@@ -0,0 +1,19 @@
+#pragma once
+
+#include "common.h"
+#include "gb.h"
+
+void ppu_init(struct gb *gb, ppu_renderer_t renderer);
+uint8_t ppu_read(struct gb *gb, uint16_t addr);
+void ppu_write(struct gb *gb, uint16_t addr, uint8_t val);
+void ppu_vram_write(struct gb *gb, uint16_t addr, uint8_t val);
+void ppu_load_tiles(struct gb *gb, const uint8_t *data);
+void ppu_event(struct gb *gb, uint64_t late);
+void ppu_set_render(struct gb *gb, bool enabled);
+uint64_t ppu_render_next_frame(struct gb *gb);
+bool ppu_set_output(struct gb *gb, void *pixels, size_t stride, ppu_format_t format);
+bool ppu_set_observation(struct gb *gb, uint8_t *ring, int depth, int width, int height,
+                         ppu_obs_format_t format, ppu_obs_filter_t filter);
+const uint8_t *ppu_observation(struct gb *gb, int age);
+const uint8_t *ppu_dirty_lines(struct gb *gb);
+void ppu_fork(struct gb *child, struct gb *parent);
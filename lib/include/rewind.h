@@ -0,0 +1,37 @@
+#pragma once
+
+#include "common.h"
+#include "gb.h"
+
+#define REWIND_KEYFRAME_MAX     UINT16_MAX
+
+struct rewind_entry {
+    uint32_t offset;        // of the encoded state in rewind.data
+    uint32_t size;
+    uint16_t since_key;     // entries since the last keyframe, 0 for a keyframe
+    bool keyframe;          // the state itself rather than its XOR with the one before
+};
+
+struct rewind {
+    struct gb *gb;
+    size_t state_size;
+    size_t words;           // state_size rounded up to 64-bit words
+    uint8_t *current;       // newest state, in full
+    uint8_t *scratch;
+    uint8_t *data;          // encoded states, a ring of variable-sized records
+    uint32_t data_size;
+    uint32_t head;          // where the next record goes
+    struct rewind_entry *entries;   // oldest first, the oldest is always a keyframe
+    int max_entries;
+    int first;
+    int count;
+    int keyframe_interval;
+    uint64_t encoded;       // bytes written since creation
+    uint64_t captures;
+};
+
+struct rewind *rewind_create(struct gb *gb, size_t budget, int keyframe_interval);
+void rewind_destroy(struct rewind *rw);
+void rewind_capture(struct rewind *rw);
+bool rewind_step_back(struct rewind *rw);
+int rewind_frames(struct rewind *rw);
@@ -1,6 +1,20 @@
 #pragma once
 
+#include <stdatomic.h>
 #include "common.h"
 #include "gb.h"
 
-void rom_load(struct gb *gb, char *rom_path);
\ No newline at end of file
+/* A cartridge image shared read-only by every instance running it */
+struct rom_image {
+    uint8_t *data;
+    uint32_t size;
+    bool mapped;        // data is a file mapping rather than a heap copy
+    atomic_int refs;
+};
+
+struct rom_image *rom_open(const char *rom_path);
+struct rom_image *rom_from_buffer(const uint8_t *data, uint32_t size);
+struct rom_image *rom_retain(struct rom_image *image);
+void rom_release(struct rom_image *image);
+void rom_attach(struct gb *gb, struct rom_image *image);
+void rom_load(struct gb *gb, char *rom_path);
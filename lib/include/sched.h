@@ -0,0 +1,21 @@
+#pragma once
+
+#include "common.h"
+#include "gb.h"
+
+#define SCHED_NEVER UINT64_MAX
+
+typedef void (*sched_fn)(struct gb *gb, uint64_t late);
+
+void sched_init(struct gb *gb);
+void sched_add(struct gb *gb, sched_event_t event, uint64_t when);
+void sched_cancel(struct gb *gb, sched_event_t event);
+void sched_dispatch(struct gb *gb);
+
+/* Move time forward by cycles T-cycles, running every event that came due */
+static ALWAYS_INLINE void sched_advance(struct gb *gb, unsigned int cycles)
+{
+    gb->sched.now += cycles;
+    if (gb->sched.now >= gb->sched.next)
+        sched_dispatch(gb);
+}
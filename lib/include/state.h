@@ -0,0 +1,10 @@
+#pragma once
+
+#include "common.h"
+#include "gb.h"
+
+#define STATE_VERSION       1
+
+size_t gb_state_size(struct gb *gb);
+size_t gb_save_state(struct gb *gb, void *buf, size_t size);
+bool gb_load_state(struct gb *gb, const void *buf, size_t size);
@@ -0,0 +1,10 @@
+#pragma once
+
+#include "common.h"
+#include "gb.h"
+
+void timer_init(struct gb *gb);
+uint8_t timer_read(struct gb *gb, uint16_t addr);
+void timer_write(struct gb *gb, uint16_t addr, uint8_t val);
+void timer_overflow(struct gb *gb, uint64_t late);
+uint64_t timer_next_change(struct gb *gb, uint16_t addr);
@@ -0,0 +1,291 @@
+#include <unistd.h>
+#include "batch.h"
+#include "cpu.h"
+#include "rom.h"
+#include "pool.h"
+
+/*
+ * Many independent instances stepped by a pool of threads, one per CPU by
+ * default. Each worker creates a contiguous share of the instances, so their
+ * memory is first touched (and placed) by the thread that usually runs them,
+ * and queues the same share to itself at the start of every round. A worker
+ * whose queue runs dry steals whole instances from the front of the others'
+ * queues, which evens out games that run at different speeds. An instance is
+ * only ever run by one thread at a time. The instances are page-aligned
+ * slots of a gb_pool, and the per-instance and per-worker data the threads
+ * write sit on their own cache lines.
+ */
+
+// registers as the DMG boot ROM leaves them, so every instance starts out the same
+static void boot(struct gb *gb)
+{
+    static const struct cpu_register regs = {
+        .a = 0x01, .f = 0xb0, .b = 0x00, .c = 0x13, .d = 0x00, .e = 0xd8, .h = 0x01, .l = 0x4d,
+        .pc = 0x0100, .sp = 0xfffe,
+    };
+
+    gb->cpu.regs = regs;
+}
+
+static void create_slot(struct batch *batch, struct batch_slot *slot)
+{
+    slot->gb = gb_create_in(batch->pool, &batch->config);
+    slot->cycles = 0;
+    if (!slot->gb)
+        return;
+    rom_attach(slot->gb, batch->rom);
+    cpu_init(slot->gb, batch->backend);
+    boot(slot->gb);
+}
+
+static void run_slot(struct batch *batch, struct batch_slot *slot)
+{
+    struct gb *gb = slot->gb;
+    uint64_t start = gb->sched.now;
+    uint64_t end = start + batch->frames * FRAME_CYCLES;
+
+    cpu_run_until(gb, end);
+    slot->cycles += gb->sched.now - start;
+}
+
+static int take(struct batch_worker *w)
+{
+    int index = -1;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->head < w->tail)
+        index = w->tasks[--w->tail];
+    pthread_mutex_unlock(&w->lock);
+    return index;
+}
+
+static int steal(struct batch_worker *w)
+{
+    struct batch *batch = w->batch;
+    int self = w - batch->workers;
+
+    for (int i = 1; i < batch->threads; i++) {
+        struct batch_worker *victim = &batch->workers[(self + i) % batch->threads];
+        int index = -1;
+
+        pthread_mutex_lock(&victim->lock);
+        if (victim->head < victim->tail)
+            index = victim->tasks[victim->head++];
+        pthread_mutex_unlock(&victim->lock);
+        if (index >= 0) {
+            w->steals++;
+            return index;
+        }
+    }
+    return -1;
+}
+
+static void *worker_main(void *arg)
+{
+    struct batch_worker *w = arg;
+    struct batch *batch = w->batch;
+    uint64_t seen = 0;
+
+    for (;;) {
+        batch_job_t job;
+        int index;
+
+        pthread_mutex_lock(&batch->lock);
+        while (batch->round == seen)
+            pthread_cond_wait(&batch->start, &batch->lock);
+        seen = batch->round;
+        job = batch->job;
+        pthread_mutex_unlock(&batch->lock);
+        if (job == BATCH_STOP)
+            return NULL;
+
+        // instances are created by their owner, only running them is shared out
+        while ((index = take(w)) >= 0 || (job == BATCH_RUN && (index = steal(w)) >= 0)) {
+            if (job == BATCH_CREATE)
+                create_slot(batch, &batch->slots[index]);
+            else
+                run_slot(batch, &batch->slots[index]);
+        }
+        // nothing left to take anywhere, the round is over once every worker gets here
+        pthread_mutex_lock(&batch->lock);
+        if (!--batch->active)
+            pthread_cond_signal(&batch->done);
+        pthread_mutex_unlock(&batch->lock);
+    }
+}
+
+// hand every worker its own slots and wait until all of them are done
+static void run_round(struct batch *batch, batch_job_t job)
+{
+    for (int t = 0; t < batch->threads; t++) {
+        struct batch_worker *w = &batch->workers[t];
+
+        pthread_mutex_lock(&w->lock);
+        w->head = 0;
+        w->tail = 0;
+        // the owner pops from the tail, so queue in reverse to run in order
+        for (int i = w->last - 1; i >= w->first; i--)
+            w->tasks[w->tail++] = i;
+        pthread_mutex_unlock(&w->lock);
+    }
+    pthread_mutex_lock(&batch->lock);
+    batch->active = batch->threads;
+    batch->job = job;
+    batch->round++;
+    pthread_cond_broadcast(&batch->start);
+    while (batch->active)
+        pthread_cond_wait(&batch->done, &batch->lock);
+    pthread_mutex_unlock(&batch->lock);
+}
+
+static void stop_workers(struct batch *batch, int started)
+{
+    pthread_mutex_lock(&batch->lock);
+    batch->job = BATCH_STOP;
+    batch->round++;
+    pthread_cond_broadcast(&batch->start);
+    pthread_mutex_unlock(&batch->lock);
+    for (int t = 0; t < started; t++)
+        pthread_join(batch->workers[t].thread, NULL);
+}
+
+/*
+ * count instances of rom, started as after the boot ROM, run by threads
+ * workers, 0 for one per online CPU. config may be NULL for the defaults.
+ */
+struct batch *batch_create(struct rom_image *rom, int count, int threads, cpu_backend_t backend,
+                           const struct gb_config *config)
+{
+    struct batch *batch;
+    int started = 0;
+
+    if (count < 1) {
+        printf("[ERROR] A batch needs at least one instance\n");
+        return NULL;
+    }
+    if (threads < 1)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1)
+        threads = 1;
+    if (threads > count)
+        threads = count;
+
+    batch = calloc(1, sizeof(struct batch));
+    if (!batch) {
+        printf("[ERROR] Can't allocate the batch\n");
+        return NULL;
+    }
+    batch->count = count;
+    batch->threads = threads;
+    batch->backend = backend;
+    if (config)
+        batch->config = *config;
+    batch->slots = aligned_alloc(CACHE_LINE, count * sizeof(struct batch_slot));
+    batch->workers = aligned_alloc(CACHE_LINE, threads * sizeof(struct batch_worker));
+    if (!batch->slots || !batch->workers) {
+        printf("[ERROR] Can't allocate the batch\n");
+        free(batch->slots);
+        free(batch->workers);
+        free(batch);
+        return NULL;
+    }
+    batch->pool = gb_pool_create(count);
+    if (!batch->pool) {
+        free(batch->slots);
+        free(batch->workers);
+        free(batch);
+        return NULL;
+    }
+    memset(batch->slots, 0, count * sizeof(struct batch_slot));
+    memset(batch->workers, 0, threads * sizeof(struct batch_worker));
+    pthread_mutex_init(&batch->lock, NULL);
+    pthread_cond_init(&batch->start, NULL);
+    pthread_cond_init(&batch->done, NULL);
+
+    for (int t = 0; t < threads; t++) {
+        struct batch_worker *w = &batch->workers[t];
+
+        pthread_mutex_init(&w->lock, NULL);
+        w->batch = batch;
+        w->first = (int64_t)count * t / threads;
+        w->last = (int64_t)count * (t + 1) / threads;
+        w->tasks = malloc((w->last - w->first) * sizeof(int));
+        if (!w->tasks) {
+            printf("[ERROR] Can't allocate the batch\n");
+            break;
+        }
+        if (pthread_create(&w->thread, NULL, worker_main, w)) {
+            printf("[ERROR] Can't start batch thread %d\n", t);
+            free(w->tasks);
+            w->tasks = NULL;
+            break;
+        }
+        started++;
+    }
+    if (started < threads) {
+        stop_workers(batch, started);
+        batch->threads = started;
+        batch_destroy(batch);
+        return NULL;
+    }
+    // from here on batch_destroy() stops the workers
+    batch->rom = rom_retain(rom);
+    run_round(batch, BATCH_CREATE);
+    for (int i = 0; i < count; i++) {
+        if (!batch->slots[i].gb) {
+            batch_destroy(batch);
+            return NULL;
+        }
+    }
+    return batch;
+}
+
+void batch_destroy(struct batch *batch)
+{
+    if (!batch)
+        return;
+    if (batch->rom) {
+        stop_workers(batch, batch->threads);
+        for (int i = 0; i < batch->count; i++) {
+            if (batch->slots[i].gb)
+                gb_destroy(batch->slots[i].gb);
+        }
+        rom_release(batch->rom);
+    }
+    gb_pool_destroy(batch->pool);
+    for (int t = 0; t < batch->threads; t++) {
+        free(batch->workers[t].tasks);
+        pthread_mutex_destroy(&batch->workers[t].lock);
+    }
+    pthread_mutex_destroy(&batch->lock);
+    pthread_cond_destroy(&batch->start);
+    pthread_cond_destroy(&batch->done);
+    free(batch->slots);
+    free(batch->workers);
+    free(batch);
+}
+
+static uint64_t total_cycles(struct batch *batch)
+{
+    uint64_t cycles = 0;
+
+    for (int i = 0; i < batch->count; i++)
+        cycles += batch->slots[i].cycles;
+    return cycles;
+}
+
+// runs every instance for frames more frames, returns the frames run by all of them together
+uint64_t batch_run(struct batch *batch, uint64_t frames)
+{
+    uint64_t before = total_cycles(batch);
+
+    batch->frames = frames;
+    run_round(batch, BATCH_RUN);
+    return (total_cycles(batch) - before) / FRAME_CYCLES;
+}
+
+// not to be touched while batch_run() is going
+struct gb *batch_instance(struct batch *batch, int index)
+{
+    return index >= 0 && index < batch->count ? batch->slots[index].gb : NULL;
+}
@@ -0,0 +1,260 @@
+#include "block.h"
+#include "mmu.h"
+
+/* Opcode length in bytes; the CB prefix is accounted for in decode_block() */
+static const uint8_t op_length[256] = {
+    1, 3, 1, 1, 1, 1, 2, 1, 3, 1, 1, 1, 1, 1, 2, 1,
+    1, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1,
+    2, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1,
+    2, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 3, 3, 3, 1, 2, 1, 1, 1, 3, 1, 3, 3, 2, 1,
+    1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 1, 2, 1,
+    2, 1, 1, 1, 1, 1, 2, 1, 2, 1, 3, 1, 1, 1, 2, 1,
+    2, 1, 1, 1, 1, 1, 2, 1, 2, 1, 3, 1, 1, 1, 2, 1,
+};
+
+/* M-cycles with no branch taken; 0xcb is filled in from cb_op_cycles */
+static const uint8_t op_cycles[256] = {
+    1, 3, 2, 2, 1, 1, 2, 1, 5, 2, 2, 2, 1, 1, 2, 1,
+    1, 3, 2, 2, 1, 1, 2, 1, 3, 2, 2, 2, 1, 1, 2, 1,
+    2, 3, 2, 2, 1, 1, 2, 1, 2, 2, 2, 2, 1, 1, 2, 1,
+    2, 3, 2, 2, 3, 3, 3, 1, 2, 2, 2, 2, 1, 1, 2, 1,
+    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1,
+    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1,
+    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1,
+    2, 2, 2, 2, 2, 2, 1, 2, 1, 1, 1, 1, 1, 1, 2, 1,
+    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1,
+    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1,
+    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1,
+    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1,
+    2, 3, 3, 4, 3, 4, 2, 4, 2, 4, 3, 0, 3, 6, 2, 4,
+    2, 3, 3, 1, 3, 4, 2, 4, 2, 4, 3, 1, 3, 1, 2, 4,
+    3, 3, 2, 1, 1, 4, 2, 4, 4, 1, 4, 1, 1, 1, 2, 4,
+    3, 3, 2, 1, 1, 4, 2, 4, 3, 2, 4, 1, 1, 1, 2, 4,
+};
+
+static uint8_t cb_op_cycles(uint8_t opcode)
+{
+    if ((opcode & 0x07) != 0x06)
+        return 2;
+    return (opcode >= 0x40 && opcode < 0x80) ? 3 : 4;
+}
+
+/* Instructions after which control flow or interrupt state may change */
+static bool ends_block(uint8_t opcode)
+{
+    switch (opcode) {
+    case 0x10: case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+    case 0x76:
+    case 0xc0: case 0xc2: case 0xc3: case 0xc4: case 0xc7: case 0xc8:
+    case 0xc9: case 0xca: case 0xcc: case 0xcd: case 0xcf:
+    case 0xd0: case 0xd2: case 0xd4: case 0xd7: case 0xd8: case 0xd9:
+    case 0xda: case 0xdc: case 0xdf:
+    case 0xe7: case 0xe9: case 0xef:
+    case 0xf3: case 0xf7: case 0xfb: case 0xff:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static unsigned int slot_index(uint16_t bank, uint16_t pc)
+{
+    return (pc ^ (pc >> 10) ^ (bank * 0x9e5)) & (BLOCK_CACHE_SLOTS - 1);
+}
+
+static void unlink_block(struct block_cache *cache, struct block *block)
+{
+    int16_t idx = block - cache->slots;
+    int16_t *link = &cache->page_head[block->start >> 8];
+
+    block->valid = false;
+    while (*link != BLOCK_NONE) {
+        if (*link == idx) {
+            *link = block->page_next;
+            break;
+        }
+        link = &cache->slots[*link].page_next;
+    }
+}
+
+// address of the instruction following the one at pc
+uint16_t block_op_end(struct gb *gb, uint16_t pc)
+{
+    uint8_t opcode = mmu_read(gb, pc);
+
+    return pc + (opcode == 0xcb ? 2 : op_length[opcode]);
+}
+
+static void decode_block(struct gb *gb, struct block *block, uint16_t bank, uint16_t pc)
+{
+    uint32_t addr = pc;
+
+    block->bank = bank;
+    block->start = pc;
+    block->n_ops = 0;
+    block->cycles = 0;
+    block->host = NULL;
+    while (block->n_ops < gb->cpu.blocks->max_ops) {
+        struct micro_op *op = &block->ops[block->n_ops++];
+        uint8_t opcode = mmu_read(gb, addr);
+        uint32_t next;
+
+        if (opcode == 0xcb) {
+            uint8_t cb = mmu_read(gb, addr + 1);
+
+            op->fn = cpu_cb_ops[cb];
+            op->fetches = 2;
+            block->cycles += 1 + cb_op_cycles(cb);
+            next = addr + 2;
+        } else {
+            op->fn = cpu_ops[opcode];
+            op->fetches = 1;
+            block->cycles += op_cycles[opcode];
+            next = addr + op_length[opcode];
+        }
+        addr = next;
+        if (opcode != 0xcb && ends_block(opcode))
+            break;
+        // stop before an instruction that could run past the 256-byte page the
+        // block is filed under, so a write only has to check that page's list
+        if ((addr + 3) >> 8 != pc >> 8)
+            break;
+    }
+    block->end = addr;
+    block->valid = true;
+}
+
+struct block_cache *block_cache_create(void)
+{
+    struct block_cache *cache = malloc(sizeof(struct block_cache));
+
+    if (!cache) {
+        printf("[ERROR] Can't allocate the block cache\n");
+        return NULL;
+    }
+    block_cache_flush(cache);
+    return cache;
+}
+
+void block_cache_destroy(struct block_cache *cache)
+{
+    free(cache);
+}
+
+void block_cache_flush(struct block_cache *cache)
+{
+    for (int i = 0; i < BLOCK_CACHE_SLOTS; i++)
+        cache->slots[i].valid = false;
+    for (int i = 0; i < 256; i++)
+        cache->page_head[i] = BLOCK_NONE;
+    cache->max_ops = BLOCK_MAX_OPS;
+    cache->hits = cache->misses = cache->invalidations = 0;
+}
+
+// drop the blocks filed under page that overlap addr to addr + len - 1
+static void invalidate_page(struct gb *gb, uint8_t page, uint16_t addr, uint16_t len)
+{
+    struct block_cache *cache = gb->cpu.blocks;
+    int16_t idx = cache->page_head[page];
+
+    while (idx != BLOCK_NONE) {
+        struct block *block = &cache->slots[idx];
+
+        idx = block->page_next;
+        if ((uint16_t)(block->start - addr) < len ||
+            (uint16_t)(addr - block->start) < (uint16_t)(block->end - block->start)) {
+            unlink_block(cache, block);
+            cache->invalidations++;
+            gb->cpu.block_exit = true;
+        }
+    }
+}
+
+void block_invalidate(struct gb *gb, uint16_t addr)
+{
+    // a block's first instruction may spill a couple of bytes into the next page
+    invalidate_page(gb, addr >> 8, addr, 1);
+    invalidate_page(gb, (addr >> 8) - 1, addr, 1);
+}
+
+// all the blocks overlapping page, for when its whole contents are replaced
+void block_invalidate_page(struct gb *gb, uint8_t page)
+{
+    invalidate_page(gb, page, page << 8, 0x100);
+    invalidate_page(gb, page - 1, page << 8, 0x100);
+}
+
+// NULL when the opcode sits in the I/O registers, which can change between decode and fetch
+struct block *block_lookup(struct gb *gb, uint16_t pc)
+{
+    struct block_cache *cache = gb->cpu.blocks;
+    uint16_t bank = mmu_bank(gb, pc);
+    struct block *block = &cache->slots[slot_index(bank, pc)];
+
+    if (pc >= 0xfeff && pc < 0xff80)
+        return NULL;
+    if (block->valid && block->start == pc && block->bank == bank) {
+        cache->hits++;
+        return block;
+    }
+    cache->misses++;
+    if (block->valid)
+        unlink_block(cache, block);
+    decode_block(gb, block, bank, pc);
+    block->page_next = cache->page_head[pc >> 8];
+    cache->page_head[pc >> 8] = block - cache->slots;
+    // the first instruction may spill into the next page
+    mmu_trap_code(gb, pc >> 8);
+    mmu_trap_code(gb, (pc >> 8) + 1);
+    return block;
+}
+
+// interpret up to count instructions of block, returns how many ran
+uint64_t block_exec(struct gb *gb, struct block *block, uint64_t count)
+{
+    uint64_t n = 0;
+
+    gb->cpu.block_exit = false;
+    for (int i = 0; i < block->n_ops; i++) {
+        const struct micro_op *op = &block->ops[i];
+
+        gb->cpu.regs.pc += op->fetches;
+        cpu_cycle(gb);
+        if (op->fetches == 2)
+            cpu_cycle(gb);
+        op->fn(gb);
+        // stop early if the block rewrote itself, switched banks or the budget ran out
+        if (++n == count || !block->valid || gb->cpu.block_exit || gb->cpu.mode != NORMAL)
+            break;
+    }
+    return n;
+}
+
+// run a single instruction without going through the cache
+uint64_t block_step(struct gb *gb)
+{
+    cpu_cycle(gb);
+    cpu_ops[mmu_read(gb, gb->cpu.regs.pc++)](gb);
+    return 1;
+}
+
+uint64_t block_run(struct gb *gb, uint64_t count)
+{
+    uint64_t n = 0;
+
+    while (n < count && gb->cpu.mode == NORMAL) {
+        struct block *block = block_lookup(gb, gb->cpu.regs.pc);
+
+        n += block ? block_exec(gb, block, count - n) : block_step(gb);
+    }
+    return n;
+}
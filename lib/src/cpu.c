@@ -1,6 +1,116 @@
 #include "cpu.h"
+#include "block.h"
+#include "jit.h"
+#include "sched.h"
+#include "idle.h"
+
+/*
+ * Lazy flags: ALU helpers only record the operation, its operands and its
+ * result in gb->cpu.flags. Z/N/H/C are worked out when something reads them,
+ * and regs.f is brought up to date before cpu_run()/cpu_step() return.
+ * Without LAZY_FLAGS the same recorders materialise F straight away.
+ */
+static void flags_materialize(struct gb *gb)
+{
+    struct lazy_flags *lf = &gb->cpu.flags;
+    uint8_t z = ((uint8_t)lf->result == 0) ? FLAG_Z : 0;
+    uint8_t f;
+
+    switch (lf->op) {
+    case FLAGS_ADD:
+        f = z | ((((lf->x & 0xf) + (lf->y & 0xf) + lf->carry) & 0x10) ? FLAG_H : 0) |
+                        ((lf->result & 0x100) ? FLAG_C : 0);
+        break;
+    case FLAGS_SUB:
+        f = z | FLAG_N | ((((lf->x & 0xf) - (lf->y & 0xf) - lf->carry) & 0x10) ? FLAG_H : 0) |
+                        ((lf->result & 0x100) ? FLAG_C : 0);
+        break;
+    case FLAGS_AND:
+        f = z | FLAG_H;
+        break;
+    case FLAGS_LOGIC:
+        f = z;
+        break;
+    case FLAGS_INC:
+        f = z | (((lf->x & 0xf) == 0xf) ? FLAG_H : 0) | lf->carry;
+        break;
+    case FLAGS_DEC:
+        f = z | FLAG_N | (((lf->x & 0xf) == 0x0) ? FLAG_H : 0) | lf->carry;
+        break;
+    case FLAGS_ADD16:
+        f = lf->carry | ((((lf->x & 0xfff) + (lf->y & 0xfff)) & 0x1000) ? FLAG_H : 0) |
+                        ((lf->result & 0x10000) ? FLAG_C : 0);
+        break;
+    case FLAGS_SHIFT:
+        f = z | lf->carry;
+        break;
+    case FLAGS_BIT:
+        f = z | FLAG_H | lf->carry;
+        break;
+    default:
+        return;
+    }
+    gb->cpu.regs.f = f;
+    lf->op = FLAGS_NONE;
+}
+
+/*
+ * carry: carry-in for ADD/SUB, the preserved FLAG_C for INC/DEC/BIT, the new
+ * FLAG_C for SHIFT and the preserved FLAG_Z for ADD16.
+ */
+static ALWAYS_INLINE void flags_record(struct gb *gb, cpu_flags_op_t op, uint16_t x, uint16_t y,
+                                       uint32_t result, uint8_t carry)
+{
+    gb->cpu.flags.op = op;
+    gb->cpu.flags.x = x;
+    gb->cpu.flags.y = y;
+    gb->cpu.flags.result = result;
+    gb->cpu.flags.carry = carry;
+#ifndef LAZY_FLAGS
+    flags_materialize(gb);
+#endif
+}
+
+static ALWAYS_INLINE uint8_t flag_c(struct gb *gb)
+{
+    struct lazy_flags *lf = &gb->cpu.flags;
+
+    switch (lf->op) {
+    case FLAGS_NONE:
+        return (gb->cpu.regs.f & FLAG_C) ? 0x01 : 0x00;
+    case FLAGS_ADD:
+    case FLAGS_SUB:
+        return (lf->result >> 8) & 0x01;
+    case FLAGS_ADD16:
+        return (lf->result >> 16) & 0x01;
+    case FLAGS_AND:
+    case FLAGS_LOGIC:
+        return 0x00;
+    default:
+        return lf->carry ? 0x01 : 0x00;
+    }
+}
+
+static ALWAYS_INLINE uint8_t flag_z(struct gb *gb)
+{
+    struct lazy_flags *lf = &gb->cpu.flags;
+
+    switch (lf->op) {
+    case FLAGS_NONE:
+        return (gb->cpu.regs.f & FLAG_Z) ? 0x01 : 0x00;
+    case FLAGS_ADD16:
+        return lf->carry ? 0x01 : 0x00;
+    default:
+        return (uint8_t)lf->result == 0;
+    }
+}
+
+void cpu_flush_flags(struct gb *gb)
+{
+    flags_materialize(gb);
+}
 
-static uint16_t get_r16(struct gb *gb, cpu_r16_t rr)
+static ALWAYS_INLINE uint16_t get_r16(struct gb *gb, cpu_r16_t rr)
 {
     uint16_t ret;
 
@@ -15,6 +125,7 @@ static uint16_t get_r16(struct gb *gb, cpu_r16_t rr)
         ret = TO_U16(gb->cpu.regs.l, gb->cpu.regs.h);
         break;
     case R16_AF:
+        flags_materialize(gb);
         ret = TO_U16(gb->cpu.regs.f, gb->cpu.regs.a);
         break;
     case R16_SP:
@@ -30,7 +141,7 @@ static uint16_t get_r16(struct gb *gb, cpu_r16_t rr)
     return ret;
 }
 
-static void set_r16(struct gb *gb, cpu_r16_t rr, uint16_t val)
+static ALWAYS_INLINE void set_r16(struct gb *gb, cpu_r16_t rr, uint16_t val)
 {
     switch (rr) {
     case R16_BC:
@@ -48,6 +159,7 @@ static void set_r16(struct gb *gb, cpu_r16_t rr, uint16_t val)
     case R16_AF:
         gb->cpu.regs.a = MSB(val);
         gb->cpu.regs.f = LSB(val) & 0xf0;
+        gb->cpu.flags.op = FLAGS_NONE;
         break;
     case R16_SP:
         gb->cpu.regs.sp = val;
@@ -60,7 +172,7 @@ static void set_r16(struct gb *gb, cpu_r16_t rr, uint16_t val)
     }
 }
 
-static uint8_t get_r8(struct gb *gb, cpu_r8_t r)
+static ALWAYS_INLINE uint8_t get_r8(struct gb *gb, cpu_r8_t r)
 {
     switch (r) {
     case R8_A:
@@ -74,6 +186,7 @@ static uint8_t get_r8(struct gb *gb, cpu_r8_t r)
     case R8_E:
         return gb->cpu.regs.e;
     case R8_F:
+        flags_materialize(gb);
         return gb->cpu.regs.f;
     case R8_H:
         return gb->cpu.regs.h;
@@ -85,7 +198,7 @@ static uint8_t get_r8(struct gb *gb, cpu_r8_t r)
     return 0xff;
 }
 
-static void set_r8(struct gb *gb, cpu_r8_t r, uint8_t val)
+static ALWAYS_INLINE void set_r8(struct gb *gb, cpu_r8_t r, uint8_t val)
 {
     switch (r) {
     case R8_A:
@@ -105,6 +218,7 @@ static void set_r8(struct gb *gb, cpu_r8_t r, uint8_t val)
         break;
     case R8_F:
         gb->cpu.regs.f = val;
+        gb->cpu.flags.op = FLAGS_NONE;
         break;
     case R8_H:
         gb->cpu.regs.h = val;
@@ -119,16 +233,23 @@ static void set_r8(struct gb *gb, cpu_r8_t r, uint8_t val)
 
 static uint8_t get_flag(struct gb *gb, cpu_flag_t flag)
 {
+    if (flag == FLAG_C)
+        return flag_c(gb);
+    if (flag == FLAG_Z)
+        return flag_z(gb);
+    flags_materialize(gb);
     return (gb->cpu.regs.f & flag) ? 0x01: 0x00;
 }
 
 static void set_flag(struct gb *gb, cpu_flag_t flag)
 {
+    flags_materialize(gb);
     gb->cpu.regs.f |= flag;
 }
 
 static void reset_flag(struct gb *gb, cpu_flag_t flag)
 {
+    flags_materialize(gb);
     gb->cpu.regs.f &= ~flag;
 }
 
@@ -140,26 +261,22 @@ static void toggle_flag(struct gb *gb, cpu_flag_t flag, bool val)
         reset_flag(gb, flag);
 }
 
-static int check_cond(struct gb *gb, cpu_cond_t cond)
+static ALWAYS_INLINE int check_cond(struct gb *gb, cpu_cond_t cond)
 {
     int ret = 0;
 
     switch (cond) {
     case COND_C:
-        if (gb->cpu.regs.f & FLAG_C)
-            ret = 1;
+        ret = flag_c(gb);
         break;
     case COND_NC:
-        if (!(gb->cpu.regs.f & FLAG_C))
-            ret = 1;
+        ret = !flag_c(gb);
         break;
     case COND_Z:
-        if (gb->cpu.regs.f & FLAG_Z)
-            ret = 1;
+        ret = flag_z(gb);
         break;
     case COND_NZ:
-        if (!(gb->cpu.regs.f & FLAG_Z))
-            ret = 1;
+        ret = !flag_z(gb);
         break;
     default:
         break;
@@ -167,24 +284,23 @@ static int check_cond(struct gb *gb, cpu_cond_t cond)
     return ret;
 }
 
-// TODO: complete this
-void tick(struct gb *gb)
+void cpu_cycle(struct gb *gb)
 {
-
+    sched_advance(gb, 4);
 }
 
-// TODO: complete this
-void cpu_cycle(struct gb *gb)
+void cpu_cycles(struct gb *gb, unsigned int n)
 {
+    sched_advance(gb, 4 * n);
 }
 
-static uint8_t cpu_read(struct gb *gb, uint16_t addr)
+static ALWAYS_INLINE uint8_t cpu_read(struct gb *gb, uint16_t addr)
 {
     cpu_cycle(gb);
     return mmu_read(gb, addr);
 }
 
-static void cpu_write(struct gb *gb, uint16_t addr, uint8_t val)
+static ALWAYS_INLINE void cpu_write(struct gb *gb, uint16_t addr, uint8_t val)
 {
     cpu_cycle(gb);
     mmu_write(gb, addr, val);
@@ -207,6 +323,84 @@ uint16_t stack_pop(struct gb *gb)
     return TO_U16(lsb, msb);
 }
 
+/**************/
+/**************/
+/* Interrupts */
+/**************/
+/**************/
+
+static ALWAYS_INLINE uint8_t interrupts_pending(struct gb *gb)
+{
+    return gb->mem[0xffff] & gb->mem[0xff0f] & 0x1f;
+}
+
+void cpu_request_interrupt(struct gb *gb, interrupt_t irq)
+{
+    gb->mem[0xff0f] |= irq;
+    cpu_check_interrupts(gb);
+}
+
+// call whenever IE, IF or IME change: stops the backends before the next instruction
+void cpu_check_interrupts(struct gb *gb)
+{
+    if (gb->cpu.mode == NORMAL && gb->cpu.ime && interrupts_pending(gb))
+        gb->cpu.mode = IME;
+}
+
+static void service_interrupt(struct gb *gb)
+{
+    uint8_t pending = interrupts_pending(gb);
+    int bit = 0;
+
+    gb->cpu.mode = NORMAL;
+    if (!gb->cpu.ime || !pending)
+        return;
+    while (!(pending & (1U << bit)))
+        bit++;
+    gb->cpu.ime = false;
+    cpu_cycles(gb, 2);
+    stack_push(gb, gb->cpu.regs.pc);
+    gb->mem[0xff0f] &= ~(1U << bit);
+    gb->cpu.regs.pc = 0x40 + bit * 8;
+    cpu_cycle(gb);
+}
+
+/*
+ * Nothing but an interrupt ends HALT, and only scheduled events raise
+ * interrupts, so a halted CPU skips straight to the next event, or to
+ * until if that comes first.
+ */
+static void halt_skip(struct gb *gb, uint64_t until)
+{
+    uint64_t next = gb->sched.next < until ? gb->sched.next : until;
+    uint64_t skip;
+
+    if (gb->sched.next == SCHED_NEVER || !(gb->mem[0xffff] & 0x1f))
+        return;
+    skip = (next - gb->sched.now + 3) & ~3ULL;
+    gb->cpu.halt_cycles += skip;
+    sched_advance(gb, skip);
+}
+
+/*
+ * Skips from event to event until an enabled interrupt is pending. Gives up
+ * when no event is left to raise one, or at until so that an enabled source
+ * which never fires can't keep the caller here for good.
+ */
+static bool halt_wait(struct gb *gb, uint64_t until)
+{
+    while (!interrupts_pending(gb)) {
+        uint64_t last = gb->sched.now;
+
+        if (last >= until)
+            return false;
+        halt_skip(gb, until);
+        if (gb->sched.now == last)
+            return false;
+    }
+    return true;
+}
+
 /***************************/
 /***************************/
 /* 8-bit Load Instructions */
@@ -280,7 +474,7 @@ static void ldh_r_a(struct gb *gb, cpu_r8_t r)
 {
     uint16_t addr = 0xff00 + get_r8(gb, r);
 
-    mmu_write(gb, addr, get_r8(gb, R8_A));
+    cpu_write(gb, addr, get_r8(gb, R8_A));
 }
 
 static void ld_r_indirect_hl(struct gb *gb, cpu_r8_t r)
@@ -295,7 +489,7 @@ static void ld_indirect_hl_r(struct gb *gb, cpu_r8_t r)
 {
     uint16_t hl = get_r16(gb, R16_HL);
 
-    mmu_write(gb, hl, get_r8(gb, r));
+    cpu_write(gb, hl, get_r8(gb, r));
 }
 
 static void ld_indirect_hl_n(struct gb *gb)
@@ -303,7 +497,7 @@ static void ld_indirect_hl_n(struct gb *gb)
     uint8_t n = cpu_read(gb, gb->cpu.regs.pc++);
     uint16_t hl = get_r16(gb, R16_HL);
 
-    mmu_write(gb, hl, n);
+    cpu_write(gb, hl, n);
 }
 
 static void ld_a_indirect_rr(struct gb *gb, cpu_r16_t rr)
@@ -317,7 +511,7 @@ static void ldh_n_a(struct gb *gb)
 {
     uint16_t addr = 0xff00 + cpu_read(gb, gb->cpu.regs.pc++);
 
-    mmu_write(gb, addr, get_r8(gb, R8_A));
+    cpu_write(gb, addr, get_r8(gb, R8_A));
 }
 
 static void ldh_a_n(struct gb *gb)
@@ -389,9 +583,7 @@ static void inc_r(struct gb *gb, cpu_r8_t r)
     uint8_t r_val = get_r8(gb, r);
 
     set_r8(gb, r, r_val + 1);
-    toggle_flag(gb, FLAG_Z, (uint8_t)(r_val + 1) == 0x00);
-    reset_flag(gb, FLAG_N);
-    toggle_flag(gb, FLAG_H, ((r_val & 0xf) + (1 & 0xf)) & 0x10);
+    flags_record(gb, FLAGS_INC, r_val, 1, (uint8_t)(r_val + 1), flag_c(gb) ? FLAG_C : 0);
 }
 
 static void dec_r(struct gb *gb, cpu_r8_t r)
@@ -399,9 +591,7 @@ static void dec_r(struct gb *gb, cpu_r8_t r)
     uint8_t r_val = get_r8(gb, r);
 
     set_r8(gb, r, r_val - 1);
-    toggle_flag(gb, FLAG_Z, (uint8_t)(r_val - 1) == 0x00);
-    set_flag(gb, FLAG_N);
-    toggle_flag(gb, FLAG_H, ((r_val & 0xf) - (1 & 0xf)) & 0x10);
+    flags_record(gb, FLAGS_DEC, r_val, 1, (uint8_t)(r_val - 1), flag_c(gb) ? FLAG_C : 0);
 }
 
 static void add_a_r(struct gb *gb, cpu_r8_t r)
@@ -410,10 +600,7 @@ static void add_a_r(struct gb *gb, cpu_r8_t r)
     uint8_t a = get_r8(gb, R8_A);
 
     set_r8(gb, R8_A, a + r_val);
-    toggle_flag(gb, FLAG_Z, (uint8_t)(a + r_val) == 0x00);
-    reset_flag(gb, FLAG_N);
-    toggle_flag(gb, FLAG_H, ((a & 0xf) + (r_val & 0xf)) & 0x10);
-    toggle_flag(gb, FLAG_C, ((a & 0xff) + (r_val & 0xff)) & 0x100);
+    flags_record(gb, FLAGS_ADD, a, r_val, (uint32_t)a + r_val, 0);
 }
 
 static void add_a_n(struct gb *gb)
@@ -422,10 +609,7 @@ static void add_a_n(struct gb *gb)
     uint8_t a = get_r8(gb, R8_A);
 
     set_r8(gb, R8_A, a + n);
-    toggle_flag(gb, FLAG_Z, (uint8_t)(a + n) == 0x00);
-    reset_flag(gb, FLAG_N);
-    toggle_flag(gb, FLAG_H, ((a & 0xf) + (n & 0xf)) & 0x10);
-    toggle_flag(gb, FLAG_C, ((a & 0xff) + (n & 0xff)) & 0x100);
+    flags_record(gb, FLAGS_ADD, a, n, (uint32_t)a + n, 0);
 }
 
 static void add_a_indirect_hl(struct gb *gb)
@@ -435,36 +619,27 @@ static void add_a_indirect_hl(struct gb *gb)
     uint8_t a = gb->cpu.regs.a;
 
     set_r8(gb, R8_A, a + hl_val);
-    toggle_flag(gb, FLAG_Z, (uint8_t)(a + hl_val) == 0x00);
-    reset_flag(gb, FLAG_N);
-    toggle_flag(gb, FLAG_H, ((a & 0xf) + (hl_val & 0xf)) & 0x10);
-    toggle_flag(gb, FLAG_C, ((a & 0xff) + (hl_val & 0xff)) & 0x100);
+    flags_record(gb, FLAGS_ADD, a, hl_val, (uint32_t)a + hl_val, 0);
 }
 
 static void adc_a_r(struct gb *gb, cpu_r8_t r)
 {
     uint8_t r_val = get_r8(gb, r);
     uint8_t a = get_r8(gb, R8_A);
-    uint8_t old_c = get_flag(gb, FLAG_C);
+    uint8_t old_c = flag_c(gb);
 
     set_r8(gb, R8_A, a + r_val + old_c);
-    toggle_flag(gb, FLAG_Z, (uint8_t)(a + r_val + old_c) == 0x00);
-    reset_flag(gb, FLAG_N);
-    toggle_flag(gb, FLAG_H, ((a & 0xf) + (r_val & 0xf) + (old_c & 0xf)) & 0x10);
-    toggle_flag(gb, FLAG_C, ((a & 0xff) + (r_val & 0xff) + (old_c & 0xff)) & 0x100);
+    flags_record(gb, FLAGS_ADD, a, r_val, (uint32_t)a + r_val + old_c, old_c);
 }
 
 static void adc_a_n(struct gb *gb)
 {
     uint8_t n = cpu_read(gb, gb->cpu.regs.pc++);
     uint8_t a = get_r8(gb, R8_A);
-    uint8_t old_c = get_flag(gb, FLAG_C);
+    uint8_t old_c = flag_c(gb);
 
     set_r8(gb, R8_A, a + n + old_c);
-    toggle_flag(gb, FLAG_Z, (uint8_t)(a + n + old_c) == 0x00);
-    reset_flag(gb, FLAG_N);
-    toggle_flag(gb, FLAG_H, ((a & 0xf) + (n & 0xf) + (old_c & 0xf)) & 0x10);
-    toggle_flag(gb, FLAG_C, ((a & 0xff) + (n & 0xff) + (old_c & 0xff)) & 0x100);
+    flags_record(gb, FLAGS_ADD, a, n, (uint32_t)a + n + old_c, old_c);
 }
 
 static void adc_a_indirect_hl(struct gb *gb)
@@ -472,13 +647,10 @@ static void adc_a_indirect_hl(struct gb *gb)
     uint16_t hl = get_r16(gb, R16_HL);
     uint8_t hl_val = cpu_read(gb, hl);
     uint8_t a = gb->cpu.regs.a;
-    uint8_t old_c = get_flag(gb, FLAG_C);
+    uint8_t old_c = flag_c(gb);
 
     set_r8(gb, R8_A, a + hl_val + old_c);
-    toggle_flag(gb, FLAG_Z, (uint8_t)(a + hl_val + old_c) == 0x00);
-    reset_flag(gb, FLAG_N);
-    toggle_flag(gb, FLAG_H, ((a & 0xf) + (hl_val & 0xf) + (old_c & 0xf)) & 0x10);
-    toggle_flag(gb, FLAG_C, ((a & 0xff) + (hl_val & 0xff) + (old_c & 0xff)) & 0x100);
+    flags_record(gb, FLAGS_ADD, a, hl_val, (uint32_t)a + hl_val + old_c, old_c);
 }
 
 static void sub_a_r(struct gb *gb, cpu_r8_t r)
@@ -487,10 +659,7 @@ static void sub_a_r(struct gb *gb, cpu_r8_t r)
     uint8_t a = get_r8(gb, R8_A);
 
     set_r8(gb, R8_A, a - r_val);
-    toggle_flag(gb, FLAG_Z, (uint8_t)(a - r_val) == 0x00);
-    set_flag(gb, FLAG_N);
-    toggle_flag(gb, FLAG_H, ((a & 0xf) - (r_val & 0xf)) & 0x10);
-    toggle_flag(gb, FLAG_C, ((a & 0xff) - (r_val & 0xff)) & 0x100);
+    flags_record(gb, FLAGS_SUB, a, r_val, (uint32_t)a - r_val, 0);
 }
 
 static void sub_a_n(struct gb *gb)
@@ -499,10 +668,7 @@ static void sub_a_n(struct gb *gb)
     uint8_t a = get_r8(gb, R8_A);
 
     set_r8(gb, R8_A, a - n);
-    toggle_flag(gb, FLAG_Z, (uint8_t)(a - n) == 0x00);
-    set_flag(gb, FLAG_N);
-    toggle_flag(gb, FLAG_H, ((a & 0xf) - (n & 0xf)) & 0x10);
-    toggle_flag(gb, FLAG_C, ((a & 0xff) - (n & 0xff)) & 0x100);
+    flags_record(gb, FLAGS_SUB, a, n, (uint32_t)a - n, 0);
 }
 
 static void sub_a_indirect_hl(struct gb *gb)
@@ -512,36 +678,27 @@ static void sub_a_indirect_hl(struct gb *gb)
     uint8_t a = gb->cpu.regs.a;
 
     set_r8(gb, R8_A, a - hl_val);
-    toggle_flag(gb, FLAG_Z, (uint8_t)(a - hl_val) == 0x00);
-    set_flag(gb, FLAG_N);
-    toggle_flag(gb, FLAG_H, ((a & 0xf) - (hl_val & 0xf)) & 0x10);
-    toggle_flag(gb, FLAG_C, ((a & 0xff) - (hl_val & 0xff)) & 0x100);
+    flags_record(gb, FLAGS_SUB, a, hl_val, (uint32_t)a - hl_val, 0);
 }
 
 static void sbc_a_r(struct gb *gb, cpu_r8_t r)
 {
     uint8_t r_val = get_r8(gb, r);
     uint8_t a = get_r8(gb, R8_A);
-    uint8_t old_c = get_flag(gb, FLAG_C);
+    uint8_t old_c = flag_c(gb);
 
     set_r8(gb, R8_A, a - r_val - old_c);
-    toggle_flag(gb, FLAG_Z, (uint8_t)(a - r_val - old_c) == 0x00);
-    set_flag(gb, FLAG_N);
-    toggle_flag(gb, FLAG_H, ((a & 0xf) - (r_val & 0xf) - (old_c & 0xf)) & 0x10);
-    toggle_flag(gb, FLAG_C, ((a & 0xff) - (r_val & 0xff) - (old_c & 0xff)) & 0x100);
+    flags_record(gb, FLAGS_SUB, a, r_val, (uint32_t)a - r_val - old_c, old_c);
 }
 
 static void sbc_a_n(struct gb *gb)
 {
     uint8_t n = cpu_read(gb, gb->cpu.regs.pc++);
     uint8_t a = get_r8(gb, R8_A);
-    uint8_t old_c = get_flag(gb, FLAG_C);
+    uint8_t old_c = flag_c(gb);
 
     set_r8(gb, R8_A, a - n - old_c);
-    toggle_flag(gb, FLAG_Z, (uint8_t)(a - n - old_c) == 0x00);
-    set_flag(gb, FLAG_N);
-    toggle_flag(gb, FLAG_H, ((a & 0xf) - (n & 0xf) - (old_c & 0xf)) & 0x10);
-    toggle_flag(gb, FLAG_C, ((a & 0xff) - (n & 0xff) - (old_c & 0xff)) & 0x100);
+    flags_record(gb, FLAGS_SUB, a, n, (uint32_t)a - n - old_c, old_c);
 }
 
 static void sbc_a_indirect_hl(struct gb *gb)
@@ -549,13 +706,10 @@ static void sbc_a_indirect_hl(struct gb *gb)
     uint16_t hl = get_r16(gb, R16_HL);
     uint8_t hl_val = cpu_read(gb, hl);
     uint8_t a = gb->cpu.regs.a;
-    uint8_t old_c = get_flag(gb, FLAG_C);
+    uint8_t old_c = flag_c(gb);
 
     set_r8(gb, R8_A, a - hl_val - old_c);
-    toggle_flag(gb, FLAG_Z, (uint8_t)(a - hl_val - old_c) == 0x00);
-    set_flag(gb, FLAG_N);
-    toggle_flag(gb, FLAG_H, ((a & 0xf) - (hl_val & 0xf) - (old_c & 0xf)) & 0x10);
-    toggle_flag(gb, FLAG_C, ((a & 0xff) - (hl_val & 0xff) - (old_c & 0xff)) & 0x100);
+    flags_record(gb, FLAGS_SUB, a, hl_val, (uint32_t)a - hl_val - old_c, old_c);
 }
 
 static void and_a_r(struct gb *gb, cpu_r8_t r)
@@ -564,10 +718,7 @@ static void and_a_r(struct gb *gb, cpu_r8_t r)
     uint8_t a = get_r8(gb, R8_A);
 
     set_r8(gb, R8_A, a & r_val);
-    toggle_flag(gb, FLAG_Z, (uint8_t)(a & r_val) == 0x00);
-    reset_flag(gb, FLAG_N);
-    set_flag(gb, FLAG_H);
-    reset_flag(gb, FLAG_C);
+    flags_record(gb, FLAGS_AND, a, r_val, a & r_val, 0);
 }
 
 static void and_a_n(struct gb *gb)
@@ -576,10 +727,7 @@ static void and_a_n(struct gb *gb)
     uint8_t a = get_r8(gb, R8_A);
 
     set_r8(gb, R8_A, a & n);
-    toggle_flag(gb, FLAG_Z, (uint8_t)(a & n) == 0x00);
-    reset_flag(gb, FLAG_N);
-    set_flag(gb, FLAG_H);
-    reset_flag(gb, FLAG_C);
+    flags_record(gb, FLAGS_AND, a, n, a & n, 0);
 }
 
 static void and_a_indirect_hl(struct gb *gb)
@@ -589,10 +737,7 @@ static void and_a_indirect_hl(struct gb *gb)
     uint8_t a = gb->cpu.regs.a;
 
     set_r8(gb, R8_A, a & hl_val);
-    toggle_flag(gb, FLAG_Z, (uint8_t)(a & hl_val) == 0x00);
-    reset_flag(gb, FLAG_N);
-    set_flag(gb, FLAG_H);
-    reset_flag(gb, FLAG_C);
+    flags_record(gb, FLAGS_AND, a, hl_val, a & hl_val, 0);
 }
 
 static void xor_a_r(struct gb *gb, cpu_r8_t r)
@@ -601,10 +746,7 @@ static void xor_a_r(struct gb *gb, cpu_r8_t r)
     uint8_t a = get_r8(gb, R8_A);
 
     set_r8(gb, R8_A, a ^ r_val);
-    toggle_flag(gb, FLAG_Z, (uint8_t)(a ^ r_val) == 0x00);
-    reset_flag(gb, FLAG_N);
-    reset_flag(gb, FLAG_H);
-    reset_flag(gb, FLAG_C);
+    flags_record(gb, FLAGS_LOGIC, a, r_val, a ^ r_val, 0);
 }
 
 static void xor_a_n(struct gb *gb)
@@ -613,10 +755,7 @@ static void xor_a_n(struct gb *gb)
     uint8_t a = get_r8(gb, R8_A);
 
     set_r8(gb, R8_A, a ^ n);
-    toggle_flag(gb, FLAG_Z, (uint8_t)(a ^ n) == 0x00);
-    reset_flag(gb, FLAG_N);
-    reset_flag(gb, FLAG_H);
-    reset_flag(gb, FLAG_C);
+    flags_record(gb, FLAGS_LOGIC, a, n, a ^ n, 0);
 }
 
 static void xor_a_indirect_hl(struct gb *gb)
@@ -626,10 +765,7 @@ static void xor_a_indirect_hl(struct gb *gb)
     uint8_t a = gb->cpu.regs.a;
 
     set_r8(gb, R8_A, a ^ hl_val);
-    toggle_flag(gb, FLAG_Z, (uint8_t)(a ^ hl_val) == 0x00);
-    reset_flag(gb, FLAG_N);
-    reset_flag(gb, FLAG_H);
-    reset_flag(gb, FLAG_C);
+    flags_record(gb, FLAGS_LOGIC, a, hl_val, a ^ hl_val, 0);
 }
 
 static void or_a_r(struct gb *gb, cpu_r8_t r)
@@ -638,10 +774,7 @@ static void or_a_r(struct gb *gb, cpu_r8_t r)
     uint8_t a = get_r8(gb, R8_A);
 
     set_r8(gb, R8_A, a | r_val);
-    toggle_flag(gb, FLAG_Z, (uint8_t)(a | r_val) == 0x00);
-    reset_flag(gb, FLAG_N);
-    reset_flag(gb, FLAG_H);
-    reset_flag(gb, FLAG_C);
+    flags_record(gb, FLAGS_LOGIC, a, r_val, a | r_val, 0);
 }
 
 static void or_a_n(struct gb *gb)
@@ -650,10 +783,7 @@ static void or_a_n(struct gb *gb)
     uint8_t a = get_r8(gb, R8_A);
 
     set_r8(gb, R8_A, a | n);
-    toggle_flag(gb, FLAG_Z, (uint8_t)(a | n) == 0x00);
-    reset_flag(gb, FLAG_N);
-    reset_flag(gb, FLAG_H);
-    reset_flag(gb, FLAG_C);
+    flags_record(gb, FLAGS_LOGIC, a, n, a | n, 0);
 }
 
 static void or_a_indirect_hl(struct gb *gb)
@@ -663,10 +793,7 @@ static void or_a_indirect_hl(struct gb *gb)
     uint8_t a = gb->cpu.regs.a;
 
     set_r8(gb, R8_A, a | hl_val);
-    toggle_flag(gb, FLAG_Z, (uint8_t)(a | hl_val) == 0x00);
-    reset_flag(gb, FLAG_N);
-    reset_flag(gb, FLAG_H);
-    reset_flag(gb, FLAG_C);
+    flags_record(gb, FLAGS_LOGIC, a, hl_val, a | hl_val, 0);
 }
 
 static void cp_a_r(struct gb *gb, cpu_r8_t r)
@@ -674,10 +801,7 @@ static void cp_a_r(struct gb *gb, cpu_r8_t r)
     uint8_t r_val = get_r8(gb, r);
     uint8_t a = get_r8(gb, R8_A);
 
-    toggle_flag(gb, FLAG_Z, (uint8_t)(a - r_val) == 0x00);
-    set_flag(gb, FLAG_N);
-    toggle_flag(gb, FLAG_H, ((a & 0xf) - (r_val & 0xf)) & 0x10);
-    toggle_flag(gb, FLAG_C, ((a & 0xff) - (r_val & 0xff)) & 0x100);
+    flags_record(gb, FLAGS_SUB, a, r_val, (uint32_t)a - r_val, 0);
 }
 
 static void cp_a_n(struct gb *gb)
@@ -685,10 +809,7 @@ static void cp_a_n(struct gb *gb)
     uint8_t n = cpu_read(gb, gb->cpu.regs.pc++);
     uint8_t a = get_r8(gb, R8_A);
 
-    toggle_flag(gb, FLAG_Z, (uint8_t)(a - n) == 0x00);
-    set_flag(gb, FLAG_N);
-    toggle_flag(gb, FLAG_H,  ((a & 0xf) - (n & 0xf)) & 0x10);
-    toggle_flag(gb, FLAG_C, ((a & 0xff) - (n & 0xff)) & 0x100);
+    flags_record(gb, FLAGS_SUB, a, n, (uint32_t)a - n, 0);
 }
 
 static void cp_a_indirect_hl(struct gb *gb)
@@ -697,10 +818,7 @@ static void cp_a_indirect_hl(struct gb *gb)
     uint8_t hl_val = cpu_read(gb, hl);
     uint8_t a = gb->cpu.regs.a;
 
-    toggle_flag(gb, FLAG_Z, (uint8_t)(a - hl_val) == 0x00);
-    set_flag(gb, FLAG_N);
-    toggle_flag(gb, FLAG_H, ((a & 0xf) - (hl_val & 0xf)) & 0x10);
-    toggle_flag(gb, FLAG_C, ((a & 0xff) - (hl_val & 0xff)) & 0x100);
+    flags_record(gb, FLAGS_SUB, a, hl_val, (uint32_t)a - hl_val, 0);
 }
 
 static void inc_indirect_hl(struct gb *gb)
@@ -710,9 +828,7 @@ static void inc_indirect_hl(struct gb *gb)
 
     cpu_cycle(gb);
     cpu_write(gb, hl, hl_val + 1);
-    toggle_flag(gb, FLAG_Z, (uint8_t)(hl_val + 1) == 0x00);
-    reset_flag(gb, FLAG_N);
-    toggle_flag(gb, FLAG_H, ((hl_val & 0xf) + (1 & 0xf)) & 0x10);
+    flags_record(gb, FLAGS_INC, hl_val, 1, (uint8_t)(hl_val + 1), flag_c(gb) ? FLAG_C : 0);
 }
 
 static void dec_indirect_hl(struct gb *gb)
@@ -722,15 +838,14 @@ static void dec_indirect_hl(struct gb *gb)
 
     cpu_cycle(gb);
     cpu_write(gb, hl, hl_val - 1);
-    toggle_flag(gb, FLAG_Z, (uint8_t)(hl_val - 1) == 0x00);
-    set_flag(gb, FLAG_N);
-    toggle_flag(gb, FLAG_H, ((hl_val & 0xf) - (1 & 0xf)) & 0x10);
+    flags_record(gb, FLAGS_DEC, hl_val, 1, (uint8_t)(hl_val - 1), flag_c(gb) ? FLAG_C : 0);
 }
 
 static void daa(struct gb *gb)
 {
     uint8_t a = gb->cpu.regs.a;
 
+    flags_materialize(gb);
     if (!(gb->cpu.regs.f & FLAG_N)) {  // after an addition, adjust if (half-)carry occurred or if result is out of bounds
         if ((gb->cpu.regs.f & FLAG_C) || a > 0x99) { a += 0x60; gb->cpu.regs.f |= FLAG_C; }
         if ((gb->cpu.regs.f & FLAG_H) || (a & 0x0f) > 0x09) { a += 0x6; }
@@ -789,9 +904,7 @@ static void add_hl_rr(struct gb *gb, cpu_r16_t rr)
     uint32_t rr_val = get_r16(gb, rr);
 
     set_r16(gb, R16_HL, hl_val + rr_val);
-    reset_flag(gb, FLAG_N);
-    toggle_flag(gb, FLAG_H, ((hl_val & 0xfff) + (rr_val & 0xfff)) & 0x1000);
-    toggle_flag(gb, FLAG_C, ((hl_val & 0xffff) + (rr_val & 0xffff)) & 0x10000);
+    flags_record(gb, FLAGS_ADD16, hl_val, rr_val, hl_val + rr_val, flag_z(gb) ? FLAG_Z : 0);
 }
 
 static void inc_rr(struct gb *gb, cpu_r16_t rr)
@@ -816,18 +929,14 @@ static void dec_rr(struct gb *gb, cpu_r16_t rr)
 
 static void bit_n_r(struct gb *gb, uint8_t n, cpu_r8_t r)
 {
-    toggle_flag(gb, FLAG_Z, (get_r8(gb, r) & (1U << n)) == 0x00);
-    reset_flag(gb, FLAG_N);
-    set_flag(gb, FLAG_H);
+    flags_record(gb, FLAGS_BIT, 0, 0, get_r8(gb, r) & (1U << n), flag_c(gb) ? FLAG_C : 0);
 }
 
 static void bit_n_indirect_hl(struct gb *gb, uint8_t n)
 {
     uint8_t hl_val = cpu_read(gb, get_r16(gb, R16_HL));
 
-    toggle_flag(gb, FLAG_Z, (hl_val & (1U << n)) == 0x00);
-    reset_flag(gb, FLAG_N);
-    set_flag(gb, FLAG_H);
+    flags_record(gb, FLAGS_BIT, 0, 0, hl_val & (1U << n), flag_c(gb) ? FLAG_C : 0);
 }
 
 static void set_n_r(struct gb *gb, uint8_t n, cpu_r8_t r)
@@ -871,7 +980,8 @@ static void reti(struct gb *gb)
     uint16_t pc = stack_pop(gb);
     cpu_cycle(gb);
     gb->cpu.regs.pc = pc;
-    // TODO: set ime = 1 here
+    gb->cpu.ime = true;
+    cpu_check_interrupts(gb);
 }
 
 static void rst_n(struct gb *gb, uint16_t addr)
@@ -903,42 +1013,57 @@ static void jp_hl(struct gb *gb)
     gb->cpu.regs.pc = hl;
 }
 
+// a taken backward jump may close an idle loop, end is the address after the jump
+static ALWAYS_INLINE void branch_taken(struct gb *gb, uint16_t end)
+{
+    if ((uint16_t)(end - gb->cpu.regs.pc - 1) < IDLE_MAX_LEN && gb->idle.enabled)
+        idle_check(gb, end);
+}
+
 static void jp_nn(struct gb *gb)
 {
     uint8_t lsb = cpu_read(gb, gb->cpu.regs.pc++);
     uint8_t msb = cpu_read(gb, gb->cpu.regs.pc++);
+    uint16_t end = gb->cpu.regs.pc;
 
     cpu_cycle(gb);
     gb->cpu.regs.pc = TO_U16(lsb, msb);
+    branch_taken(gb, end);
 }
 
 static void jp_f_nn(struct gb *gb, cpu_cond_t cond)
 {
     uint8_t lsb = cpu_read(gb, gb->cpu.regs.pc++);
     uint8_t msb = cpu_read(gb, gb->cpu.regs.pc++);
+    uint16_t end = gb->cpu.regs.pc;
 
     if (check_cond(gb, cond)) {
         cpu_cycle(gb);
         gb->cpu.regs.pc = TO_U16(lsb, msb);
+        branch_taken(gb, end);
     }
 }
 
 static void jr_f_i8(struct gb *gb, cpu_cond_t cond)
 {
     uint8_t i8 = cpu_read(gb, gb->cpu.regs.pc++);
+    uint16_t end = gb->cpu.regs.pc;
 
     if (check_cond(gb, cond)) {
         cpu_cycle(gb);
         gb->cpu.regs.pc += (int8_t)i8;
+        branch_taken(gb, end);
     }
 }
 
 static void jr_i8(struct gb *gb)
 {
     uint8_t i8 = cpu_read(gb, gb->cpu.regs.pc++);
+    uint16_t end = gb->cpu.regs.pc;
 
     cpu_cycle(gb);
     gb->cpu.regs.pc += (int8_t)i8;
+    branch_taken(gb, end);
 }
 
 static void call_nn(struct gb *gb)
@@ -997,10 +1122,7 @@ static void rlc_r(struct gb *gb, cpu_r8_t r)
     uint8_t new_c = (r_val & 0x80) >> 7;
 
     set_r8(gb, r, (r_val << 1) | new_c);
-    toggle_flag(gb, FLAG_Z, get_r8(gb, r) == 0x00);
-    reset_flag(gb, FLAG_N);
-    reset_flag(gb, FLAG_H);
-    toggle_flag(gb, FLAG_C, new_c);
+    flags_record(gb, FLAGS_SHIFT, 0, 0, (uint8_t)((r_val << 1) | new_c), new_c ? FLAG_C : 0);
 }
 
 static void rlc_indirect_hl(struct gb *gb)
@@ -1010,10 +1132,7 @@ static void rlc_indirect_hl(struct gb *gb)
     uint8_t new_c = (hl_val & 0x80) >> 7;
 
     cpu_write(gb, hl, (hl_val << 1) | new_c);
-    toggle_flag(gb, FLAG_Z, (uint8_t)((hl_val << 1) | new_c) == 0x00);
-    reset_flag(gb, FLAG_N);
-    reset_flag(gb, FLAG_H);
-    toggle_flag(gb, FLAG_C, new_c);
+    flags_record(gb, FLAGS_SHIFT, 0, 0, (uint8_t)((hl_val << 1) | new_c), new_c ? FLAG_C : 0);
 }
 
 static void rrc_r(struct gb *gb, cpu_r8_t r)
@@ -1022,10 +1141,7 @@ static void rrc_r(struct gb *gb, cpu_r8_t r)
     uint8_t new_c = (r_val & 0x01) << 7;
 
     set_r8(gb, r, (r_val >> 1) | new_c);
-    toggle_flag(gb, FLAG_Z, get_r8(gb, r) == 0x00);
-    reset_flag(gb, FLAG_N);
-    reset_flag(gb, FLAG_H);
-    toggle_flag(gb, FLAG_C, new_c);
+    flags_record(gb, FLAGS_SHIFT, 0, 0, (r_val >> 1) | new_c, new_c ? FLAG_C : 0);
 }
 
 static void rrc_indirect_hl(struct gb *gb)
@@ -1035,64 +1151,45 @@ static void rrc_indirect_hl(struct gb *gb)
     uint8_t new_c = (hl_val & 0x01) << 7;
 
     cpu_write(gb, hl, (hl_val >> 1) | new_c);
-    toggle_flag(gb, FLAG_Z, (uint8_t)((hl_val >> 1) | new_c) == 0x00);
-    reset_flag(gb, FLAG_N);
-    reset_flag(gb, FLAG_H);
-    toggle_flag(gb, FLAG_C, new_c);
+    flags_record(gb, FLAGS_SHIFT, 0, 0, (hl_val >> 1) | new_c, new_c ? FLAG_C : 0);
 }
 
 static void rl_r(struct gb *gb, cpu_r8_t r)
 {
     uint8_t r_val = get_r8(gb, r);
-    uint8_t old_c = get_flag(gb, FLAG_C), new_c = r_val & 0x80;
+    uint8_t old_c = flag_c(gb), new_c = r_val & 0x80;
 
     set_r8(gb, r, (r_val << 1) | old_c);
-
-    toggle_flag(gb, FLAG_Z, (uint8_t)((r_val << 1) | old_c) == 0x00);
-    reset_flag(gb, FLAG_N);
-    reset_flag(gb, FLAG_H);
-    toggle_flag(gb, FLAG_C, new_c);
+    flags_record(gb, FLAGS_SHIFT, 0, 0, (uint8_t)((r_val << 1) | old_c), new_c ? FLAG_C : 0);
 }
 
 static void rl_indirect_hl(struct gb *gb)
 {
     uint16_t hl = get_r16(gb, R16_HL);
     uint8_t hl_val = cpu_read(gb, hl);
-    uint8_t old_c = get_flag(gb, FLAG_C), new_c = hl_val & 0x80;
+    uint8_t old_c = flag_c(gb), new_c = hl_val & 0x80;
 
     cpu_write(gb, hl, (hl_val << 1) | old_c);
-
-    toggle_flag(gb, FLAG_Z, (uint8_t)((hl_val << 1) | old_c) == 0x00);
-    reset_flag(gb, FLAG_N);
-    reset_flag(gb, FLAG_H);
-    toggle_flag(gb, FLAG_C, new_c);
+    flags_record(gb, FLAGS_SHIFT, 0, 0, (uint8_t)((hl_val << 1) | old_c), new_c ? FLAG_C : 0);
 }
 
 static void rr_r(struct gb *gb, cpu_r8_t r)
 {
     uint8_t r_val = get_r8(gb, r);
-    uint8_t old_c = get_flag(gb, FLAG_C), new_c = r_val & 0x01;
+    uint8_t old_c = flag_c(gb), new_c = r_val & 0x01;
 
     set_r8(gb, r, (r_val >> 1) | (old_c << 7));
-
-    toggle_flag(gb, FLAG_Z, ((r_val >> 1) | (old_c << 7)) == 0x00);
-    reset_flag(gb, FLAG_N);
-    reset_flag(gb, FLAG_H);
-    toggle_flag(gb, FLAG_C, new_c);
+    flags_record(gb, FLAGS_SHIFT, 0, 0, (r_val >> 1) | (old_c << 7), new_c ? FLAG_C : 0);
 }
 
 static void rr_indirect_hl(struct gb *gb)
 {
     uint16_t hl = get_r16(gb, R16_HL);
     uint8_t hl_val = cpu_read(gb, hl);
-    uint8_t old_c = get_flag(gb, FLAG_C), new_c = hl_val & 0x01;
+    uint8_t old_c = flag_c(gb), new_c = hl_val & 0x01;
 
     cpu_write(gb, hl, (hl_val >> 1) | (old_c << 7));
-
-    toggle_flag(gb, FLAG_Z, (uint8_t)((hl_val >> 1) | (old_c << 7)) == 0x00);
-    reset_flag(gb, FLAG_N);
-    reset_flag(gb, FLAG_H);
-    toggle_flag(gb, FLAG_C, new_c);
+    flags_record(gb, FLAGS_SHIFT, 0, 0, (hl_val >> 1) | (old_c << 7), new_c ? FLAG_C : 0);
 }
 
 static void sla_r(struct gb *gb, cpu_r8_t r)
@@ -1101,10 +1198,7 @@ static void sla_r(struct gb *gb, cpu_r8_t r)
     uint8_t new_c = r_val & 0x80;
 
     set_r8(gb, r, r_val << 1);
-    toggle_flag(gb, FLAG_Z, get_r8(gb, r) == 0x00);
-    reset_flag(gb, FLAG_N);
-    reset_flag(gb, FLAG_H);
-    toggle_flag(gb, FLAG_C, new_c);
+    flags_record(gb, FLAGS_SHIFT, 0, 0, (uint8_t)(r_val << 1), new_c ? FLAG_C : 0);
 }
 
 static void sla_indirect_hl(struct gb *gb)
@@ -1114,10 +1208,7 @@ static void sla_indirect_hl(struct gb *gb)
     uint8_t new_c = hl_val & 0x80;
 
     cpu_write(gb, hl, hl_val << 1);
-    toggle_flag(gb, FLAG_Z, (uint8_t)(hl_val << 1) == 0x00);
-    reset_flag(gb, FLAG_N);
-    reset_flag(gb, FLAG_H);
-    toggle_flag(gb, FLAG_C, new_c);
+    flags_record(gb, FLAGS_SHIFT, 0, 0, (uint8_t)(hl_val << 1), new_c ? FLAG_C : 0);
 }
 
 static void sra_r(struct gb *gb, cpu_r8_t r)
@@ -1126,10 +1217,7 @@ static void sra_r(struct gb *gb, cpu_r8_t r)
     uint8_t new_c = r_val & 0x01;
 
     set_r8(gb, r, (r_val >> 1) | (r_val & 0x80));
-    toggle_flag(gb, FLAG_Z, get_r8(gb, r) == 0x00);
-    reset_flag(gb, FLAG_N);
-    reset_flag(gb, FLAG_H);
-    toggle_flag(gb, FLAG_C, new_c);
+    flags_record(gb, FLAGS_SHIFT, 0, 0, (r_val >> 1) | (r_val & 0x80), new_c ? FLAG_C : 0);
 }
 
 static void sra_indirect_hl(struct gb *gb)
@@ -1139,10 +1227,7 @@ static void sra_indirect_hl(struct gb *gb)
     uint8_t new_c = hl_val & 0x01;
 
     cpu_write(gb, hl, (hl_val >> 1) | (hl_val & 0x80));
-    toggle_flag(gb, FLAG_Z, (uint8_t)((hl_val >> 1) | (hl_val & 0x80)) == 0x00);
-    reset_flag(gb, FLAG_N);
-    reset_flag(gb, FLAG_H);
-    toggle_flag(gb, FLAG_C, new_c);
+    flags_record(gb, FLAGS_SHIFT, 0, 0, (hl_val >> 1) | (hl_val & 0x80), new_c ? FLAG_C : 0);
 }
 
 static void swap_r(struct gb *gb, cpu_r8_t r)
@@ -1150,10 +1235,7 @@ static void swap_r(struct gb *gb, cpu_r8_t r)
     uint8_t r_val = get_r8(gb, r);
 
     set_r8(gb, r, (r_val << 4) | (r_val >> 4));
-    toggle_flag(gb, FLAG_Z, get_r8(gb, r) == 0x00);
-    reset_flag(gb, FLAG_N);
-    reset_flag(gb, FLAG_H);
-    reset_flag(gb, FLAG_C);
+    flags_record(gb, FLAGS_SHIFT, 0, 0, (uint8_t)((r_val << 4) | (r_val >> 4)), 0);
 }
 
 static void swap_indirect_hl(struct gb *gb)
@@ -1162,10 +1244,7 @@ static void swap_indirect_hl(struct gb *gb)
     uint8_t hl_val = cpu_read(gb, hl);
 
     cpu_write(gb, hl, (hl_val << 4) | (hl_val >> 4));
-    toggle_flag(gb, FLAG_Z, (uint8_t)((hl_val << 4) | (hl_val >> 4)) == 0x00);
-    reset_flag(gb, FLAG_N);
-    reset_flag(gb, FLAG_H);
-    reset_flag(gb, FLAG_C);
+    flags_record(gb, FLAGS_SHIFT, 0, 0, (uint8_t)((hl_val << 4) | (hl_val >> 4)), 0);
 }
 
 static void srl_r(struct gb *gb, cpu_r8_t r)
@@ -1174,10 +1253,7 @@ static void srl_r(struct gb *gb, cpu_r8_t r)
     uint8_t new_c = r_val & 0x01;
 
     set_r8(gb, r, r_val >> 1);
-    toggle_flag(gb, FLAG_Z, (r_val >> 1) == 0x00);
-    reset_flag(gb, FLAG_N);
-    reset_flag(gb, FLAG_H);
-    toggle_flag(gb, FLAG_C, new_c);
+    flags_record(gb, FLAGS_SHIFT, 0, 0, r_val >> 1, new_c ? FLAG_C : 0);
 }
 
 static void srl_indirect_hl(struct gb *gb)
@@ -1187,10 +1263,7 @@ static void srl_indirect_hl(struct gb *gb)
     uint8_t new_c = hl_val & 0x01;
 
     cpu_write(gb, hl, hl_val >> 1);
-    toggle_flag(gb, FLAG_Z, (hl_val >> 1) == 0x00);
-    reset_flag(gb, FLAG_N);
-    reset_flag(gb, FLAG_H);
-    toggle_flag(gb, FLAG_C, new_c);
+    flags_record(gb, FLAGS_SHIFT, 0, 0, hl_val >> 1, new_c ? FLAG_C : 0);
 }
 
 static void rla(struct gb *gb)
@@ -1241,12 +1314,17 @@ static void scf(struct gb *gb)
     set_flag(gb, FLAG_C);
 }
 
-// TODO: complete these instructions
 static void halt(struct gb *gb)
 {
-    gb->cpu.mode = HALT;
+    // with IME off and an interrupt already pending HALT falls through at once,
+    // but the CPU fails to advance pc past the next opcode
+    if (!gb->cpu.ime && interrupts_pending(gb))
+        gb->cpu.mode = HALT_BUG;
+    else
+        gb->cpu.mode = HALT;
 }
 
+// TODO: complete this instruction
 static void stop(struct gb *gb)
 {
     gb->cpu.mode = STOP;
@@ -1254,10 +1332,17 @@ static void stop(struct gb *gb)
 
 static void di(struct gb *gb)
 {
+    gb->cpu.ime = false;
+    gb->cpu.ei_delay = false;
 }
 
 static void ei(struct gb *gb)
 {
+    // IME is set once the next instruction has run, see cpu_run()
+    if (!gb->cpu.ime) {
+        gb->cpu.ei_delay = true;
+        gb->cpu.mode = IME;
+    }
 }
 
 void execute_cb_instructions(struct gb *gb)
@@ -1794,19 +1879,622 @@ void execute_normal_instructions(struct gb *gb)
     }
 }
 
-void cpu_step(struct gb *gb)
-{
-    switch (gb->cpu.mode) {
-    case NORMAL:
+/******************/
+/******************/
+/* Handler Tables */
+/******************/
+/******************/
+
+/*
+ * One handler per opcode, with the register/condition operand fixed at
+ * compile time. The handlers are flattened so get_r8()/set_r8() and friends
+ * are inlined with a constant argument and their switch folds away.
+ */
+#define R8_HANDLERS(name, fn)                                           \
+    static FLATTEN void name##_b(struct gb *gb) { fn(gb, R8_B); }       \
+    static FLATTEN void name##_c(struct gb *gb) { fn(gb, R8_C); }       \
+    static FLATTEN void name##_d(struct gb *gb) { fn(gb, R8_D); }       \
+    static FLATTEN void name##_e(struct gb *gb) { fn(gb, R8_E); }       \
+    static FLATTEN void name##_h(struct gb *gb) { fn(gb, R8_H); }       \
+    static FLATTEN void name##_l(struct gb *gb) { fn(gb, R8_L); }       \
+    static FLATTEN void name##_a(struct gb *gb) { fn(gb, R8_A); }
+
+#define R16_HANDLERS(name, fn)                                          \
+    static FLATTEN void name##_bc(struct gb *gb) { fn(gb, R16_BC); }    \
+    static FLATTEN void name##_de(struct gb *gb) { fn(gb, R16_DE); }    \
+    static FLATTEN void name##_hl(struct gb *gb) { fn(gb, R16_HL); }    \
+    static FLATTEN void name##_sp(struct gb *gb) { fn(gb, R16_SP); }
+
+#define COND_HANDLERS(name, fn)                                         \
+    static FLATTEN void name##_nz(struct gb *gb) { fn(gb, COND_NZ); }   \
+    static FLATTEN void name##_z(struct gb *gb) { fn(gb, COND_Z); }     \
+    static FLATTEN void name##_nc(struct gb *gb) { fn(gb, COND_NC); }   \
+    static FLATTEN void name##_c(struct gb *gb) { fn(gb, COND_C); }
+
+#define BIT_HANDLERS(name, fn, hl_fn, n)                                \
+    static FLATTEN void name##n##_b(struct gb *gb) { fn(gb, n, R8_B); } \
+    static FLATTEN void name##n##_c(struct gb *gb) { fn(gb, n, R8_C); } \
+    static FLATTEN void name##n##_d(struct gb *gb) { fn(gb, n, R8_D); } \
+    static FLATTEN void name##n##_e(struct gb *gb) { fn(gb, n, R8_E); } \
+    static FLATTEN void name##n##_h(struct gb *gb) { fn(gb, n, R8_H); } \
+    static FLATTEN void name##n##_l(struct gb *gb) { fn(gb, n, R8_L); } \
+    static FLATTEN void name##n##_a(struct gb *gb) { fn(gb, n, R8_A); } \
+    static FLATTEN void name##n##_hl(struct gb *gb) { hl_fn(gb, n); }
+
+#define LD_R_R_HANDLERS(dst)                                                                \
+    static void op_ld_##dst##_b(struct gb *gb) { gb->cpu.regs.dst = gb->cpu.regs.b; }       \
+    static void op_ld_##dst##_c(struct gb *gb) { gb->cpu.regs.dst = gb->cpu.regs.c; }       \
+    static void op_ld_##dst##_d(struct gb *gb) { gb->cpu.regs.dst = gb->cpu.regs.d; }       \
+    static void op_ld_##dst##_e(struct gb *gb) { gb->cpu.regs.dst = gb->cpu.regs.e; }       \
+    static void op_ld_##dst##_h(struct gb *gb) { gb->cpu.regs.dst = gb->cpu.regs.h; }       \
+    static void op_ld_##dst##_l(struct gb *gb) { gb->cpu.regs.dst = gb->cpu.regs.l; }       \
+    static void op_ld_##dst##_a(struct gb *gb) { gb->cpu.regs.dst = gb->cpu.regs.a; }
+
+#define RST_HANDLER(n) \
+    static void op_rst_##n(struct gb *gb) { rst_n(gb, 0x##n); }
+
+#define R8_ROW(name, hl) \
+    name##_b, name##_c, name##_d, name##_e, name##_h, name##_l, hl, name##_a
+#define BIT_ROW(name, n) R8_ROW(name##n, name##n##_hl)
+
+R8_HANDLERS(op_rlc, rlc_r)
+R8_HANDLERS(op_rrc, rrc_r)
+R8_HANDLERS(op_rl, rl_r)
+R8_HANDLERS(op_rr, rr_r)
+R8_HANDLERS(op_sla, sla_r)
+R8_HANDLERS(op_sra, sra_r)
+R8_HANDLERS(op_swap, swap_r)
+R8_HANDLERS(op_srl, srl_r)
+
+BIT_HANDLERS(op_bit, bit_n_r, bit_n_indirect_hl, 0)
+BIT_HANDLERS(op_bit, bit_n_r, bit_n_indirect_hl, 1)
+BIT_HANDLERS(op_bit, bit_n_r, bit_n_indirect_hl, 2)
+BIT_HANDLERS(op_bit, bit_n_r, bit_n_indirect_hl, 3)
+BIT_HANDLERS(op_bit, bit_n_r, bit_n_indirect_hl, 4)
+BIT_HANDLERS(op_bit, bit_n_r, bit_n_indirect_hl, 5)
+BIT_HANDLERS(op_bit, bit_n_r, bit_n_indirect_hl, 6)
+BIT_HANDLERS(op_bit, bit_n_r, bit_n_indirect_hl, 7)
+BIT_HANDLERS(op_res, res_n_r, res_n_indirect_hl, 0)
+BIT_HANDLERS(op_res, res_n_r, res_n_indirect_hl, 1)
+BIT_HANDLERS(op_res, res_n_r, res_n_indirect_hl, 2)
+BIT_HANDLERS(op_res, res_n_r, res_n_indirect_hl, 3)
+BIT_HANDLERS(op_res, res_n_r, res_n_indirect_hl, 4)
+BIT_HANDLERS(op_res, res_n_r, res_n_indirect_hl, 5)
+BIT_HANDLERS(op_res, res_n_r, res_n_indirect_hl, 6)
+BIT_HANDLERS(op_res, res_n_r, res_n_indirect_hl, 7)
+BIT_HANDLERS(op_set, set_n_r, set_n_indirect_hl, 0)
+BIT_HANDLERS(op_set, set_n_r, set_n_indirect_hl, 1)
+BIT_HANDLERS(op_set, set_n_r, set_n_indirect_hl, 2)
+BIT_HANDLERS(op_set, set_n_r, set_n_indirect_hl, 3)
+BIT_HANDLERS(op_set, set_n_r, set_n_indirect_hl, 4)
+BIT_HANDLERS(op_set, set_n_r, set_n_indirect_hl, 5)
+BIT_HANDLERS(op_set, set_n_r, set_n_indirect_hl, 6)
+BIT_HANDLERS(op_set, set_n_r, set_n_indirect_hl, 7)
+
+const cpu_op_fn cpu_cb_ops[256] = {
+    R8_ROW(op_rlc, rlc_indirect_hl),
+    R8_ROW(op_rrc, rrc_indirect_hl),
+    R8_ROW(op_rl, rl_indirect_hl),
+    R8_ROW(op_rr, rr_indirect_hl),
+    R8_ROW(op_sla, sla_indirect_hl),
+    R8_ROW(op_sra, sra_indirect_hl),
+    R8_ROW(op_swap, swap_indirect_hl),
+    R8_ROW(op_srl, srl_indirect_hl),
+    BIT_ROW(op_bit, 0), BIT_ROW(op_bit, 1), BIT_ROW(op_bit, 2), BIT_ROW(op_bit, 3),
+    BIT_ROW(op_bit, 4), BIT_ROW(op_bit, 5), BIT_ROW(op_bit, 6), BIT_ROW(op_bit, 7),
+    BIT_ROW(op_res, 0), BIT_ROW(op_res, 1), BIT_ROW(op_res, 2), BIT_ROW(op_res, 3),
+    BIT_ROW(op_res, 4), BIT_ROW(op_res, 5), BIT_ROW(op_res, 6), BIT_ROW(op_res, 7),
+    BIT_ROW(op_set, 0), BIT_ROW(op_set, 1), BIT_ROW(op_set, 2), BIT_ROW(op_set, 3),
+    BIT_ROW(op_set, 4), BIT_ROW(op_set, 5), BIT_ROW(op_set, 6), BIT_ROW(op_set, 7),
+};
+
+static void op_nop(struct gb *gb)
+{
+    (void)gb;
+}
+
+// unused opcodes behave as NOP, same as the switch path
+static void op_illegal(struct gb *gb)
+{
+    (void)gb;
+}
+
+static void op_cb(struct gb *gb)
+{
+    cpu_cb_ops[cpu_read(gb, gb->cpu.regs.pc++)](gb);
+}
+
+R16_HANDLERS(op_ld_nn, ld_rr_nn)
+R16_HANDLERS(op_inc, inc_rr)
+R16_HANDLERS(op_dec, dec_rr)
+R16_HANDLERS(op_add_hl, add_hl_rr)
+
+R8_HANDLERS(op_inc, inc_r)
+R8_HANDLERS(op_dec, dec_r)
+R8_HANDLERS(op_ld_n, ld_r_n)
+R8_HANDLERS(op_ld_from_hl, ld_r_indirect_hl)
+R8_HANDLERS(op_ld_to_hl, ld_indirect_hl_r)
+
+LD_R_R_HANDLERS(b)
+LD_R_R_HANDLERS(c)
+LD_R_R_HANDLERS(d)
+LD_R_R_HANDLERS(e)
+LD_R_R_HANDLERS(h)
+LD_R_R_HANDLERS(l)
+LD_R_R_HANDLERS(a)
+
+R8_HANDLERS(op_add, add_a_r)
+R8_HANDLERS(op_adc, adc_a_r)
+R8_HANDLERS(op_sub, sub_a_r)
+R8_HANDLERS(op_sbc, sbc_a_r)
+R8_HANDLERS(op_and, and_a_r)
+R8_HANDLERS(op_xor, xor_a_r)
+R8_HANDLERS(op_or, or_a_r)
+R8_HANDLERS(op_cp, cp_a_r)
+
+COND_HANDLERS(op_jr, jr_f_i8)
+COND_HANDLERS(op_jp, jp_f_nn)
+COND_HANDLERS(op_call, call_f_nn)
+COND_HANDLERS(op_ret, ret_f)
+
+RST_HANDLER(00)
+RST_HANDLER(08)
+RST_HANDLER(10)
+RST_HANDLER(18)
+RST_HANDLER(20)
+RST_HANDLER(28)
+RST_HANDLER(30)
+RST_HANDLER(38)
+
+static FLATTEN void op_ld_indirect_bc_a(struct gb *gb) { ld_indirect_rr_a(gb, R16_BC); }
+static FLATTEN void op_ld_indirect_de_a(struct gb *gb) { ld_indirect_rr_a(gb, R16_DE); }
+static FLATTEN void op_ld_a_indirect_bc(struct gb *gb) { ld_a_indirect_rr(gb, R16_BC); }
+static FLATTEN void op_ld_a_indirect_de(struct gb *gb) { ld_a_indirect_rr(gb, R16_DE); }
+static FLATTEN void op_ldh_c_a(struct gb *gb) { ldh_r_a(gb, R8_C); }
+static FLATTEN void op_ldh_a_c(struct gb *gb) { ldh_a_r(gb, R8_C); }
+static FLATTEN void op_pop_bc(struct gb *gb) { pop_rr(gb, R16_BC); }
+static FLATTEN void op_pop_de(struct gb *gb) { pop_rr(gb, R16_DE); }
+static FLATTEN void op_pop_hl(struct gb *gb) { pop_rr(gb, R16_HL); }
+static FLATTEN void op_pop_af(struct gb *gb) { pop_rr(gb, R16_AF); }
+static FLATTEN void op_push_bc(struct gb *gb) { push_rr(gb, R16_BC); }
+static FLATTEN void op_push_de(struct gb *gb) { push_rr(gb, R16_DE); }
+static FLATTEN void op_push_hl(struct gb *gb) { push_rr(gb, R16_HL); }
+static FLATTEN void op_push_af(struct gb *gb) { push_rr(gb, R16_AF); }
+
+#define CPU_OPS(X) \
+    X(00, op_nop)              \
+    X(01, op_ld_nn_bc)         \
+    X(02, op_ld_indirect_bc_a) \
+    X(03, op_inc_bc)           \
+    X(04, op_inc_b)            \
+    X(05, op_dec_b)            \
+    X(06, op_ld_n_b)           \
+    X(07, rlca)                \
+    X(08, ld_indirect_nn_sp)   \
+    X(09, op_add_hl_bc)        \
+    X(0a, op_ld_a_indirect_bc) \
+    X(0b, op_dec_bc)           \
+    X(0c, op_inc_c)            \
+    X(0d, op_dec_c)            \
+    X(0e, op_ld_n_c)           \
+    X(0f, rrca)                \
+    X(10, stop)                \
+    X(11, op_ld_nn_de)         \
+    X(12, op_ld_indirect_de_a) \
+    X(13, op_inc_de)           \
+    X(14, op_inc_d)            \
+    X(15, op_dec_d)            \
+    X(16, op_ld_n_d)           \
+    X(17, rla)                 \
+    X(18, jr_i8)               \
+    X(19, op_add_hl_de)        \
+    X(1a, op_ld_a_indirect_de) \
+    X(1b, op_dec_de)           \
+    X(1c, op_inc_e)            \
+    X(1d, op_dec_e)            \
+    X(1e, op_ld_n_e)           \
+    X(1f, rra)                 \
+    X(20, op_jr_nz)            \
+    X(21, op_ld_nn_hl)         \
+    X(22, ldi_indirect_hl_a)   \
+    X(23, op_inc_hl)           \
+    X(24, op_inc_h)            \
+    X(25, op_dec_h)            \
+    X(26, op_ld_n_h)           \
+    X(27, daa)                 \
+    X(28, op_jr_z)             \
+    X(29, op_add_hl_hl)        \
+    X(2a, ldi_a_indirect_hl)   \
+    X(2b, op_dec_hl)           \
+    X(2c, op_inc_l)            \
+    X(2d, op_dec_l)            \
+    X(2e, op_ld_n_l)           \
+    X(2f, cpl)                 \
+    X(30, op_jr_nc)            \
+    X(31, op_ld_nn_sp)         \
+    X(32, ldd_indirect_hl_a)   \
+    X(33, op_inc_sp)           \
+    X(34, inc_indirect_hl)     \
+    X(35, dec_indirect_hl)     \
+    X(36, ld_indirect_hl_n)    \
+    X(37, scf)                 \
+    X(38, op_jr_c)             \
+    X(39, op_add_hl_sp)        \
+    X(3a, ldd_a_indirect_hl)   \
+    X(3b, op_dec_sp)           \
+    X(3c, op_inc_a)            \
+    X(3d, op_dec_a)            \
+    X(3e, op_ld_n_a)           \
+    X(3f, ccf)                 \
+    X(40, op_ld_b_b)           \
+    X(41, op_ld_b_c)           \
+    X(42, op_ld_b_d)           \
+    X(43, op_ld_b_e)           \
+    X(44, op_ld_b_h)           \
+    X(45, op_ld_b_l)           \
+    X(46, op_ld_from_hl_b)     \
+    X(47, op_ld_b_a)           \
+    X(48, op_ld_c_b)           \
+    X(49, op_ld_c_c)           \
+    X(4a, op_ld_c_d)           \
+    X(4b, op_ld_c_e)           \
+    X(4c, op_ld_c_h)           \
+    X(4d, op_ld_c_l)           \
+    X(4e, op_ld_from_hl_c)     \
+    X(4f, op_ld_c_a)           \
+    X(50, op_ld_d_b)           \
+    X(51, op_ld_d_c)           \
+    X(52, op_ld_d_d)           \
+    X(53, op_ld_d_e)           \
+    X(54, op_ld_d_h)           \
+    X(55, op_ld_d_l)           \
+    X(56, op_ld_from_hl_d)     \
+    X(57, op_ld_d_a)           \
+    X(58, op_ld_e_b)           \
+    X(59, op_ld_e_c)           \
+    X(5a, op_ld_e_d)           \
+    X(5b, op_ld_e_e)           \
+    X(5c, op_ld_e_h)           \
+    X(5d, op_ld_e_l)           \
+    X(5e, op_ld_from_hl_e)     \
+    X(5f, op_ld_e_a)           \
+    X(60, op_ld_h_b)           \
+    X(61, op_ld_h_c)           \
+    X(62, op_ld_h_d)           \
+    X(63, op_ld_h_e)           \
+    X(64, op_ld_h_h)           \
+    X(65, op_ld_h_l)           \
+    X(66, op_ld_from_hl_h)     \
+    X(67, op_ld_h_a)           \
+    X(68, op_ld_l_b)           \
+    X(69, op_ld_l_c)           \
+    X(6a, op_ld_l_d)           \
+    X(6b, op_ld_l_e)           \
+    X(6c, op_ld_l_h)           \
+    X(6d, op_ld_l_l)           \
+    X(6e, op_ld_from_hl_l)     \
+    X(6f, op_ld_l_a)           \
+    X(70, op_ld_to_hl_b)       \
+    X(71, op_ld_to_hl_c)       \
+    X(72, op_ld_to_hl_d)       \
+    X(73, op_ld_to_hl_e)       \
+    X(74, op_ld_to_hl_h)       \
+    X(75, op_ld_to_hl_l)       \
+    X(76, halt)                \
+    X(77, op_ld_to_hl_a)       \
+    X(78, op_ld_a_b)           \
+    X(79, op_ld_a_c)           \
+    X(7a, op_ld_a_d)           \
+    X(7b, op_ld_a_e)           \
+    X(7c, op_ld_a_h)           \
+    X(7d, op_ld_a_l)           \
+    X(7e, op_ld_from_hl_a)     \
+    X(7f, op_ld_a_a)           \
+    X(80, op_add_b)            \
+    X(81, op_add_c)            \
+    X(82, op_add_d)            \
+    X(83, op_add_e)            \
+    X(84, op_add_h)            \
+    X(85, op_add_l)            \
+    X(86, add_a_indirect_hl)   \
+    X(87, op_add_a)            \
+    X(88, op_adc_b)            \
+    X(89, op_adc_c)            \
+    X(8a, op_adc_d)            \
+    X(8b, op_adc_e)            \
+    X(8c, op_adc_h)            \
+    X(8d, op_adc_l)            \
+    X(8e, adc_a_indirect_hl)   \
+    X(8f, op_adc_a)            \
+    X(90, op_sub_b)            \
+    X(91, op_sub_c)            \
+    X(92, op_sub_d)            \
+    X(93, op_sub_e)            \
+    X(94, op_sub_h)            \
+    X(95, op_sub_l)            \
+    X(96, sub_a_indirect_hl)   \
+    X(97, op_sub_a)            \
+    X(98, op_sbc_b)            \
+    X(99, op_sbc_c)            \
+    X(9a, op_sbc_d)            \
+    X(9b, op_sbc_e)            \
+    X(9c, op_sbc_h)            \
+    X(9d, op_sbc_l)            \
+    X(9e, sbc_a_indirect_hl)   \
+    X(9f, op_sbc_a)            \
+    X(a0, op_and_b)            \
+    X(a1, op_and_c)            \
+    X(a2, op_and_d)            \
+    X(a3, op_and_e)            \
+    X(a4, op_and_h)            \
+    X(a5, op_and_l)            \
+    X(a6, and_a_indirect_hl)   \
+    X(a7, op_and_a)            \
+    X(a8, op_xor_b)            \
+    X(a9, op_xor_c)            \
+    X(aa, op_xor_d)            \
+    X(ab, op_xor_e)            \
+    X(ac, op_xor_h)            \
+    X(ad, op_xor_l)            \
+    X(ae, xor_a_indirect_hl)   \
+    X(af, op_xor_a)            \
+    X(b0, op_or_b)             \
+    X(b1, op_or_c)             \
+    X(b2, op_or_d)             \
+    X(b3, op_or_e)             \
+    X(b4, op_or_h)             \
+    X(b5, op_or_l)             \
+    X(b6, or_a_indirect_hl)    \
+    X(b7, op_or_a)             \
+    X(b8, op_cp_b)             \
+    X(b9, op_cp_c)             \
+    X(ba, op_cp_d)             \
+    X(bb, op_cp_e)             \
+    X(bc, op_cp_h)             \
+    X(bd, op_cp_l)             \
+    X(be, cp_a_indirect_hl)    \
+    X(bf, op_cp_a)             \
+    X(c0, op_ret_nz)           \
+    X(c1, op_pop_bc)           \
+    X(c2, op_jp_nz)            \
+    X(c3, jp_nn)               \
+    X(c4, op_call_nz)          \
+    X(c5, op_push_bc)          \
+    X(c6, add_a_n)             \
+    X(c7, op_rst_00)           \
+    X(c8, op_ret_z)            \
+    X(c9, ret)                 \
+    X(ca, op_jp_z)             \
+    X(cb, op_cb)               \
+    X(cc, op_call_z)           \
+    X(cd, call_nn)             \
+    X(ce, adc_a_n)             \
+    X(cf, op_rst_08)           \
+    X(d0, op_ret_nc)           \
+    X(d1, op_pop_de)           \
+    X(d2, op_jp_nc)            \
+    X(d3, op_illegal)          \
+    X(d4, op_call_nc)          \
+    X(d5, op_push_de)          \
+    X(d6, sub_a_n)             \
+    X(d7, op_rst_10)           \
+    X(d8, op_ret_c)            \
+    X(d9, reti)                \
+    X(da, op_jp_c)             \
+    X(db, op_illegal)          \
+    X(dc, op_call_c)           \
+    X(dd, op_illegal)          \
+    X(de, sbc_a_n)             \
+    X(df, op_rst_18)           \
+    X(e0, ldh_n_a)             \
+    X(e1, op_pop_hl)           \
+    X(e2, op_ldh_c_a)          \
+    X(e3, op_illegal)          \
+    X(e4, op_illegal)          \
+    X(e5, op_push_hl)          \
+    X(e6, and_a_n)             \
+    X(e7, op_rst_20)           \
+    X(e8, add_sp_i8)           \
+    X(e9, jp_hl)               \
+    X(ea, ld_indirect_nn_a)    \
+    X(eb, op_illegal)          \
+    X(ec, op_illegal)          \
+    X(ed, op_illegal)          \
+    X(ee, xor_a_n)             \
+    X(ef, op_rst_28)           \
+    X(f0, ldh_a_n)             \
+    X(f1, op_pop_af)           \
+    X(f2, op_ldh_a_c)          \
+    X(f3, di)                  \
+    X(f4, op_illegal)          \
+    X(f5, op_push_af)          \
+    X(f6, or_a_n)              \
+    X(f7, op_rst_30)           \
+    X(f8, ld_hl_sp_plus_i8)    \
+    X(f9, ld_sp_hl)            \
+    X(fa, ld_a_indirect_nn)    \
+    X(fb, ei)                  \
+    X(fc, op_illegal)          \
+    X(fd, op_illegal)          \
+    X(fe, cp_a_n)              \
+    X(ff, op_rst_38)          
+
+#define OP_ENTRY(code, fn) [0x##code] = fn,
+
+const cpu_op_fn cpu_ops[256] = {
+    CPU_OPS(OP_ENTRY)
+};
+
+static uint64_t run_switch(struct gb *gb, uint64_t count)
+{
+    uint64_t n = 0;
+
+    while (n < count && gb->cpu.mode == NORMAL) {
         execute_normal_instructions(gb);
-        break;
+        n++;
+    }
+    return n;
+}
+
+#ifdef HAVE_COMPUTED_GOTO
+/*
+ * Direct-threaded loop: every opcode has its own label and its own indirect
+ * jump to the next handler, so the branch predictor sees one jump site per
+ * opcode instead of a single shared one.
+ */
+#define OP_LABEL(code, fn) [0x##code] = &&op_##code,
+#define OP_BODY(code, fn) op_##code: fn(gb); DISPATCH();
+#define DISPATCH()                                                  \
+    do {                                                            \
+        if (n == count || gb->cpu.mode != NORMAL)                   \
+            return n;                                               \
+        n++;                                                        \
+        goto *labels[cpu_read(gb, gb->cpu.regs.pc++)];              \
+    } while (0)
+
+static uint64_t run_threaded(struct gb *gb, uint64_t count)
+{
+    static const void *const labels[256] = {
+        CPU_OPS(OP_LABEL)
+    };
+    uint64_t n = 0;
+
+    DISPATCH();
+    CPU_OPS(OP_BODY)
+    return n;
+}
+
+#undef DISPATCH
+#undef OP_BODY
+#undef OP_LABEL
+#else
+static uint64_t run_threaded(struct gb *gb, uint64_t count)
+{
+    uint64_t n = 0;
+
+    while (n < count && gb->cpu.mode == NORMAL) {
+        cpu_ops[cpu_read(gb, gb->cpu.regs.pc++)](gb);
+        n++;
+    }
+    return n;
+}
+#endif
+
+static uint64_t run_backend(struct gb *gb, uint64_t count)
+{
+    switch (gb->cpu.backend) {
+    case BACKEND_THREADED:
+        return run_threaded(gb, count);
+    case BACKEND_CACHED:
+        return block_run(gb, count);
+    case BACKEND_JIT:
+        return jit_run(gb, count);
     default:
-        break;
+        return run_switch(gb, count);
     }
 }
 
-void cpu_init(struct gb *gb)
+/*
+ * The backends return as soon as the mode leaves NORMAL, everything else
+ * (interrupt entry, the EI delay, HALT) is handled here between instructions.
+ * Returns early when nothing can wake the halted CPU any more, when it has
+ * stayed halted up to cycle until, or when it is stopped. Idle loop skips
+ * stop short of until as well.
+ */
+static uint64_t run(struct gb *gb, uint64_t count, uint64_t until)
+{
+    uint64_t n = 0;
+
+    gb->idle.until = until;
+
+    while (n < count) {
+        switch (gb->cpu.mode) {
+        case NORMAL:
+            n += run_backend(gb, count - n);
+            break;
+        case IME:
+            if (gb->cpu.ei_delay) {
+                gb->cpu.mode = NORMAL;
+                gb->cpu.ei_delay = false;
+                gb->cpu.ime = true;
+                n += run_backend(gb, 1);
+                cpu_check_interrupts(gb);
+            } else {
+                service_interrupt(gb);
+            }
+            break;
+        case HALT_BUG:
+            // the byte after HALT is read twice
+            gb->cpu.mode = NORMAL;
+            cpu_ops[cpu_read(gb, gb->cpu.regs.pc)](gb);
+            n++;
+            break;
+        case HALT:
+            if (!halt_wait(gb, until))
+                goto out;
+            gb->cpu.mode = NORMAL;
+            cpu_check_interrupts(gb);
+            break;
+        default:
+            goto out;
+        }
+    }
+out:
+    flags_materialize(gb);
+    return n;
+}
+
+// a halted CPU waits at most a frame per call
+uint64_t cpu_run(struct gb *gb, uint64_t count)
+{
+    return run(gb, count, gb->sched.now + FRAME_CYCLES);
+}
+
+/*
+ * Runs until the cycle count reaches cycle, overshooting by at most the
+ * instruction or interrupt entry that crosses it, or until the CPU can't
+ * make progress any more. Returns the instructions executed.
+ */
+uint64_t cpu_run_until(struct gb *gb, uint64_t cycle)
+{
+    uint64_t n = 0;
+
+    while (gb->sched.now < cycle) {
+        uint64_t last = gb->sched.now;
+
+        // no instruction takes more than 24 cycles, so this many can't run past cycle by much
+        n += run(gb, (cycle - last + 23) / 24, cycle);
+        // halted or stopped with nothing left to wake it up
+        if (gb->sched.now == last)
+            break;
+    }
+    return n;
+}
+
+void cpu_step(struct gb *gb)
+{
+    cpu_run(gb, 1);
+}
+
+void cpu_init(struct gb *gb, cpu_backend_t backend)
 {
     gb->cpu.mode = NORMAL;
+    gb->cpu.flags.op = FLAGS_NONE;
+    gb->cpu.ime = false;
+    gb->cpu.ei_delay = false;
+    gb->cpu.halt_cycles = 0;
+    if ((backend == BACKEND_CACHED || backend == BACKEND_JIT) && !gb->cpu.blocks)
+        gb->cpu.blocks = block_cache_create();
+    // without a block cache neither backend can run, interpret instead
+    if ((backend == BACKEND_CACHED || backend == BACKEND_JIT) && !gb->cpu.blocks)
+        backend = BACKEND_THREADED;
+    gb->cpu.backend = backend;
+    if (backend == BACKEND_JIT && !gb->cpu.jit)
+        gb->cpu.jit = jit_create();
+    if (gb->cpu.blocks)
+        block_cache_flush(gb->cpu.blocks);
+    mmu_untrap_code(gb);
+    if (gb->cpu.jit)
+        gb->cpu.jit->used = 0;
     gb->cpu.regs.pc = 0;
 }
\ No newline at end of file
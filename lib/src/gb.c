@@ -1,20 +1,217 @@
+#include <stddef.h>
 #include "common.h"
 #include "gb.h"
+#include "block.h"
+#include "jit.h"
+#include "sched.h"
+#include "timer.h"
+#include "idle.h"
+#include "mmu.h"
+#include "rom.h"
+#include "mbc.h"
+#include "ppu.h"
+#include "pool.h"
+
+static const struct gb_config default_config = {
+    .renderer = PPU_SCANLINE,
+};
 
 struct gb *gb_create(void)
 {
-    struct gb *gb = malloc(sizeof(struct gb));
+    return gb_create_config(NULL);
+}
+
+struct gb *gb_create_config(const struct gb_config *config)
+{
+    return gb_create_in(NULL, config);
+}
+
+// an instance in pool, or on the heap if pool is NULL
+struct gb *gb_create_in(struct gb_pool *pool, const struct gb_config *config)
+{
+    struct gb *gb = pool ? gb_pool_get(pool) : malloc(sizeof(struct gb));
 
     if (!gb) {
         printf("[ERROR] Can't create the system\n");
+        return NULL;
     }
+    if (!config)
+        config = &default_config;
+
+    memset(gb, 0, sizeof(struct gb));
+    gb->pool = pool;
+    mmu_init(gb);
+    sched_init(gb);
+    timer_init(gb);
+    ppu_init(gb, config->renderer);
+    idle_init(gb);
+    return gb;
+}
 
-    gb->rom.data = NULL;
+// instances created from the same image share its pages, config may be NULL for the defaults
+struct gb *gb_create_from_rom(struct rom_image *image, const struct gb_config *config)
+{
+    struct gb *gb = gb_create_config(config);
+
+    if (gb)
+        rom_attach(gb, image);
+    return gb;
+}
+
+/*
+ * A child that carries on from the parent's exact state. RAM pages are shared
+ * with the parent and its other children until either side writes to them,
+ * see mmu.c; cartridge RAM is copied. The child has no save file, draws into
+ * its own framebuffer with no observations and translates code afresh. The
+ * parent is changed too (its pages become shared) so it must not be running
+ * or forked from another thread meanwhile. The parent may be destroyed first.
+ */
+struct gb *gb_fork(struct gb *parent)
+{
+    struct gb *gb;
+
+    if (!mmu_share(parent))
+        return NULL;
+    gb = malloc(sizeof(struct gb));
+    if (!gb) {
+        printf("[ERROR] Can't create the system\n");
+        return NULL;
+    }
+    // everything but the memory, which mmu_fork() shares or copies page by page
+    memcpy(&gb->mmu, &parent->mmu, sizeof(struct gb) - offsetof(struct gb, mmu));
+    gb->pool = NULL;
+    mmu_fork(gb, parent);
+    ppu_fork(gb, parent);
+    if (gb->rom.image)
+        rom_retain(gb->rom.image);
+    gb->mbc.ram = NULL;
+    gb->cpu.blocks = NULL;
+    gb->cpu.jit = NULL;
+    if (!mbc_fork(gb, parent)) {
+        gb_destroy(gb);
+        return NULL;
+    }
+    mmu_untrap_code(gb);
+    if (gb->cpu.backend == BACKEND_CACHED || gb->cpu.backend == BACKEND_JIT) {
+        gb->cpu.blocks = block_cache_create();
+        if (!gb->cpu.blocks) {
+            gb_destroy(gb);
+            return NULL;
+        }
+    }
+    if (gb->cpu.backend == BACKEND_JIT) {
+        gb->cpu.jit = jit_create();
+        if (!gb->cpu.jit) {
+            gb_destroy(gb);
+            return NULL;
+        }
+    }
+    gb->cpu.block_exit = true;
     return gb;
 }
 
+/*
+ * Put gb back into the exact state template is in with one copy of the whole
+ * instance, then fix up what gb must keep for itself: where it lives, its
+ * block cache and JIT buffer (emptied), its output, observations (started
+ * over) and save file, and its cartridge RAM, copied from the template's.
+ * Both must run the same ROM with the same amount of cartridge RAM. Meant
+ * for a template kept at power on or just after the boot ROM and reused for
+ * many short runs, e.g. one per test. On failure gb is left as it was.
+ */
+bool gb_reset_from(struct gb *gb, const struct gb *template)
+{
+    struct gb_pool *pool = gb->pool;
+    struct block_cache *blocks = gb->cpu.blocks;
+    struct jit *jit = gb->cpu.jit;
+    uint8_t *ram = gb->mbc.ram;
+    uint8_t *save = gb->mbc.save;
+    uint32_t save_size = gb->mbc.save_size;
+    uint64_t flushes = gb->mbc.flushes;
+    struct ppu_output output = gb->ppu.output;
+    struct ppu_output next_output = gb->ppu.next_output;
+    bool output_pending = gb->ppu.output_pending;
+    bool render = gb->ppu.render;
+    struct ppu_observation obs = gb->ppu.obs;
+    uint8_t max_ops = blocks ? blocks->max_ops : BLOCK_MAX_OPS;
+    cpu_backend_t backend = template->cpu.backend;
+
+    if (gb == template)
+        return true;
+    if (gb->rom.image != template->rom.image || gb->rom.data != template->rom.data ||
+        gb->mbc.ram_size != template->mbc.ram_size) {
+        printf("[ERROR] Can't reset from an instance with a different cartridge\n");
+        return false;
+    }
+    // whatever can fail comes before gb is overwritten
+    if (!blocks && (backend == BACKEND_CACHED || backend == BACKEND_JIT)) {
+        blocks = block_cache_create();
+        if (!blocks)
+            return false;
+        gb->cpu.blocks = blocks;
+    }
+    if (!jit && backend == BACKEND_JIT) {
+        jit = jit_create();
+        if (!jit)
+            return false;
+        gb->cpu.jit = jit;
+    }
+
+    mmu_destroy(gb);
+    memcpy(gb, template, sizeof(struct gb));
+    mmu_rebase(gb, template);
+    gb->pool = pool;
+
+    if (blocks && backend != BACKEND_CACHED && backend != BACKEND_JIT) {
+        block_cache_destroy(blocks);
+        blocks = NULL;
+    }
+    if (jit && backend != BACKEND_JIT) {
+        jit_destroy(jit);
+        jit = NULL;
+    }
+    gb->cpu.blocks = blocks;
+    gb->cpu.jit = jit;
+    mmu_untrap_code(gb);
+    if (blocks) {
+        block_cache_flush(blocks);
+        blocks->max_ops = max_ops;
+    }
+    if (jit)
+        jit->used = 0;
+    gb->cpu.block_exit = true;
+
+    gb->ppu.output = output;
+    gb->ppu.next_output = next_output;
+    gb->ppu.output_pending = output_pending;
+    gb->ppu.render = render;
+    gb->ppu.obs.ring = NULL;
+    if (obs.ring)
+        ppu_set_observation(gb, obs.ring, obs.depth, obs.width, obs.height, obs.format, obs.filter);
+
+    gb->mbc.ram = ram;
+    gb->mbc.save = save;
+    gb->mbc.save_size = save_size;
+    gb->mbc.flushes = flushes;
+    if (!save)
+        sched_cancel(gb, SCHED_SAVE);
+    if (ram) {
+        memcpy(ram, template->mbc.ram, gb->mbc.ram_size);
+        mbc_restore(gb);
+    }
+    return true;
+}
+
 void gb_destroy(struct gb *gb)
 {
-    free(gb);
+    jit_destroy(gb->cpu.jit);
+    block_cache_destroy(gb->cpu.blocks);
+    mbc_destroy(gb);
+    rom_release(gb->rom.image);
+    mmu_destroy(gb);
+    if (gb->pool)
+        gb_pool_put(gb->pool, gb);
+    else
+        free(gb);
 }
 
@@ -0,0 +1,265 @@
+#include "idle.h"
+#include "cpu.h"
+#include "mmu.h"
+#include "sched.h"
+
+/*
+ * Idle loop skipping. A short backward loop that only reads memory, writes
+ * no memory and only feeds registers it computed itself in the same pass
+ * (ldh a,(44); cp 90; jr nz, ...) leaves the machine in the same state every
+ * time round. Nothing changes until something it reads does, so time can be
+ * moved forward by whole iterations up to that point.
+ */
+#define REG(r)      (1U << (r))
+
+// 3-bit register field to cpu_r8_t, 6 is (hl)
+static const uint8_t field_reg[8] = { R8_B, R8_C, R8_D, R8_E, R8_H, R8_L, 0xff, R8_A };
+
+struct idle_op {
+    uint8_t len;
+    uint8_t cycles;     // M-cycles, branches taken
+    uint8_t reads;      // registers read
+    uint8_t writes;     // registers written
+    int32_t addr;       // memory read, -1 for none
+    bool branch;
+};
+
+static uint8_t reg_value(struct gb *gb, uint8_t r)
+{
+    switch (r) {
+    case R8_B: return gb->cpu.regs.b;
+    case R8_C: return gb->cpu.regs.c;
+    case R8_D: return gb->cpu.regs.d;
+    case R8_E: return gb->cpu.regs.e;
+    case R8_H: return gb->cpu.regs.h;
+    case R8_L: return gb->cpu.regs.l;
+    default:   return gb->cpu.regs.a;
+    }
+}
+
+static uint16_t reg_pair(struct gb *gb, uint8_t hi, uint8_t lo)
+{
+    return TO_U16(reg_value(gb, lo), reg_value(gb, hi));
+}
+
+// fills op for the instructions an idle loop may contain, false for anything else
+static bool decode(struct gb *gb, uint16_t pc, struct idle_op *op)
+{
+    uint8_t opcode = mmu_read(gb, pc);
+    uint8_t src = field_reg[opcode & 0x07];
+    uint8_t dst = field_reg[(opcode >> 3) & 0x07];
+
+    *op = (struct idle_op){ .len = 1, .cycles = 1, .addr = -1 };
+    if (opcode >= 0x40 && opcode < 0x80 && opcode != 0x76) {
+        // LD r,r' and LD r,(hl); LD (hl),r writes memory
+        if (dst == 0xff)
+            return false;
+        op->writes = REG(dst);
+        if (src == 0xff) {
+            op->reads = REG(R8_H) | REG(R8_L);
+            op->addr = reg_pair(gb, R8_H, R8_L);
+            op->cycles = 2;
+        } else {
+            op->reads = REG(src);
+        }
+        return true;
+    }
+    if (opcode >= 0x80 && opcode < 0xc0) {
+        // ALU a,r and ALU a,(hl); CP only sets flags
+        op->reads = REG(R8_A);
+        if (src == 0xff) {
+            op->reads |= REG(R8_H) | REG(R8_L);
+            op->addr = reg_pair(gb, R8_H, R8_L);
+            op->cycles = 2;
+        } else {
+            op->reads |= REG(src);
+        }
+        if (opcode >= 0x88 && opcode < 0xa0 && (opcode & 0x08))
+            op->reads |= REG(R8_F);
+        op->writes = REG(R8_F) | (opcode >= 0xb8 ? 0 : REG(R8_A));
+        return true;
+    }
+    if ((opcode & 0xc6) == 0x04 && dst != 0xff) {
+        // INC r and DEC r keep the carry flag
+        op->reads = REG(dst) | REG(R8_F);
+        op->writes = REG(dst) | REG(R8_F);
+        return true;
+    }
+    if ((opcode & 0xc7) == 0x06 && dst != 0xff) {
+        op->len = 2;
+        op->cycles = 2;
+        op->writes = REG(dst);
+        return true;
+    }
+    if ((opcode & 0xc7) == 0xc6) {
+        // ALU a,n
+        op->len = 2;
+        op->cycles = 2;
+        op->reads = REG(R8_A) | ((opcode == 0xce || opcode == 0xde) ? REG(R8_F) : 0);
+        op->writes = REG(R8_F) | (opcode == 0xfe ? 0 : REG(R8_A));
+        return true;
+    }
+
+    switch (opcode) {
+    case 0x00:
+        return true;
+    case 0x0a:
+    case 0x1a:
+        op->cycles = 2;
+        op->reads = opcode == 0x0a ? REG(R8_B) | REG(R8_C) : REG(R8_D) | REG(R8_E);
+        op->writes = REG(R8_A);
+        op->addr = opcode == 0x0a ? reg_pair(gb, R8_B, R8_C) : reg_pair(gb, R8_D, R8_E);
+        return true;
+    case 0xf0:
+        op->len = 2;
+        op->cycles = 3;
+        op->writes = REG(R8_A);
+        op->addr = 0xff00 + mmu_read(gb, pc + 1);
+        return true;
+    case 0xf2:
+        op->cycles = 2;
+        op->reads = REG(R8_C);
+        op->writes = REG(R8_A);
+        op->addr = 0xff00 + gb->cpu.regs.c;
+        return true;
+    case 0xfa:
+        op->len = 3;
+        op->cycles = 4;
+        op->writes = REG(R8_A);
+        op->addr = TO_U16(mmu_read(gb, pc + 1), mmu_read(gb, pc + 2));
+        return true;
+    case 0xcb: {
+        uint8_t cb = mmu_read(gb, pc + 1);
+        uint8_t r = field_reg[cb & 0x07];
+
+        // only BIT n,r and BIT n,(hl)
+        if (cb < 0x40 || cb >= 0x80)
+            return false;
+        op->len = 2;
+        op->cycles = 2;
+        op->reads = REG(R8_F);
+        op->writes = REG(R8_F);
+        if (r == 0xff) {
+            op->reads |= REG(R8_H) | REG(R8_L);
+            op->addr = reg_pair(gb, R8_H, R8_L);
+            op->cycles = 3;
+        } else {
+            op->reads |= REG(r);
+        }
+        return true;
+    }
+    case 0x18:
+        op->len = 2;
+        op->cycles = 3;
+        op->branch = true;
+        return true;
+    case 0x20: case 0x28: case 0x30: case 0x38:
+        op->len = 2;
+        op->cycles = 3;
+        op->reads = REG(R8_F);
+        op->branch = true;
+        return true;
+    case 0xc3:
+        op->len = 3;
+        op->cycles = 4;
+        op->branch = true;
+        return true;
+    case 0xc2: case 0xca: case 0xd2: case 0xda:
+        op->len = 3;
+        op->cycles = 4;
+        op->reads = REG(R8_F);
+        op->branch = true;
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Is start..end an idle loop closed by the branch that ends at end? On success
+ * cycles holds the T-cycles of one pass and deadline the first cycle at which
+ * something the loop reads may change.
+ */
+static bool analyse(struct gb *gb, uint16_t start, uint16_t end, uint32_t *cycles, uint64_t *deadline)
+{
+    uint8_t used = 0, defined = 0;
+    uint16_t pc = start;
+    struct idle_op op;
+
+    *cycles = 0;
+    // interrupt handlers only run at events, so RAM cannot change before the next one
+    *deadline = gb->sched.next;
+    while ((uint16_t)(pc - start) < (uint16_t)(end - start)) {
+        if (!decode(gb, pc, &op))
+            return false;
+        used |= op.reads & ~defined;
+        defined |= op.writes;
+        if (op.addr >= 0) {
+            uint64_t change = mmu_next_change(gb, op.addr);
+
+            if (change < *deadline)
+                *deadline = change;
+        }
+        *cycles += op.cycles * 4;
+        pc += op.len;
+        if (op.branch)
+            break;
+    }
+    // a register read before it is written must stay the same every pass
+    return op.branch && pc == end && !(used & defined);
+}
+
+void idle_init(struct gb *gb)
+{
+    struct idle *idle = &gb->idle;
+
+    idle->enabled = true;
+    idle->skipped = 0;
+    idle->skips = 0;
+    idle->last_key = 0;
+    idle->last_now = 0;
+    idle->last_deadline = 0;
+    idle->until = SCHED_NEVER;
+    memset(idle->rejected, 0, sizeof(idle->rejected));
+}
+
+/*
+ * Called after a backward JR/JP ending at end was taken, pc is the loop start.
+ * The registers are only known to be settled once a whole pass has run with
+ * nothing it reads changing, so a skip needs two back to back visits.
+ * Loops found not to be idle are remembered so they are only looked at once.
+ */
+void idle_check(struct gb *gb, uint16_t end)
+{
+    struct idle *idle = &gb->idle;
+    uint16_t start = gb->cpu.regs.pc;
+    uint32_t key = ((uint32_t)start << 16) | end;
+    uint32_t *rejected = &idle->rejected[(start ^ (start >> 6)) & (IDLE_CACHE_SIZE - 1)];
+    uint64_t now = gb->sched.now;
+    uint64_t deadline, passes;
+    uint32_t cycles;
+    bool settled;
+
+    if (*rejected == key)
+        return;
+    if (!analyse(gb, start, end, &cycles, &deadline)) {
+        *rejected = key;
+        return;
+    }
+    settled = idle->last_key == key && idle->last_now + cycles == now && idle->last_deadline > now;
+    idle->last_key = key;
+    idle->last_now = now;
+    idle->last_deadline = deadline;
+    if (deadline > idle->until)
+        deadline = idle->until;
+    if (!settled || deadline == SCHED_NEVER)
+        return;
+    // whole passes that finish strictly before the deadline
+    passes = (deadline - now - 1) / cycles;
+    if (!passes)
+        return;
+    gb->sched.now += passes * cycles;
+    idle->last_now = gb->sched.now;
+    idle->skipped += passes * cycles;
+    idle->skips++;
+}
@@ -0,0 +1,401 @@
+#include "jit.h"
+#include "cpu.h"
+#include "mmu.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+#include <stddef.h>
+#include <sys/mman.h>
+
+/*
+ * x86-64 translation of blocks from the block cache.
+ *
+ * While a block runs, the SM83 registers live in r8-r15 in struct
+ * cpu_register order (a, b, c, d, e, f, h, l) and rbx holds the struct gb
+ * pointer. Loads between registers, LD r,n, INC/DEC r and the 8-bit ALU are
+ * emitted natively, using the host's ZF/AF/CF (via LAHF) for Z/H/C. Every
+ * other instruction calls its cpu_ops handler with the registers spilled.
+ * After each call the block returns to the runtime if the handler touched
+ * I/O, the cartridge registers or cached code (gb->cpu.block_exit).
+ * Handlers may leave flags lazy, so they are materialised before the
+ * registers are reloaded.
+ *
+ * A block returns how many instructions it retired.
+ */
+
+#define REG_OFFSET(field)   ((int32_t)offsetof(struct gb, cpu.regs.field))
+#define HOST_F              5
+#define HOST_NONE           0xff
+
+struct emitter {
+    uint8_t *start;
+    uint8_t *p;
+    uint8_t *end;
+    uint32_t pending;           // M-cycles not yet handed to cpu_cycles()
+    uint32_t exits[BLOCK_MAX_OPS];
+    int n_exits;
+};
+
+/* SM83 flags from the host's AH after LAHF: Z (bit 6), AF (bit 4) and CF (bit 0) */
+#define AH_FLAGS(ah, n)     ((((ah) & 0x40) << 1) | (((ah) & 0x10) << 1) | (((ah) & 0x01) << 4) | (n))
+#define AH_FLAGS4(ah, n)    AH_FLAGS(ah, n), AH_FLAGS((ah) + 1, n), AH_FLAGS((ah) + 2, n), AH_FLAGS((ah) + 3, n)
+#define AH_FLAGS16(ah, n)   AH_FLAGS4(ah, n), AH_FLAGS4((ah) + 4, n), AH_FLAGS4((ah) + 8, n), AH_FLAGS4((ah) + 12, n)
+#define AH_FLAGS64(ah, n)   AH_FLAGS16(ah, n), AH_FLAGS16((ah) + 16, n), AH_FLAGS16((ah) + 32, n), AH_FLAGS16((ah) + 48, n)
+#define AH_FLAGS256(n)      AH_FLAGS64(0, n), AH_FLAGS64(64, n), AH_FLAGS64(128, n), AH_FLAGS64(192, n)
+
+static const uint8_t flags_add[256] = { AH_FLAGS256(0) };
+static const uint8_t flags_sub[256] = { AH_FLAGS256(FLAG_N) };
+
+/* host register (r8 + index) of each 3-bit SM83 register field b,c,d,e,h,l,(hl),a */
+static const uint8_t host_reg[8] = { 1, 2, 3, 4, 6, 7, HOST_NONE, 0 };
+
+static void emit8(struct emitter *e, uint8_t b)
+{
+    if (e->p < e->end)
+        *e->p = b;
+    e->p++;
+}
+
+static void emit32(struct emitter *e, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+        emit8(e, v >> (i * 8));
+}
+
+static void emit64(struct emitter *e, uint64_t v)
+{
+    for (int i = 0; i < 8; i++)
+        emit8(e, v >> (i * 8));
+}
+
+static void emit_load_regs(struct emitter *e)
+{
+    // mov r8b+i, [rbx + regs + i]
+    for (int i = 0; i < 8; i++) {
+        emit8(e, 0x44); emit8(e, 0x8a); emit8(e, 0x83 | (i << 3));
+        emit32(e, REG_OFFSET(a) + i);
+    }
+}
+
+static void emit_store_regs(struct emitter *e)
+{
+    // mov [rbx + regs + i], r8b+i
+    for (int i = 0; i < 8; i++) {
+        emit8(e, 0x44); emit8(e, 0x88); emit8(e, 0x83 | (i << 3));
+        emit32(e, REG_OFFSET(a) + i);
+    }
+}
+
+static void emit_set_pc(struct emitter *e, uint16_t pc)
+{
+    // mov word [rbx + pc], imm16
+    emit8(e, 0x66); emit8(e, 0xc7); emit8(e, 0x83);
+    emit32(e, REG_OFFSET(pc));
+    emit8(e, LSB(pc)); emit8(e, MSB(pc));
+}
+
+static void emit_call(struct emitter *e, const void *fn)
+{
+    emit8(e, 0x48); emit8(e, 0x89); emit8(e, 0xdf);     // mov rdi, rbx
+    emit8(e, 0x48); emit8(e, 0xb8); emit64(e, (uintptr_t)fn);  // mov rax, fn
+    emit8(e, 0xff); emit8(e, 0xd0);                     // call rax
+}
+
+static void emit_flush_cycles(struct emitter *e)
+{
+    if (!e->pending)
+        return;
+    emit8(e, 0xbe); emit32(e, e->pending);              // mov esi, pending
+    emit_call(e, (const void *)cpu_cycles);
+    e->pending = 0;
+}
+
+/* AH (from LAHF) -> SM83 flags via the given table, result in al */
+static void emit_flags_from_ah(struct emitter *e, const uint8_t *table)
+{
+    emit8(e, 0x9f);                                     // lahf
+    emit8(e, 0x0f); emit8(e, 0xb6); emit8(e, 0xc4);     // movzx eax, ah
+    emit8(e, 0x48); emit8(e, 0xb9); emit64(e, (uintptr_t)table);   // mov rcx, table
+    emit8(e, 0x0f); emit8(e, 0xb6); emit8(e, 0x04); emit8(e, 0x01); // movzx eax, byte [rcx + rax]
+}
+
+static void emit_store_f(struct emitter *e)
+{
+    emit8(e, 0x41); emit8(e, 0x88); emit8(e, 0xc0 | HOST_F);       // mov r13b, al
+}
+
+static void emit_carry_in(struct emitter *e)
+{
+    emit8(e, 0x41); emit8(e, 0x0f); emit8(e, 0xba); emit8(e, 0xe0 | HOST_F); emit8(e, 4);  // bt r13d, 4
+}
+
+/* ADD ADC SUB SBC AND XOR OR CP in SM83 order */
+static const uint8_t alu_rr_opcode[8] = { 0x00, 0x10, 0x28, 0x18, 0x20, 0x30, 0x08, 0x38 };
+static const uint8_t alu_imm_ext[8] = { 0, 2, 5, 3, 4, 6, 1, 7 };
+
+static void emit_alu_flags(struct emitter *e, int alu)
+{
+    switch (alu) {
+    case 0: case 1:
+        emit_flags_from_ah(e, flags_add);
+        break;
+    case 2: case 3: case 7:
+        emit_flags_from_ah(e, flags_sub);
+        break;
+    default:
+        // logic ops: Z from the result, H set for AND only
+        emit8(e, 0x0f); emit8(e, 0x94); emit8(e, 0xc0);     // setz al
+        emit8(e, 0xc0); emit8(e, 0xe0); emit8(e, 7);        // shl al, 7
+        if (alu == 4) {
+            emit8(e, 0x0c); emit8(e, FLAG_H);               // or al, FLAG_H
+        }
+        break;
+    }
+    emit_store_f(e);
+}
+
+static void emit_alu_r(struct emitter *e, int alu, uint8_t src)
+{
+    if (alu == 1 || alu == 3)
+        emit_carry_in(e);
+    emit8(e, 0x45); emit8(e, alu_rr_opcode[alu]); emit8(e, 0xc0 | (src << 3));  // op r8b, src
+    emit_alu_flags(e, alu);
+}
+
+static void emit_alu_n(struct emitter *e, int alu, uint8_t n)
+{
+    if (alu == 1 || alu == 3)
+        emit_carry_in(e);
+    emit8(e, 0x41); emit8(e, 0x80); emit8(e, 0xc0 | (alu_imm_ext[alu] << 3)); emit8(e, n);  // op r8b, n
+    emit_alu_flags(e, alu);
+}
+
+static void emit_inc_dec(struct emitter *e, uint8_t r, bool dec)
+{
+    emit8(e, 0x41); emit8(e, 0xfe); emit8(e, 0xc0 | (dec << 3) | r);   // inc/dec r
+    emit_flags_from_ah(e, dec ? flags_sub : flags_add);
+    emit8(e, 0x24); emit8(e, 0xe0);                                     // and al, ~FLAG_C
+    emit8(e, 0x41); emit8(e, 0x80); emit8(e, 0xe0 | HOST_F); emit8(e, FLAG_C);  // and r13b, FLAG_C
+    emit8(e, 0x41); emit8(e, 0x08); emit8(e, 0xc0 | HOST_F);                    // or r13b, al
+}
+
+/* Returns true if the instruction at code[] was emitted natively */
+static bool emit_native(struct emitter *e, const uint8_t *code)
+{
+    uint8_t opcode = code[0];
+    uint8_t dst = host_reg[(opcode >> 3) & 7], src = host_reg[opcode & 7];
+
+    if (opcode == 0x00) {
+        e->pending += 1;
+        return true;
+    }
+    if (opcode >= 0x40 && opcode < 0x80 && dst != HOST_NONE && src != HOST_NONE) {
+        if (dst != src) {
+            emit8(e, 0x45); emit8(e, 0x88); emit8(e, 0xc0 | (src << 3) | dst);   // mov dst, src
+        }
+        e->pending += 1;
+        return true;
+    }
+    if (opcode >= 0x80 && opcode < 0xc0 && src != HOST_NONE) {
+        emit_alu_r(e, (opcode >> 3) & 7, src);
+        e->pending += 1;
+        return true;
+    }
+    if (opcode >= 0xc0 && (opcode & 0x07) == 0x06) {
+        emit_alu_n(e, (opcode >> 3) & 7, code[1]);
+        e->pending += 2;
+        return true;
+    }
+    if (opcode < 0x40 && dst != HOST_NONE) {
+        switch (opcode & 0x07) {
+        case 0x04:
+        case 0x05:
+            emit_inc_dec(e, dst, opcode & 0x01);
+            e->pending += 1;
+            return true;
+        case 0x06:
+            emit8(e, 0x41); emit8(e, 0xb0 | dst); emit8(e, code[1]);     // mov dst, n
+            e->pending += 2;
+            return true;
+        default:
+            break;
+        }
+    }
+    return false;
+}
+
+static void emit_materialize_flags(struct emitter *e)
+{
+    // cmp dword [rbx + flags.op], FLAGS_NONE; je over; call cpu_flush_flags
+    emit8(e, 0x83); emit8(e, 0xbb);
+    emit32(e, (int32_t)offsetof(struct gb, cpu.flags.op));
+    emit8(e, FLAGS_NONE);
+    emit8(e, 0x74); emit8(e, 15);
+    emit_call(e, (const void *)cpu_flush_flags);
+}
+
+static void emit_exit_check(struct emitter *e, uint32_t retired)
+{
+    // cmp byte [rbx + block_exit], 0; je over; mov eax, retired; jmp epilogue
+    emit8(e, 0x80); emit8(e, 0xbb);
+    emit32(e, (int32_t)offsetof(struct gb, cpu.block_exit));
+    emit8(e, 0x00);
+    emit8(e, 0x74); emit8(e, 10);
+    emit8(e, 0xb8); emit32(e, retired);
+    emit8(e, 0xe9);
+    e->exits[e->n_exits++] = e->p - e->start;
+    emit32(e, 0);
+}
+
+struct jit *jit_create(void)
+{
+    struct jit *jit = malloc(sizeof(struct jit));
+
+    if (!jit) {
+        printf("[ERROR] Can't allocate the JIT\n");
+        return NULL;
+    }
+    jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->code == MAP_FAILED) {
+        printf("[ERROR] Can't map executable memory for the JIT\n");
+        free(jit);
+        return NULL;
+    }
+    jit->used = 0;
+    return jit;
+}
+
+void jit_destroy(struct jit *jit)
+{
+    if (!jit)
+        return;
+    munmap(jit->code, JIT_CODE_SIZE);
+    free(jit);
+}
+
+static void *compile(struct gb *gb, struct jit *jit, const struct block *block)
+{
+    struct emitter e = {
+        .start = jit->code + jit->used,
+        .p = jit->code + jit->used,
+        .end = jit->code + JIT_CODE_SIZE,
+    };
+    uint16_t pc = block->start;
+    bool last_native = false;
+
+    emit8(&e, 0x53);                                        // push rbx
+    emit8(&e, 0x41); emit8(&e, 0x54);                       // push r12
+    emit8(&e, 0x41); emit8(&e, 0x55);                       // push r13
+    emit8(&e, 0x41); emit8(&e, 0x56);                       // push r14
+    emit8(&e, 0x41); emit8(&e, 0x57);                       // push r15
+    emit8(&e, 0x48); emit8(&e, 0x89); emit8(&e, 0xfb);      // mov rbx, rdi
+    emit_load_regs(&e);
+
+    for (int i = 0; i < block->n_ops; i++) {
+        const struct micro_op *op = &block->ops[i];
+        uint8_t code[2] = { mmu_read(gb, pc), mmu_read(gb, pc + 1) };
+        uint16_t next = block_op_end(gb, pc);
+
+        last_native = op->fetches == 1 && emit_native(&e, code);
+        if (!last_native) {
+            e.pending += op->fetches;
+            emit_store_regs(&e);
+            emit_flush_cycles(&e);
+            emit_set_pc(&e, pc + op->fetches);
+            emit_call(&e, (const void *)op->fn);
+            emit_materialize_flags(&e);
+            emit_load_regs(&e);
+            if (i + 1 < block->n_ops)
+                emit_exit_check(&e, i + 1);
+        }
+        pc = next;
+    }
+
+    if (last_native)
+        emit_set_pc(&e, block->end);
+    emit_store_regs(&e);
+    emit_flush_cycles(&e);
+    emit8(&e, 0xb8); emit32(&e, block->n_ops);             // mov eax, n_ops
+
+    // epilogue, also the target of every early exit
+    uint32_t epilogue = e.p - e.start;
+    for (int i = 0; i < e.n_exits; i++) {
+        int32_t rel = epilogue - (e.exits[i] + 4);
+
+        if (e.start + e.exits[i] + 4 <= e.end)
+            memcpy(e.start + e.exits[i], &rel, 4);
+    }
+    emit8(&e, 0x41); emit8(&e, 0x5f);                       // pop r15
+    emit8(&e, 0x41); emit8(&e, 0x5e);                       // pop r14
+    emit8(&e, 0x41); emit8(&e, 0x5d);                       // pop r13
+    emit8(&e, 0x41); emit8(&e, 0x5c);                       // pop r12
+    emit8(&e, 0x5b);                                        // pop rbx
+    emit8(&e, 0xc3);                                        // ret
+
+    if (e.p > e.end)
+        return NULL;
+    jit->used = e.p - jit->code;
+    return e.start;
+}
+
+static void *jit_compile(struct gb *gb, struct block *block)
+{
+    struct jit *jit = gb->cpu.jit;
+    void *host = compile(gb, jit, block);
+
+    if (!host) {
+        // out of code space: drop every translation and start over
+        block_cache_flush(gb->cpu.blocks);
+        jit->used = 0;
+        return NULL;
+    }
+    return host;
+}
+
+uint64_t jit_run(struct gb *gb, uint64_t count)
+{
+    uint64_t n = 0;
+
+    if (!gb->cpu.jit)
+        return block_run(gb, count);
+    while (n < count && gb->cpu.mode == NORMAL) {
+        struct block *block = block_lookup(gb, gb->cpu.regs.pc);
+
+        if (!block) {
+            n += block_step(gb);
+            continue;
+        }
+        if (!block->host)
+            block->host = jit_compile(gb, block);
+        // native code hands over its cycles in batches, so an event falling due
+        // inside the block would be seen late: interpret the block instead
+        if (block->host && block->n_ops <= count - n &&
+                    gb->sched.now + 4 * block->cycles < gb->sched.next) {
+            gb->cpu.block_exit = false;
+            cpu_flush_flags(gb);
+            n += ((jit_block_fn)block->host)(gb);
+        } else {
+            n += block_exec(gb, block, count - n);
+        }
+    }
+    return n;
+}
+
+#else
+
+struct jit *jit_create(void)
+{
+    return NULL;
+}
+
+void jit_destroy(struct jit *jit)
+{
+    (void)jit;
+}
+
+uint64_t jit_run(struct gb *gb, uint64_t count)
+{
+    return block_run(gb, count);
+}
+
+#endif
@@ -0,0 +1,508 @@
+#include "mbc.h"
+#include "mmu.h"
+#include "sched.h"
+
+#include <time.h>
+#if defined(__unix__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/*
+ * Cartridge mappers. A bank switch only repoints the pages of the
+ * 0x0000-0x7fff and 0xa000-0xbfff windows into rom.data and the cartridge
+ * RAM, nothing is copied. The MBC3 clock is not ticked either: it is counted
+ * from the cycle counter whenever the CPU looks at it.
+ *
+ * Battery-backed RAM can live in a shared mapping of the .sav file, so game
+ * writes land in the page cache with no syscall. The file is only msync'ed,
+ * asynchronously, from the SCHED_SAVE event: on the frame after the game
+ * disables RAM (which it does once a save is complete) and every
+ * SAVE_INTERVAL while RAM stays enabled.
+ */
+
+#define ROM_BANK_SIZE       0x4000
+#define RAM_BANK_SIZE       0x2000
+#define RTC_FOOTER_SIZE     48
+#define SAVE_INTERVAL       (60 * FRAME_CYCLES)
+
+struct cart_type {
+    uint8_t code;   // header byte 0x147
+    mbc_type_t type;
+    bool ram;
+    bool battery;
+    bool rtc;
+};
+
+static const struct cart_type cart_types[] = {
+    { 0x00, MBC_NONE, false, false, false },
+    { 0x01, MBC_1,    false, false, false },
+    { 0x02, MBC_1,    true,  false, false },
+    { 0x03, MBC_1,    true,  true,  false },
+    { 0x08, MBC_NONE, true,  false, false },
+    { 0x09, MBC_NONE, true,  true,  false },
+    { 0x0f, MBC_3,    false, true,  true },
+    { 0x10, MBC_3,    true,  true,  true },
+    { 0x11, MBC_3,    false, false, false },
+    { 0x12, MBC_3,    true,  false, false },
+    { 0x13, MBC_3,    true,  true,  false },
+    { 0x19, MBC_5,    false, false, false },
+    { 0x1a, MBC_5,    true,  false, false },
+    { 0x1b, MBC_5,    true,  true,  false },
+    { 0x1c, MBC_5,    false, false, false },
+    { 0x1d, MBC_5,    true,  false, false },
+    { 0x1e, MBC_5,    true,  true,  false },
+};
+
+// indexed by header byte 0x149
+static const uint32_t ram_sizes[] = { 0, 0x800, 0x2000, 0x8000, 0x20000, 0x10000 };
+
+static const uint8_t rtc_masks[RTC_REGS] = { 0x3f, 0x3f, 0x1f, 0xff, 0xc1 };
+
+/*******************************************************
+ *                        RTC                          *
+ *******************************************************/
+
+// out of range values count up to the register width and wrap without a carry
+static void rtc_tick(uint8_t *r)
+{
+    uint16_t days;
+
+    r[RTC_S] = (r[RTC_S] + 1) & 0x3f;
+    if (r[RTC_S] != 60)
+        return;
+    r[RTC_S] = 0;
+    r[RTC_M] = (r[RTC_M] + 1) & 0x3f;
+    if (r[RTC_M] != 60)
+        return;
+    r[RTC_M] = 0;
+    r[RTC_H] = (r[RTC_H] + 1) & 0x1f;
+    if (r[RTC_H] != 24)
+        return;
+    r[RTC_H] = 0;
+    days = ((r[RTC_DH] & 0x01) << 8 | r[RTC_DL]) + 1;
+    if (days == 512)
+        r[RTC_DH] |= 0x80;
+    r[RTC_DL] = days & 0xff;
+    r[RTC_DH] = (r[RTC_DH] & 0xfe) | ((days >> 8) & 0x01);
+}
+
+static void rtc_advance(uint8_t *r, uint64_t secs)
+{
+    uint64_t t;
+
+    while (secs && (r[RTC_S] >= 60 || r[RTC_M] >= 60 || r[RTC_H] >= 24)) {
+        rtc_tick(r);
+        secs--;
+    }
+    if (!secs)
+        return;
+    t = ((uint64_t)(r[RTC_DH] & 0x01) << 8 | r[RTC_DL]) * 24 + r[RTC_H];
+    t = (t * 60 + r[RTC_M]) * 60 + r[RTC_S] + secs;
+    r[RTC_S] = t % 60;
+    t /= 60;
+    r[RTC_M] = t % 60;
+    t /= 60;
+    r[RTC_H] = t % 24;
+    t /= 24;
+    if (t >= 512)
+        r[RTC_DH] |= 0x80;
+    r[RTC_DL] = t & 0xff;
+    r[RTC_DH] = (r[RTC_DH] & 0xfe) | ((t >> 8) & 0x01);
+}
+
+// count the whole seconds since the last sync, the halt bit stops the clock
+static void rtc_sync(struct gb *gb)
+{
+    struct rtc *rtc = &gb->mbc.rtc;
+    uint64_t secs = (gb->sched.now - rtc->sync) / CPU_FREQ;
+
+    if (rtc->regs[RTC_DH] & 0x40) {
+        rtc->sync = gb->sched.now;
+        return;
+    }
+    rtc->sync += secs * CPU_FREQ;
+    rtc_advance(rtc->regs, secs);
+}
+
+static bool rtc_selected(struct mbc *mbc)
+{
+    return mbc->has_rtc && mbc->ram_enabled && mbc->ram_select >= 0x08 && mbc->ram_select <= 0x0c;
+}
+
+/*******************************************************
+ *                      Banking                        *
+ *******************************************************/
+
+static uint16_t current_rom_bank0(struct mbc *mbc)
+{
+    if (mbc->type == MBC_1 && mbc->mode)
+        return ((mbc->ram_select & 0x03) << 5) % mbc->rom_banks;
+    return 0;
+}
+
+static uint16_t current_rom_bank(struct mbc *mbc)
+{
+    uint16_t bank;
+
+    switch (mbc->type) {
+    case MBC_1:
+        bank = (mbc->rom_select & 0x1f) ? (mbc->rom_select & 0x1f) : 1;
+        bank |= (mbc->ram_select & 0x03) << 5;
+        break;
+    case MBC_3:
+        bank = (mbc->rom_select & 0x7f) ? (mbc->rom_select & 0x7f) : 1;
+        break;
+    case MBC_5:
+        bank = mbc->rom_select & 0x1ff;
+        break;
+    default:
+        bank = 1;
+        break;
+    }
+    return bank % mbc->rom_banks;
+}
+
+static uint16_t current_ram_bank(struct mbc *mbc)
+{
+    if (!mbc->ram_size || !mbc->ram_enabled)
+        return MBC_NO_RAM;
+    switch (mbc->type) {
+    case MBC_1:
+        return mbc->mode ? mbc->ram_select & 0x03 : 0;
+    case MBC_3:
+        return mbc->ram_select < 0x04 ? mbc->ram_select : MBC_NO_RAM;
+    case MBC_5:
+        return mbc->ram_select & 0x0f;
+    default:
+        return 0;
+    }
+}
+
+static void map_ram(struct gb *gb, uint16_t bank)
+{
+    struct mbc *mbc = &gb->mbc;
+
+    for (int i = 0; i < RAM_BANK_SIZE >> 8; i++) {
+        // smaller chips are mirrored across the window
+        uint8_t *page = bank == MBC_NO_RAM ? NULL :
+                    &mbc->ram[((uint32_t)bank * RAM_BANK_SIZE + (i << 8)) % mbc->ram_size];
+
+        mmu_map(gb, 0xa0 + i, page, page);
+    }
+}
+
+// repoint the windows whose bank changed, or all of them
+static void remap(struct gb *gb, bool all)
+{
+    struct mbc *mbc = &gb->mbc;
+    uint16_t bank0 = current_rom_bank0(mbc);
+    uint16_t bank = current_rom_bank(mbc);
+    uint16_t ram_bank = current_ram_bank(mbc);
+
+    if (all || bank0 != mbc->rom_bank0)
+        mmu_map_rom(gb, 0x00, ROM_BANK_SIZE >> 8, (uint32_t)bank0 * ROM_BANK_SIZE);
+    if (all || bank != mbc->rom_bank)
+        mmu_map_rom(gb, 0x40, ROM_BANK_SIZE >> 8, (uint32_t)bank * ROM_BANK_SIZE);
+    if (all || ram_bank != mbc->ram_bank)
+        map_ram(gb, ram_bank);
+    mbc->rom_bank0 = bank0;
+    mbc->rom_bank = bank;
+    mbc->ram_bank = ram_bank;
+}
+
+/*******************************************************
+ *                      Battery                        *
+ *******************************************************/
+
+// RTC footer in the layout shared by most emulators: the running and latched
+// registers as 32-bit little-endian words, then the UNIX time it was written
+static void put_le(uint8_t *p, uint64_t val, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        p[i] = val >> (8 * i);
+}
+
+static uint64_t get_le(const uint8_t *p, int bytes)
+{
+    uint64_t val = 0;
+
+    for (int i = 0; i < bytes; i++)
+        val |= (uint64_t)p[i] << (8 * i);
+    return val;
+}
+
+static void write_rtc_footer(struct gb *gb, uint8_t *footer)
+{
+    struct rtc *rtc = &gb->mbc.rtc;
+
+    rtc_sync(gb);
+    for (int i = 0; i < RTC_REGS; i++) {
+        put_le(&footer[4 * i], rtc->regs[i], 4);
+        put_le(&footer[4 * (RTC_REGS + i)], rtc->latched[i], 4);
+    }
+    put_le(&footer[8 * RTC_REGS], time(NULL), 8);
+}
+
+// footer_size is 44 for files written with a 32-bit timestamp
+static void read_rtc_footer(struct gb *gb, const uint8_t *footer, uint32_t footer_size)
+{
+    struct rtc *rtc = &gb->mbc.rtc;
+    int64_t elapsed = time(NULL) - (int64_t)get_le(&footer[8 * RTC_REGS], footer_size - 8 * RTC_REGS);
+
+    for (int i = 0; i < RTC_REGS; i++) {
+        rtc->regs[i] = get_le(&footer[4 * i], 4) & rtc_masks[i];
+        rtc->latched[i] = get_le(&footer[4 * (RTC_REGS + i)], 4) & rtc_masks[i];
+    }
+    rtc->sync = gb->sched.now;
+    // the cartridge kept counting while it was switched off
+    if (elapsed > 0 && !(rtc->regs[RTC_DH] & 0x40))
+        rtc_advance(rtc->regs, elapsed);
+}
+
+// flush after the next frame once a save is done, otherwise after a while
+static void schedule_flush(struct gb *gb, bool save_done)
+{
+    uint64_t when = save_done ? (gb->sched.now / FRAME_CYCLES + 1) * FRAME_CYCLES :
+                                gb->sched.now + SAVE_INTERVAL;
+
+    if (gb->sched.slot[SCHED_SAVE] < 0 || gb->sched.heap[gb->sched.slot[SCHED_SAVE]].when > when)
+        sched_add(gb, SCHED_SAVE, when);
+}
+
+// hand the dirty pages of the save file to the kernel without waiting for the disk
+void mbc_flush(struct gb *gb)
+{
+    struct mbc *mbc = &gb->mbc;
+
+    if (!mbc->save)
+        return;
+    if (mbc->has_rtc)
+        write_rtc_footer(gb, &mbc->save[mbc->ram_size]);
+#if defined(__unix__)
+    msync(mbc->save, mbc->save_size, MS_ASYNC);
+#endif
+    mbc->flushes++;
+}
+
+void mbc_save_event(struct gb *gb, uint64_t late)
+{
+    (void)late;
+    mbc_flush(gb);
+    if (gb->mbc.ram_enabled)
+        schedule_flush(gb, false);
+}
+
+/*
+ * Back the cartridge RAM and clock with sav_path, created if missing. Call
+ * before running, the current RAM contents are replaced by the file's.
+ */
+bool mbc_open_save(struct gb *gb, const char *sav_path)
+{
+#if defined(__unix__)
+    struct mbc *mbc = &gb->mbc;
+    uint32_t size = mbc->ram_size + (mbc->has_rtc ? RTC_FOOTER_SIZE : 0);
+    struct stat st;
+    uint8_t *map;
+    int fd;
+
+    if (!mbc->battery || !size || mbc->save)
+        return false;
+    fd = open(sav_path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        printf("Can't open the save file. Path: %s\n", sav_path);
+        return false;
+    }
+    if (fstat(fd, &st) || (st.st_size < size && ftruncate(fd, size))) {
+        printf("Can't resize the save file. Path: %s\n", sav_path);
+        close(fd);
+        return false;
+    }
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        printf("Can't map the save file. Path: %s\n", sav_path);
+        return false;
+    }
+    if (mbc->has_rtc && st.st_size >= mbc->ram_size + RTC_FOOTER_SIZE - 4)
+        read_rtc_footer(gb, &map[mbc->ram_size], st.st_size - mbc->ram_size >= RTC_FOOTER_SIZE ?
+                    RTC_FOOTER_SIZE : RTC_FOOTER_SIZE - 4);
+    free(mbc->ram);
+    mbc->ram = mbc->ram_size ? map : NULL;
+    mbc->save = map;
+    mbc->save_size = size;
+    remap(gb, true);
+    if (mbc->ram_enabled)
+        schedule_flush(gb, false);
+    return true;
+#else
+    (void)gb;
+    (void)sav_path;
+    printf("Save files are not supported on this platform\n");
+    return false;
+#endif
+}
+
+// the registers and RAM were replaced by a savestate: map the banks they select, save the new RAM soon
+void mbc_restore(struct gb *gb)
+{
+    remap(gb, true);
+    if (gb->mbc.save) {
+        sched_cancel(gb, SCHED_SAVE);
+        schedule_flush(gb, true);
+    }
+}
+
+// a forked child gets a copy of the cartridge RAM and no save file, its writes are its own
+bool mbc_fork(struct gb *child, struct gb *parent)
+{
+    struct mbc *mbc = &child->mbc;
+
+    mbc->save = NULL;
+    mbc->save_size = 0;
+    if (parent->mbc.save)
+        sched_cancel(child, SCHED_SAVE);
+    if (mbc->ram_size) {
+        mbc->ram = malloc(mbc->ram_size);
+        if (!mbc->ram) {
+            printf("Can't allocate memory for cartridge RAM\n");
+            return false;
+        }
+        memcpy(mbc->ram, parent->mbc.ram, mbc->ram_size);
+        remap(child, true);
+    }
+    return true;
+}
+
+/*******************************************************
+ *                     Registers                       *
+ *******************************************************/
+
+static void mbc_write(struct gb *gb, uint16_t addr, uint8_t val)
+{
+    struct mbc *mbc = &gb->mbc;
+
+    if (mbc->type == MBC_NONE)
+        return;
+    switch (addr >> 13) {
+    case 0:
+        if (mbc->save && mbc->ram_enabled != ((val & 0x0f) == 0x0a))
+            schedule_flush(gb, mbc->ram_enabled);
+        mbc->ram_enabled = (val & 0x0f) == 0x0a;
+        break;
+    case 1:
+        if (mbc->type != MBC_5)
+            mbc->rom_select = val;
+        else if (addr < 0x3000)
+            mbc->rom_select = (mbc->rom_select & 0x100) | val;
+        else
+            mbc->rom_select = (mbc->rom_select & 0xff) | (val & 0x01) << 8;
+        break;
+    case 2:
+        mbc->ram_select = val;
+        break;
+    default:
+        if (mbc->type == MBC_1) {
+            mbc->mode = val & 0x01;
+        } else if (mbc->has_rtc) {
+            if (mbc->rtc.latch == 0x00 && val == 0x01) {
+                rtc_sync(gb);
+                memcpy(mbc->rtc.latched, mbc->rtc.regs, RTC_REGS);
+            }
+            mbc->rtc.latch = val;
+        }
+        break;
+    }
+    remap(gb, false);
+    // the code after the write may now come from another bank
+    gb->cpu.block_exit = true;
+}
+
+// the RAM window when no RAM bank is mapped into it
+static uint8_t cart_ram_read(struct gb *gb, uint16_t addr)
+{
+    (void)addr;
+    if (rtc_selected(&gb->mbc))
+        return gb->mbc.rtc.latched[gb->mbc.ram_select - 0x08];
+    return 0xff;
+}
+
+static void cart_ram_write(struct gb *gb, uint16_t addr, uint8_t val)
+{
+    struct rtc *rtc = &gb->mbc.rtc;
+    int reg = gb->mbc.ram_select - 0x08;
+
+    (void)addr;
+    if (!rtc_selected(&gb->mbc))
+        return;
+    rtc_sync(gb);
+    rtc->regs[reg] = val & rtc_masks[reg];
+    rtc->latched[reg] = rtc->regs[reg];
+    // writing the seconds restarts the current second
+    if (reg == RTC_S)
+        rtc->sync = gb->sched.now;
+}
+
+void mbc_init(struct gb *gb)
+{
+    struct mbc *mbc = &gb->mbc;
+    uint8_t code = gb->rom.info.size >= 0x150 ? gb->rom.data[0x147] : 0x00;
+    uint8_t ram_code = gb->rom.info.size >= 0x150 ? gb->rom.data[0x149] : 0x00;
+    const struct cart_type *type = &cart_types[0];
+
+    for (size_t i = 0; i < sizeof(cart_types) / sizeof(cart_types[0]); i++) {
+        if (cart_types[i].code == code)
+            type = &cart_types[i];
+    }
+    if (type->code != code)
+        printf("[WARNING] Unsupported cartridge type 0x%02x, running without a mapper\n", code);
+
+    mbc_destroy(gb);
+    memset(mbc, 0, sizeof(struct mbc));
+    mbc->type = type->type;
+    mbc->battery = type->battery;
+    mbc->has_rtc = type->rtc;
+    mbc->ram_enabled = type->type == MBC_NONE;
+    mbc->rom_banks = (gb->rom.info.size + ROM_BANK_SIZE - 1) / ROM_BANK_SIZE;
+    if (mbc->rom_banks < 2)
+        mbc->rom_banks = 2;
+    if (type->ram && ram_code < sizeof(ram_sizes) / sizeof(ram_sizes[0]))
+        mbc->ram_size = ram_sizes[ram_code];
+    if (mbc->ram_size) {
+        mbc->ram = calloc(1, mbc->ram_size);
+        if (!mbc->ram) {
+            printf("Can't allocate memory for cartridge RAM\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    mbc->rtc.latch = 0xff;
+    mbc->rtc.sync = gb->sched.now;
+
+    for (int page = 0x00; page < 0x80; page++)
+        gb->mmu.write_fn[page] = mbc_write;
+    for (int page = 0xa0; page < 0xc0; page++) {
+        gb->mmu.read_fn[page] = cart_ram_read;
+        gb->mmu.write_fn[page] = cart_ram_write;
+    }
+    remap(gb, true);
+}
+
+// flush and close the save file, or free the RAM when there is none
+void mbc_destroy(struct gb *gb)
+{
+    struct mbc *mbc = &gb->mbc;
+
+    if (mbc->save) {
+        mbc_flush(gb);
+#if defined(__unix__)
+        munmap(mbc->save, mbc->save_size);
+#endif
+        sched_cancel(gb, SCHED_SAVE);
+    } else {
+        free(mbc->ram);
+    }
+    mbc->ram = NULL;
+    mbc->save = NULL;
+}
@@ -1,11 +1,353 @@
 #include "mmu.h"
+#include "cpu.h"
+#include "block.h"
+#include "timer.h"
+#include "sched.h"
+#include "ppu.h"
 
-void mmu_write(struct gb *gb, uint16_t addr, uint8_t val)
+/*
+ * The address space is split into 256 pages of 256 bytes. A page is either
+ * backed by host memory (ROM, VRAM, WRAM, echo RAM), so an access is one load
+ * and an index, or served by the page's read/write handlers (cartridge
+ * registers, OAM, I/O). Writes to pages holding cached code are trapped so
+ * the block cache can drop stale translations.
+ *
+ * gb_fork() freezes the RAM pages of gb->mem into a refcounted copy that the
+ * parent and its children all read from. A page stays shared until its first
+ * write, which copies it back into the writer's own gb->mem. VRAM, OAM and
+ * I/O are read straight from gb->mem by the PPU and the CPU, so they are
+ * never shared and a fork copies them.
+ */
+
+static uint8_t open_bus_read(struct gb *gb, uint16_t addr)
+{
+    (void)gb;
+    (void)addr;
+    return 0xff;
+}
+
+static void ignore_write(struct gb *gb, uint16_t addr, uint8_t val)
+{
+    (void)gb;
+    (void)addr;
+    (void)val;
+}
+
+static uint8_t oam_read(struct gb *gb, uint16_t addr)
+{
+    // 0xfea0-0xfeff is not usable
+    return addr < 0xfea0 ? gb->mem[addr] : 0x00;
+}
+
+static void oam_write(struct gb *gb, uint16_t addr, uint8_t val)
+{
+    if (addr < 0xfea0)
+        gb->mem[addr] = val;
+}
+
+static uint8_t io_read(struct gb *gb, uint16_t addr)
+{
+    if (addr >= 0xff40 && addr <= 0xff4b)
+        return ppu_read(gb, addr);
+    switch (addr) {
+    case 0xff04: case 0xff05: case 0xff06: case 0xff07:
+        return timer_read(gb, addr);
+    default:
+        return gb->mem[addr];
+    }
+}
+
+static void io_write(struct gb *gb, uint16_t addr, uint8_t val)
 {
     gb->mem[addr] = val;
+    if (addr >= 0xff40 && addr <= 0xff4b)
+        ppu_write(gb, addr, val);
+    switch (addr) {
+    case 0xff04: case 0xff05: case 0xff06: case 0xff07:
+        timer_write(gb, addr, val);
+        break;
+    case 0xff0f:
+    case 0xffff:
+        cpu_check_interrupts(gb);
+        break;
+    default:
+        break;
+    }
+    // I/O may raise interrupts, HRAM is plain memory
+    if (addr < 0xff80 || addr == 0xffff)
+        gb->cpu.block_exit = true;
+}
+
+void mmu_map(struct gb *gb, uint8_t page, uint8_t *read, uint8_t *write)
+{
+    gb->mmu.read[page] = read;
+    gb->mmu.ram[page] = write;
+    gb->mmu.write[page] = gb->mmu.code[page] ? NULL : write;
+    gb->mmu.cow[page] = NULL;
+}
+
+void mmu_init(struct gb *gb)
+{
+    struct mmu *mmu = &gb->mmu;
+
+    mmu->shared = NULL;
+    mmu->cow_copies = 0;
+    for (int page = 0; page < MMU_PAGES; page++) {
+        mmu->code[page] = false;
+        mmu->read_fn[page] = open_bus_read;
+        mmu->write_fn[page] = ignore_write;
+        mmu_map(gb, page, NULL, NULL);
+    }
+    // VRAM and WRAM, the cartridge is mapped by mbc_init()
+    for (int page = 0x80; page < 0x98; page++) {
+        mmu->write_fn[page] = ppu_vram_write;
+        mmu_map(gb, page, &gb->mem[page << 8], NULL);
+    }
+    for (int page = 0x98; page < 0xa0; page++)
+        mmu_map(gb, page, &gb->mem[page << 8], &gb->mem[page << 8]);
+    for (int page = 0xc0; page < 0xe0; page++)
+        mmu_map(gb, page, &gb->mem[page << 8], &gb->mem[page << 8]);
+    // echo of 0xc000-0xddff
+    for (int page = 0xe0; page < 0xfe; page++)
+        mmu_map(gb, page, &gb->mem[(page - 0x20) << 8], &gb->mem[(page - 0x20) << 8]);
+    mmu->read_fn[0xfe] = oam_read;
+    mmu->write_fn[0xfe] = oam_write;
+    mmu->read_fn[0xff] = io_read;
+    mmu->write_fn[0xff] = io_write;
+}
+
+// count read-only pages from offset into the ROM image, open bus past its end
+void mmu_map_rom(struct gb *gb, uint8_t page, int count, uint32_t offset)
+{
+    for (int i = 0; i < count; i++, offset += 0x100) {
+        if (gb->rom.data && offset + 0x100 <= gb->rom.info.size)
+            mmu_map(gb, page + i, &gb->rom.data[offset], NULL);
+        else
+            mmu_map(gb, page + i, NULL, NULL);
+    }
+}
+
+// all 64 KiB as plain RAM in gb->mem, used by the CPU tests
+void mmu_map_flat(struct gb *gb)
+{
+    for (int page = 0; page < MMU_PAGES; page++)
+        mmu_map(gb, page, &gb->mem[page << 8], &gb->mem[page << 8]);
+    // with no I/O registers left the LCD could never be turned off, stop it raising interrupts
+    ppu_write(gb, 0xff40, 0x00);
+}
+
+// RAM the page writes to, shared pages included
+static uint8_t *own_ram(struct gb *gb, uint8_t page)
+{
+    return gb->mmu.cow[page] ? gb->mmu.cow[page] : gb->mmu.ram[page];
+}
+
+// the other page backed by the same RAM as page, or page itself
+static uint8_t echo_page(struct gb *gb, uint8_t page)
+{
+    uint8_t other = page < 0xe0 ? page + 0x20 : page - 0x20;
+
+    if (own_ram(gb, page) && own_ram(gb, page) == own_ram(gb, other))
+        return other;
+    return page;
+}
+
+void mmu_trap_code(struct gb *gb, uint8_t page)
+{
+    gb->mmu.code[page] = true;
+    gb->mmu.write[page] = NULL;
+    // code in WRAM can also be rewritten through echo RAM
+    page = echo_page(gb, page);
+    gb->mmu.code[page] = true;
+    gb->mmu.write[page] = NULL;
+}
+
+void mmu_untrap_code(struct gb *gb)
+{
+    for (int page = 0; page < MMU_PAGES; page++) {
+        if (gb->mmu.code[page]) {
+            gb->mmu.code[page] = false;
+            gb->mmu.write[page] = gb->mmu.ram[page];
+        }
+    }
+}
+
+void mmu_write_slow(struct gb *gb, uint16_t addr, uint8_t val)
+{
+    uint8_t page = addr >> 8;
+    uint8_t echo;
+
+    if (gb->mmu.cow[page])
+        mmu_unshare(gb, page);
+    echo = echo_page(gb, page);
+    if (gb->mmu.ram[page])
+        gb->mmu.ram[page][addr & 0xff] = val;
+    else
+        gb->mmu.write_fn[page](gb, addr, val);
+    if (!gb->cpu.blocks)
+        return;
+    if (gb->cpu.blocks->page_head[page] != BLOCK_NONE ||
+        gb->cpu.blocks->page_head[(uint8_t)(page - 1)] != BLOCK_NONE)
+        block_invalidate(gb, addr);
+    if (echo != page && (gb->cpu.blocks->page_head[echo] != BLOCK_NONE ||
+                         gb->cpu.blocks->page_head[(uint8_t)(echo - 1)] != BLOCK_NONE))
+        block_invalidate(gb, (echo << 8) | (addr & 0xff));
+}
+
+// bank visible at addr, used to tell cached code from different banks apart
+uint16_t mmu_bank(struct gb *gb, uint16_t addr)
+{
+    if (addr < 0x4000)
+        return gb->mbc.rom_bank0;
+    if (addr < 0x8000)
+        return gb->mbc.rom_bank;
+    if (addr >= 0xa000 && addr < 0xc000)
+        return gb->mbc.ram_bank;
+    return 0;
+}
+
+// first cycle at which a read of addr may return something new without a CPU write
+uint64_t mmu_next_change(struct gb *gb, uint16_t addr)
+{
+    if (!gb->mmu.read[addr >> 8] && (addr == 0xff04 || addr == 0xff05))
+        return timer_next_change(gb, addr);
+    return gb->sched.next;
+}
+
+/*******************************************************
+ *                    Shared pages                     *
+ *******************************************************/
+
+static void release_shared(struct mmu_shared *shared)
+{
+    if (shared && atomic_fetch_sub_explicit(&shared->refs, 1, memory_order_acq_rel) == 1)
+        free(shared);
+}
+
+// gb->mem behind page if it is plain RAM that can be shared, NULL otherwise
+static uint8_t *shareable(struct gb *gb, int page)
+{
+    uint8_t *ram = gb->mmu.ram[page];
+    size_t offset;
+
+    if (gb->mmu.cow[page])
+        return gb->mmu.cow[page];
+    if (!ram || ram < gb->mem || ram >= gb->mem + GB_MEM_SIZE)
+        return NULL;
+    offset = ram - gb->mem;
+    if ((offset >= 0x8000 && offset < 0xa000) || offset >= 0xfe00)
+        return NULL;
+    return ram;
+}
+
+// point every shareable page at a frozen copy, which is kept while no page has been written since
+bool mmu_share(struct gb *gb)
+{
+    struct mmu *mmu = &gb->mmu;
+    struct mmu_shared *shared;
+    bool current = mmu->shared;
+
+    for (int page = 0; page < MMU_PAGES && current; page++) {
+        if (shareable(gb, page) && !mmu->cow[page])
+            current = false;
+    }
+    if (current)
+        return true;
+    shared = malloc(sizeof(struct mmu_shared));
+    if (!shared) {
+        printf("[ERROR] Can't allocate the shared pages\n");
+        return false;
+    }
+    atomic_init(&shared->refs, 1);
+    for (int page = 0; page < MMU_PAGES; page++) {
+        uint8_t *own = shareable(gb, page);
+        uint8_t *frozen;
+
+        if (!own)
+            continue;
+        frozen = &shared->data[own - gb->mem];
+        memcpy(frozen, mmu->read[page], 0x100);
+        mmu_map(gb, page, frozen, NULL);
+        mmu->cow[page] = own;
+    }
+    release_shared(mmu->shared);
+    mmu->shared = shared;
+    return true;
+}
+
+static uint8_t *rebase(uint8_t *p, const struct gb *from, struct gb *to)
+{
+    if (p >= from->mem && p < from->mem + GB_MEM_SIZE)
+        return to->mem + (p - from->mem);
+    return p;
+}
+
+// gb's page table was copied from another instance's, point it at gb's own memory
+void mmu_rebase(struct gb *gb, const struct gb *from)
+{
+    struct mmu *mmu = &gb->mmu;
+
+    if (mmu->shared)
+        atomic_fetch_add_explicit(&mmu->shared->refs, 1, memory_order_relaxed);
+    mmu->cow_copies = 0;
+    for (int page = 0; page < MMU_PAGES; page++) {
+        mmu->read[page] = rebase(mmu->read[page], from, gb);
+        mmu->write[page] = rebase(mmu->write[page], from, gb);
+        mmu->ram[page] = rebase(mmu->ram[page], from, gb);
+        mmu->cow[page] = rebase(mmu->cow[page], from, gb);
+    }
+}
+
+// child is a copy of parent made after mmu_share(parent), give it its own pointers and private pages
+void mmu_fork(struct gb *child, struct gb *parent)
+{
+    mmu_rebase(child, parent);
+    for (int page = 0; page < MMU_PAGES; page++) {
+        uint8_t *read = parent->mmu.read[page];
+
+        if (read >= parent->mem && read < parent->mem + GB_MEM_SIZE)
+            memcpy(child->mmu.read[page], read, 0x100);
+    }
+    // OAM, I/O and HRAM are behind handlers
+    memcpy(&child->mem[0xfe00], &parent->mem[0xfe00], 0x200);
+}
+
+// copy a shared page into gb->mem, along with the echo page sharing it
+void mmu_unshare(struct gb *gb, uint8_t page)
+{
+    struct mmu *mmu = &gb->mmu;
+    uint8_t *own = mmu->cow[page];
+    const uint8_t pages[3] = { page, page + 0x20, page - 0x20 };
+
+    memcpy(own, mmu->read[page], 0x100);
+    for (int i = 0; i < 3; i++) {
+        if (mmu->cow[pages[i]] == own)
+            mmu_map(gb, pages[i], own, own);
+    }
+    mmu->cow_copies++;
+}
+
+// what gb->mem holds for page, wherever it is
+const uint8_t *mmu_mem_page(struct gb *gb, uint8_t page)
+{
+    if (gb->mmu.cow[page] == &gb->mem[page << 8])
+        return gb->mmu.read[page];
+    return &gb->mem[page << 8];
 }
 
-uint8_t mmu_read(struct gb *gb, uint16_t addr)
+int mmu_shared_pages(struct gb *gb)
 {
-    return gb->mem[addr];
-}
\ No newline at end of file
+    int count = 0;
+
+    for (int page = 0; page < MMU_PAGES; page++) {
+        if (gb->mmu.cow[page] == &gb->mem[page << 8])
+            count++;
+    }
+    return count;
+}
+
+void mmu_destroy(struct gb *gb)
+{
+    release_shared(gb->mmu.shared);
+    gb->mmu.shared = NULL;
+}
@@ -0,0 +1,232 @@
+#include "pixel.h"
+
+#define OBJ_BG_PRIORITY     0x80
+#define OBJ_PALETTE         0x10
+
+/*******************************************************
+ *                      Scalar                         *
+ *******************************************************/
+
+// bit 7 - i of bits to bit 0 of byte i, a multiply spreads all eight at once
+static uint64_t spread_bits(uint8_t bits)
+{
+    return ((bits * 0x8040201008040201ULL) >> 7) & 0x0101010101010101ULL;
+}
+
+static void decode_scalar(uint8_t *out, uint8_t lo, uint8_t hi)
+{
+    uint64_t row = spread_bits(lo) | spread_bits(hi) << 1;
+
+    for (int x = 0; x < 8; x++)
+        out[x] = row >> (8 * x);
+}
+
+static void palette_scalar(uint8_t *out, const uint8_t *idx, uint8_t pal, int count)
+{
+    uint8_t shade[4] = { pal & 0x03, (pal >> 2) & 0x03, (pal >> 4) & 0x03, pal >> 6 };
+
+    for (int x = 0; x < count; x++)
+        out[x] = shade[idx[x]];
+}
+
+static void merge_scalar(uint8_t *out, const uint8_t *bg, const uint8_t *obj, const uint8_t *attr,
+                         uint8_t bgp, const uint8_t *obp, int count)
+{
+    for (int x = 0; x < count; x++) {
+        if (obj[x] && !((attr[x] & OBJ_BG_PRIORITY) && bg[x]))
+            out[x] = (obp[!!(attr[x] & OBJ_PALETTE)] >> (2 * obj[x])) & 0x03;
+        else
+            out[x] = (bgp >> (2 * bg[x])) & 0x03;
+    }
+}
+
+const struct pixel_kernels pixel_scalar = {
+    "scalar", decode_scalar, palette_scalar, merge_scalar,
+};
+
+#if defined(HAVE_PIXEL_SIMD)
+#include <immintrin.h>
+
+/*******************************************************
+ *                       SSE2                          *
+ *******************************************************/
+
+__attribute__((target("sse2")))
+static void decode_sse2(uint8_t *out, uint8_t lo, uint8_t hi)
+{
+    const __m128i bits = _mm_setr_epi8(0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+                                       0, 0, 0, 0, 0, 0, 0, 0);
+    __m128i b0 = _mm_cmpeq_epi8(_mm_and_si128(_mm_set1_epi8(lo), bits), bits);
+    __m128i b1 = _mm_cmpeq_epi8(_mm_and_si128(_mm_set1_epi8(hi), bits), bits);
+
+    b0 = _mm_and_si128(b0, _mm_set1_epi8(1));
+    b1 = _mm_and_si128(b1, _mm_set1_epi8(2));
+    _mm_storel_epi64((__m128i *)out, _mm_or_si128(b0, b1));
+}
+
+// no byte shuffle before SSSE3: select each of the four shades by compare
+struct shades_sse2 {
+    __m128i shade[4];
+};
+
+__attribute__((target("sse2")))
+static inline struct shades_sse2 shades_sse2(uint8_t pal)
+{
+    struct shades_sse2 s;
+
+    for (int i = 0; i < 4; i++)
+        s.shade[i] = _mm_set1_epi8((pal >> (2 * i)) & 0x03);
+    return s;
+}
+
+__attribute__((target("sse2")))
+static inline __m128i lookup_sse2(__m128i idx, const struct shades_sse2 *s)
+{
+    __m128i r = _mm_and_si128(_mm_cmpeq_epi8(idx, _mm_setzero_si128()), s->shade[0]);
+
+    r = _mm_or_si128(r, _mm_and_si128(_mm_cmpeq_epi8(idx, _mm_set1_epi8(1)), s->shade[1]));
+    r = _mm_or_si128(r, _mm_and_si128(_mm_cmpeq_epi8(idx, _mm_set1_epi8(2)), s->shade[2]));
+    return _mm_or_si128(r, _mm_and_si128(_mm_cmpeq_epi8(idx, _mm_set1_epi8(3)), s->shade[3]));
+}
+
+__attribute__((target("sse2")))
+static void palette_sse2(uint8_t *out, const uint8_t *idx, uint8_t pal, int count)
+{
+    const struct shades_sse2 s = shades_sse2(pal);
+    int x = 0;
+
+    for (; x + 16 <= count; x += 16)
+        _mm_storeu_si128((__m128i *)&out[x], lookup_sse2(_mm_loadu_si128((const __m128i *)&idx[x]), &s));
+    palette_scalar(&out[x], &idx[x], pal, count - x);
+}
+
+__attribute__((target("sse2")))
+static void merge_sse2(uint8_t *out, const uint8_t *bg, const uint8_t *obj, const uint8_t *attr,
+                       uint8_t bgp, const uint8_t *obp, int count)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i priority = _mm_set1_epi8((char)OBJ_BG_PRIORITY);
+    const __m128i palette = _mm_set1_epi8(OBJ_PALETTE);
+    const struct shades_sse2 bg_shades = shades_sse2(bgp);
+    const struct shades_sse2 obj_shades[2] = { shades_sse2(obp[0]), shades_sse2(obp[1]) };
+    int x = 0;
+
+    for (; x + 16 <= count; x += 16) {
+        __m128i b = _mm_loadu_si128((const __m128i *)&bg[x]);
+        __m128i o = _mm_loadu_si128((const __m128i *)&obj[x]);
+        __m128i a = _mm_loadu_si128((const __m128i *)&attr[x]);
+        __m128i pal1 = _mm_cmpeq_epi8(_mm_and_si128(a, palette), palette);
+        __m128i obj_shade = _mm_or_si128(_mm_and_si128(pal1, lookup_sse2(o, &obj_shades[1])),
+                                         _mm_andnot_si128(pal1, lookup_sse2(o, &obj_shades[0])));
+        __m128i behind = _mm_andnot_si128(_mm_cmpeq_epi8(b, zero),
+                                          _mm_cmpeq_epi8(_mm_and_si128(a, priority), priority));
+        __m128i hide = _mm_or_si128(behind, _mm_cmpeq_epi8(o, zero));
+
+        _mm_storeu_si128((__m128i *)&out[x], _mm_or_si128(_mm_andnot_si128(hide, obj_shade),
+                                                          _mm_and_si128(hide, lookup_sse2(b, &bg_shades))));
+    }
+    merge_scalar(&out[x], &bg[x], &obj[x], &attr[x], bgp, obp, count - x);
+}
+
+const struct pixel_kernels pixel_sse2 = {
+    "sse2", decode_sse2, palette_sse2, merge_sse2,
+};
+
+/*******************************************************
+ *                       AVX2                          *
+ *******************************************************/
+
+/*
+ * Tails are finished by the scalar code: calling the SSE2 kernels from here
+ * would mix legacy SSE with dirty upper YMM halves, which stalls some cores.
+ */
+
+// the palette as a byte shuffle table in both lanes
+__attribute__((target("avx2")))
+static inline __m256i table_avx2(uint8_t pal)
+{
+    return _mm256_setr_epi8(pal & 0x03, (pal >> 2) & 0x03, (pal >> 4) & 0x03, pal >> 6,
+                            0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                            pal & 0x03, (pal >> 2) & 0x03, (pal >> 4) & 0x03, pal >> 6,
+                            0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+}
+
+__attribute__((target("avx2")))
+static void palette_avx2(uint8_t *out, const uint8_t *idx, uint8_t pal, int count)
+{
+    const __m256i table = table_avx2(pal);
+    int x = 0;
+
+    for (; x + 32 <= count; x += 32) {
+        __m256i i = _mm256_loadu_si256((const __m256i *)&idx[x]);
+
+        _mm256_storeu_si256((__m256i *)&out[x], _mm256_shuffle_epi8(table, i));
+    }
+    palette_scalar(&out[x], &idx[x], pal, count - x);
+}
+
+__attribute__((target("avx2")))
+static void merge_avx2(uint8_t *out, const uint8_t *bg, const uint8_t *obj, const uint8_t *attr,
+                       uint8_t bgp, const uint8_t *obp, int count)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i priority = _mm256_set1_epi8((char)OBJ_BG_PRIORITY);
+    const __m256i palette = _mm256_set1_epi8(OBJ_PALETTE);
+    const __m256i bg_table = table_avx2(bgp);
+    const __m256i obj_table[2] = { table_avx2(obp[0]), table_avx2(obp[1]) };
+    int x = 0;
+
+    for (; x + 32 <= count; x += 32) {
+        __m256i b = _mm256_loadu_si256((const __m256i *)&bg[x]);
+        __m256i o = _mm256_loadu_si256((const __m256i *)&obj[x]);
+        __m256i a = _mm256_loadu_si256((const __m256i *)&attr[x]);
+        __m256i pal1 = _mm256_cmpeq_epi8(_mm256_and_si256(a, palette), palette);
+        __m256i obj_shade = _mm256_blendv_epi8(_mm256_shuffle_epi8(obj_table[0], o),
+                                               _mm256_shuffle_epi8(obj_table[1], o), pal1);
+        __m256i behind = _mm256_andnot_si256(_mm256_cmpeq_epi8(b, zero),
+                                             _mm256_cmpeq_epi8(_mm256_and_si256(a, priority), priority));
+        __m256i hide = _mm256_or_si256(behind, _mm256_cmpeq_epi8(o, zero));
+
+        _mm256_storeu_si256((__m256i *)&out[x], _mm256_blendv_epi8(obj_shade,
+                                                        _mm256_shuffle_epi8(bg_table, b), hide));
+    }
+    merge_scalar(&out[x], &bg[x], &obj[x], &attr[x], bgp, obp, count - x);
+}
+
+// a tile row is too narrow to gain anything over SSE2
+const struct pixel_kernels pixel_avx2 = {
+    "avx2", decode_sse2, palette_avx2, merge_avx2,
+};
+
+bool pixel_supported(const struct pixel_kernels *kernels)
+{
+    __builtin_cpu_init();
+    if (kernels == &pixel_avx2)
+        return __builtin_cpu_supports("avx2");
+    if (kernels == &pixel_sse2)
+        return __builtin_cpu_supports("sse2");
+    return true;
+}
+
+const struct pixel_kernels *pixel_kernels(void)
+{
+    if (pixel_supported(&pixel_avx2))
+        return &pixel_avx2;
+    if (pixel_supported(&pixel_sse2))
+        return &pixel_sse2;
+    return &pixel_scalar;
+}
+
+#else
+
+bool pixel_supported(const struct pixel_kernels *kernels)
+{
+    return kernels == &pixel_scalar;
+}
+
+const struct pixel_kernels *pixel_kernels(void)
+{
+    return &pixel_scalar;
+}
+
+#endif
@@ -0,0 +1,110 @@
+#include "pool.h"
+
+#if defined(__unix__)
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+/*
+ * Instances carved out of one mapping instead of one malloc() each. Getting
+ * and putting back a slot is a push or a pop on a free list, and the pages
+ * stay mapped (and faulted in) from one instance to the next. The mapping
+ * asks for explicit huge pages first, which need pages reserved by the
+ * administrator, then falls back to plain pages with a transparent huge
+ * page hint, so the TLB covers many instances per entry either way.
+ */
+
+static void *map_pool(struct gb_pool *pool)
+{
+#if defined(__unix__)
+    void *base;
+
+#if defined(MAP_HUGETLB)
+    base = mmap(NULL, pool->size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (base != MAP_FAILED) {
+        pool->huge = true;
+        return base;
+    }
+#endif
+    base = mmap(NULL, pool->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+#if defined(MADV_HUGEPAGE)
+    madvise(base, pool->size, MADV_HUGEPAGE);
+#endif
+    return base;
+#else
+    return aligned_alloc(POOL_HUGE_PAGE, pool->size);
+#endif
+}
+
+struct gb_pool *gb_pool_create(int capacity)
+{
+    struct gb_pool *pool;
+    size_t page = 4096;
+
+#if defined(__unix__)
+    page = sysconf(_SC_PAGESIZE);
+#endif
+    if (capacity < 1) {
+        printf("[ERROR] An instance pool needs room for at least one instance\n");
+        return NULL;
+    }
+    pool = calloc(1, sizeof(struct gb_pool));
+    if (!pool) {
+        printf("[ERROR] Can't allocate the instance pool\n");
+        return NULL;
+    }
+    pool->capacity = capacity;
+    pool->slot_size = (sizeof(struct gb) + page - 1) / page * page;
+    pool->size = (pool->slot_size * capacity + POOL_HUGE_PAGE - 1) / POOL_HUGE_PAGE * POOL_HUGE_PAGE;
+    pool->free = malloc(capacity * sizeof(int));
+    pool->base = pool->free ? map_pool(pool) : NULL;
+    if (!pool->base) {
+        printf("[ERROR] Can't map %zu bytes for the instance pool\n", pool->size);
+        free(pool->free);
+        free(pool);
+        return NULL;
+    }
+    // handed out lowest address first
+    for (int i = 0; i < capacity; i++)
+        pool->free[i] = capacity - 1 - i;
+    pool->n_free = capacity;
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+// every instance taken from the pool must have been destroyed
+void gb_pool_destroy(struct gb_pool *pool)
+{
+    if (!pool)
+        return;
+#if defined(__unix__)
+    munmap(pool->base, pool->size);
+#else
+    free(pool->base);
+#endif
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->free);
+    free(pool);
+}
+
+// memory for one instance, not initialised, NULL when the pool is full
+struct gb *gb_pool_get(struct gb_pool *pool)
+{
+    struct gb *gb = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->n_free)
+        gb = (struct gb *)(pool->base + pool->free[--pool->n_free] * pool->slot_size);
+    pthread_mutex_unlock(&pool->lock);
+    return gb;
+}
+
+void gb_pool_put(struct gb_pool *pool, struct gb *gb)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->free[pool->n_free++] = ((uint8_t *)gb - pool->base) / pool->slot_size;
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,845 @@
+#include "ppu.h"
+#include "cpu.h"
+#include "mmu.h"
+#include "sched.h"
+#include "pixel.h"
+
+/*
+ * The PPU is not ticked: a SCHED_PPU event fires on each mode change and
+ * LY/STAT are read from the state it leaves behind. Mode 3 is drawn by one of
+ * two renderers, picked when the instance is created:
+ *
+ * - PPU_SCANLINE draws a whole line when mode 3 ends, using the registers as
+ *   they are then. Mode 3 always lasts DRAW_CYCLES.
+ * - PPU_FIFO runs the pixel fetcher and FIFOs dot by dot, so mode 3 gets
+ *   longer with SCX, the window and sprites, and writes made mid-line show
+ *   up from the pixel they hit. It is caught up lazily: before any PPU
+ *   register or VRAM write and when the event marking the end of mode 3
+ *   fires, that event being moved on while pixels are left.
+ *
+ * Both share the OAM scan and the tile fetches.
+ *
+ * Tile data is kept decoded in ppu.tiles, one colour index per byte, and the
+ * row touched by a write to 0x8000-0x97ff is decoded again on the spot, so
+ * drawing a line is only copies and palette lookups. Those go through the
+ * pixel kernels (pixel.c), vectorised where the host allows it.
+ *
+ * With rendering off only the pixels are skipped: modes, LY, interrupts, the
+ * window line counter and the length of mode 3 under the FIFO are all kept,
+ * so the game cannot tell the difference. Whether a frame is drawn is decided
+ * as it begins, on line 0.
+ *
+ * Lines go straight into the buffer registered with ppu_set_output(), in its
+ * pixel format, by default ppu.framebuffer as shades. A new buffer is only
+ * switched to when a frame begins, so the caller double buffers by handing
+ * over the next one as soon as ppu.frames ticks over.
+ *
+ * Every drawn line is hashed and compared with the same line of the previous
+ * drawn frame, so that a frontend can send only the lines that changed.
+ *
+ * On top of that each line can be folded into a downscaled observation frame
+ * for learning agents (ppu_set_observation), kept in a ring for frame
+ * stacking.
+ */
+
+#define LCDC_BG             0x01
+#define LCDC_OBJ            0x02
+#define LCDC_OBJ_SIZE       0x04
+#define LCDC_BG_MAP         0x08
+#define LCDC_TILE_DATA      0x10
+#define LCDC_WIN            0x20
+#define LCDC_WIN_MAP        0x40
+#define LCDC_ON             0x80
+
+#define OAM_CYCLES          80
+#define DRAW_CYCLES         172
+#define LINE_CYCLES         456
+#define VBLANK_LINE         144
+#define LINES               154
+
+#define FETCH_DOTS          6
+#define OBJ_BG_PRIORITY     0x80
+#define OBJ_Y_FLIP          0x40
+#define OBJ_X_FLIP          0x20
+#define OBJ_PALETTE         0x10
+
+static void fifo_sync(struct gb *gb);
+static void set_output(struct ppu_output *out, void *pixels, size_t stride, ppu_format_t format);
+static void observe_line(struct ppu *ppu, const uint8_t *shades);
+
+void ppu_init(struct gb *gb, ppu_renderer_t renderer)
+{
+    struct ppu *ppu = &gb->ppu;
+
+    memset(ppu, 0, sizeof(struct ppu));
+    ppu->renderer = renderer;
+    ppu->kernels = pixel_kernels();
+    ppu->render = true;
+    ppu->drawing = true;
+    set_output(&ppu->output, ppu->framebuffer, SCREEN_WIDTH, PPU_FORMAT_SHADE);
+    // the FIFO has to see tile map writes too, to catch up first
+    if (renderer == PPU_FIFO) {
+        for (int page = 0x98; page < 0xa0; page++) {
+            gb->mmu.write_fn[page] = ppu_vram_write;
+            mmu_map(gb, page, &gb->mem[page << 8], NULL);
+        }
+    }
+    // state left by the boot ROM
+    ppu->bgp = 0xfc;
+    ppu_write(gb, 0xff40, 0x91);
+}
+
+/*******************************************************
+ *                       Output                        *
+ *******************************************************/
+
+static const uint8_t grey[4] = { 0xff, 0xaa, 0x55, 0x00 };
+
+static void set_output(struct ppu_output *out, void *pixels, size_t stride, ppu_format_t format)
+{
+    out->pixels = pixels;
+    out->stride = stride;
+    out->format = format;
+    for (int i = 0; i < 4; i++) {
+        uint8_t g = grey[i];
+        uint8_t rgba[4] = { g, g, g, 0xff };
+
+        switch (format) {
+        case PPU_FORMAT_SHADE: out->colors[i] = i; break;
+        case PPU_FORMAT_RGBA8888: memcpy(&out->colors[i], rgba, 4); break;
+        case PPU_FORMAT_XRGB8888: out->colors[i] = 0xff000000u | g << 16 | g << 8 | g; break;
+        case PPU_FORMAT_RGB565: out->colors[i] = (g >> 3) << 11 | (g >> 2) << 5 | g >> 3; break;
+        }
+    }
+}
+
+/*
+ * Draw into pixels from the next frame on, stride being the bytes from one
+ * line to the next. Until the frame is over the buffer belongs to the PPU.
+ */
+bool ppu_set_output(struct gb *gb, void *pixels, size_t stride, ppu_format_t format)
+{
+    static const size_t bpp[] = { 1, 4, 4, 2 };
+    struct ppu *ppu = &gb->ppu;
+
+    if (!pixels || (unsigned)format > PPU_FORMAT_RGB565 || stride < SCREEN_WIDTH * bpp[format]) {
+        printf("[ERROR] Bad framebuffer format %d or stride %zu\n", format, stride);
+        return false;
+    }
+    set_output(&ppu->next_output, pixels, stride, format);
+    ppu->output_pending = true;
+    // nothing of the current frame drawn yet
+    if (!(ppu->lcdc & LCDC_ON) || (ppu->ly == 0 && ppu->mode == PPU_OAM)) {
+        ppu->output = ppu->next_output;
+        ppu->output_pending = false;
+    }
+    return true;
+}
+
+// a forked child draws into its own framebuffer, the parent's outputs and observations stay the parent's
+void ppu_fork(struct gb *child, struct gb *parent)
+{
+    struct ppu *ppu = &child->ppu;
+
+    if (ppu->output.pixels == parent->ppu.framebuffer)
+        ppu->output.pixels = ppu->framebuffer;
+    else
+        set_output(&ppu->output, ppu->framebuffer, SCREEN_WIDTH, PPU_FORMAT_SHADE);
+    ppu->next_output = ppu->output;
+    ppu->output_pending = false;
+    ppu->obs.ring = NULL;
+}
+
+// where the shades of the current line are drawn
+static uint8_t *line_shades(struct ppu *ppu)
+{
+    if (ppu->output.format == PPU_FORMAT_SHADE)
+        return (uint8_t *)ppu->output.pixels + ppu->ly * ppu->output.stride;
+    return ppu->line;
+}
+
+static uint64_t hash_line(const uint8_t *shades)
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+
+    for (int x = 0; x < SCREEN_WIDTH; x += 8) {
+        uint64_t word;
+
+        memcpy(&word, &shades[x], 8);
+        h = (h ^ word) * 0x9e3779b97f4a7c15ull;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+// convert the line drawn in ppu.line to the output format
+static void emit_line(struct ppu *ppu)
+{
+    struct ppu_output *out = &ppu->output;
+    void *row = (uint8_t *)out->pixels + ppu->ly * out->stride;
+    const uint8_t *shades = line_shades(ppu);
+    uint64_t hash = hash_line(shades);
+
+    if (hash != ppu->line_hash[ppu->ly]) {
+        ppu->line_hash[ppu->ly] = hash;
+        ppu->dirty_next[ppu->ly / 8] |= 1 << (ppu->ly % 8);
+    }
+    if (ppu->obs.ring)
+        observe_line(ppu, shades);
+    switch (out->format) {
+    case PPU_FORMAT_SHADE:
+        break;
+    case PPU_FORMAT_RGBA8888:
+    case PPU_FORMAT_XRGB8888: {
+        uint32_t *dst = row;
+
+        for (int x = 0; x < SCREEN_WIDTH; x++)
+            dst[x] = out->colors[ppu->line[x]];
+        break;
+    }
+    case PPU_FORMAT_RGB565: {
+        uint16_t *dst = row;
+
+        for (int x = 0; x < SCREEN_WIDTH; x++)
+            dst[x] = out->colors[ppu->line[x]];
+        break;
+    }
+    }
+}
+
+/*
+ * Lines of the last complete frame that differ from the frame drawn before
+ * it. Frames skipped while rendering is off show no change.
+ */
+const uint8_t *ppu_dirty_lines(struct gb *gb)
+{
+    return gb->ppu.dirty;
+}
+
+/*******************************************************
+ *                    Observation                      *
+ *******************************************************/
+
+/*
+ * Source pixel i covers [i * dst, (i + 1) * dst) and output pixel j covers
+ * [j * src, (j + 1) * src), so a source pixel overlaps one output pixel or
+ * straddles two. Sums are weighted by overlap and divided by src_w * src_h.
+ */
+static void area_weights(uint8_t *map, uint8_t *weight, int src, int dst)
+{
+    for (int i = 0; i < src; i++) {
+        int start = i * dst;
+        int j = start / src;
+        int boundary = (j + 1) * src;
+
+        map[i] = j;
+        weight[i] = start + dst > boundary ? start + dst - boundary : 0;
+    }
+}
+
+/*
+ * Write downscaled frames into ring, depth frames of width * height bytes
+ * used in turn. A frame fills its slot line by line as it is drawn, so when
+ * the caller stacks frames while the next one is being drawn depth needs
+ * one more slot than the stack. A NULL ring turns observations off.
+ */
+bool ppu_set_observation(struct gb *gb, uint8_t *ring, int depth, int width, int height,
+                         ppu_obs_format_t format, ppu_obs_filter_t filter)
+{
+    struct ppu_observation *obs = &gb->ppu.obs;
+
+    if (ring && (depth < 1 || width < 1 || width > SCREEN_WIDTH || height < 1 || height > SCREEN_HEIGHT)) {
+        printf("[ERROR] Bad observation size %dx%d or depth %d\n", width, height, depth);
+        return false;
+    }
+    memset(obs, 0, sizeof(struct ppu_observation));
+    obs->ring = ring;
+    obs->depth = depth;
+    obs->width = width;
+    obs->height = height;
+    obs->format = format;
+    obs->filter = filter;
+    for (int i = 0; i < 4; i++)
+        obs->value[i] = format == PPU_OBS_GRAY ? grey[i] : i;
+    if (filter == PPU_OBS_AREA) {
+        area_weights(obs->map_x, obs->weight_x, SCREEN_WIDTH, width);
+        area_weights(obs->map_y, obs->weight_y, SCREEN_HEIGHT, height);
+    } else {
+        // sample the middle of each output pixel
+        memset(obs->map_y, 0xff, sizeof(obs->map_y));
+        for (int j = 0; j < width; j++)
+            obs->map_x[j] = (2 * j + 1) * SCREEN_WIDTH / (2 * width);
+        for (int j = 0; j < height; j++)
+            obs->map_y[(2 * j + 1) * SCREEN_HEIGHT / (2 * height)] = j;
+    }
+    // a frame already under way is not observed
+    obs->row = (gb->ppu.lcdc & LCDC_ON) && !(gb->ppu.ly == 0 && gb->ppu.mode == PPU_OAM) ? height : 0;
+    return true;
+}
+
+// latest complete frame when age is 0, the one before when 1... NULL when not there
+const uint8_t *ppu_observation(struct gb *gb, int age)
+{
+    struct ppu_observation *obs = &gb->ppu.obs;
+
+    if (!obs->ring || age < 0 || age >= obs->depth || (uint64_t)age >= obs->count)
+        return NULL;
+    return obs->ring + ((obs->count - 1 - age) % obs->depth) * obs->width * obs->height;
+}
+
+static void observe_line(struct ppu *ppu, const uint8_t *shades)
+{
+    struct ppu_observation *obs = &ppu->obs;
+    uint8_t *frame = obs->ring + (obs->count % obs->depth) * obs->width * obs->height;
+    int ly = ppu->ly;
+
+    if (obs->row == obs->height)
+        return;
+    if (obs->filter == PPU_OBS_NEAREST) {
+        uint8_t *out = frame + obs->map_y[ly] * obs->width;
+
+        if (obs->map_y[ly] == 0xff)
+            return;
+        for (int j = 0; j < obs->width; j++)
+            out[j] = obs->value[shades[obs->map_x[j]]];
+        obs->row++;
+    } else {
+        uint32_t area = SCREEN_WIDTH * SCREEN_HEIGHT;
+        uint32_t wy1 = obs->weight_y[ly];
+        uint32_t wy0 = obs->height - wy1;
+        // both kinds of output are linear in the shade
+        int32_t base = obs->value[0];
+        int32_t step = obs->value[1] - obs->value[0];
+
+        // vertical pass first, each line split between the two output rows it covers
+        uint8_t line[SCREEN_WIDTH];
+
+        // a local copy cannot alias the sums, which keeps this loop vectorisable
+        memcpy(line, shades, SCREEN_WIDTH);
+        for (int x = 0; x < SCREEN_WIDTH; x++) {
+            uint32_t v = base + step * line[x];
+
+            obs->acc[0][x] += v * wy0;
+            obs->acc[1][x] += v * wy1;
+        }
+        // the output row is complete once this line reaches its bottom edge, then
+        // the horizontal pass, where output pixels only ever move on by one
+        if ((ly + 1) * obs->height >= (obs->row + 1) * SCREEN_HEIGHT) {
+            uint8_t *out = frame + obs->row * obs->width;
+            uint32_t sum = 0, next = 0;
+            int j = 0;
+
+            for (int x = 0; x < SCREEN_WIDTH; x++) {
+                uint32_t v = obs->acc[0][x];
+                uint32_t w1 = obs->weight_x[x];
+
+                if (obs->map_x[x] != j) {
+                    out[j++] = (sum + area / 2) / area;
+                    sum = next;
+                    next = 0;
+                }
+                sum += v * (obs->width - w1);
+                next += v * w1;
+            }
+            out[j] = (sum + area / 2) / area;
+            memcpy(obs->acc[0], obs->acc[1], sizeof(obs->acc[0]));
+            memset(obs->acc[1], 0, sizeof(obs->acc[1]));
+            obs->row++;
+        }
+    }
+    if (obs->row == obs->height)
+        obs->count++;
+}
+
+/*******************************************************
+ *                     Tile cache                      *
+ *******************************************************/
+
+static void decode_row(struct gb *gb, uint16_t addr)
+{
+    uint16_t offset = (addr - 0x8000) & ~1;
+    uint8_t lo = gb->mem[0x8000 + offset];
+    uint8_t hi = gb->mem[0x8000 + offset + 1];
+
+    gb->ppu.kernels->decode(gb->ppu.tiles[offset / 16][(offset / 2) & 7], lo, hi);
+}
+
+// replace 0x8000-0x97ff with data, only decoding the tiles that change, for savestates
+void ppu_load_tiles(struct gb *gb, const uint8_t *data)
+{
+    for (int tile = 0; tile < PPU_TILES; tile++) {
+        uint8_t *vram = &gb->mem[0x8000 + tile * 16];
+
+        if (!memcmp(vram, &data[tile * 16], 16))
+            continue;
+        memcpy(vram, &data[tile * 16], 16);
+        for (int row = 0; row < 8; row++)
+            decode_row(gb, 0x8000 + tile * 16 + row * 2);
+    }
+}
+
+// write handler of the tile data pages, and of the tile maps with the FIFO
+void ppu_vram_write(struct gb *gb, uint16_t addr, uint8_t val)
+{
+    fifo_sync(gb);
+    gb->mem[addr] = val;
+    if (addr < 0x9800)
+        decode_row(gb, addr);
+}
+
+static const uint8_t *bg_tile_row(struct ppu *ppu, uint8_t id, uint8_t row)
+{
+    unsigned int tile = (ppu->lcdc & LCDC_TILE_DATA) ? id : 256 + (int8_t)id;
+
+    return ppu->tiles[tile][row & 7];
+}
+
+// sprite row on the current line, flipped vertically but not horizontally
+static const uint8_t *obj_tile_row(struct ppu *ppu, const struct ppu_sprite *s)
+{
+    int height = (ppu->lcdc & LCDC_OBJ_SIZE) ? 16 : 8;
+    int row = ppu->ly + 16 - s->y;
+    uint8_t tile = height == 16 ? s->tile & 0xfe : s->tile;
+
+    if (s->attr & OBJ_Y_FLIP)
+        row = height - 1 - row;
+    return ppu->tiles[tile + row / 8][row & 7];
+}
+
+/*
+ * The first PPU_OBJ_PER_LINE sprites on the current line, in the order they
+ * take priority: smaller X first, then earlier in OAM.
+ */
+static int oam_scan(struct gb *gb, struct ppu_sprite *sprites)
+{
+    struct ppu *ppu = &gb->ppu;
+    int height = (ppu->lcdc & LCDC_OBJ_SIZE) ? 16 : 8;
+    int n = 0;
+
+    for (int i = 0; i < 40 && n < PPU_OBJ_PER_LINE; i++) {
+        const uint8_t *oam = &gb->mem[0xfe00 + 4 * i];
+        int row = ppu->ly + 16 - oam[0];
+
+        if (row >= 0 && row < height)
+            sprites[n++] = (struct ppu_sprite){ oam[0], oam[1], oam[2], oam[3] };
+    }
+    // stable sort on X
+    for (int i = 1; i < n; i++) {
+        struct ppu_sprite s = sprites[i];
+        int j = i;
+
+        for (; j > 0 && sprites[j - 1].x > s.x; j--)
+            sprites[j] = sprites[j - 1];
+        sprites[j] = s;
+    }
+    return n;
+}
+
+/*******************************************************
+ *                      Renderer                       *
+ *******************************************************/
+
+/*
+ * Copy count pixels of row y of the 256x256 tile map at map, starting at
+ * column x, to dst. Whole tiles are copied so up to 7 bytes either side of
+ * the span get overwritten.
+ */
+static void fetch_map_row(struct gb *gb, uint8_t *dst, uint16_t map, uint8_t y, uint8_t x, int count)
+{
+    const uint8_t *entries = &gb->mem[map + (y / 8) * 32];
+    uint8_t col = x / 8;
+
+    dst -= x & 7;
+    count += x & 7;
+    for (int i = 0; i < count; i += 8, col = (col + 1) & 31)
+        memcpy(&dst[i], bg_tile_row(&gb->ppu, entries[col], y), 8);
+}
+
+// draw the sprites of the line into color/attr, lowest priority first so the winner is left
+static bool render_sprites(struct gb *gb, uint8_t *color, uint8_t *attr)
+{
+    struct ppu *ppu = &gb->ppu;
+    struct ppu_sprite sprites[PPU_OBJ_PER_LINE];
+    int n = oam_scan(gb, sprites);
+
+    if (!n)
+        return false;
+    memset(color, 0, SCREEN_WIDTH);
+    memset(attr, 0, SCREEN_WIDTH);
+    for (int i = n - 1; i >= 0; i--) {
+        const struct ppu_sprite *s = &sprites[i];
+        const uint8_t *pixels = obj_tile_row(ppu, s);
+
+        for (int px = 0; px < 8; px++) {
+            int x = s->x - 8 + px;
+            uint8_t c = pixels[(s->attr & OBJ_X_FLIP) ? 7 - px : px];
+
+            if (x < 0 || x >= SCREEN_WIDTH || !c)
+                continue;
+            color[x] = c;
+            attr[x] = s->attr;
+        }
+    }
+    return true;
+}
+
+static bool window_on_line(struct ppu *ppu)
+{
+    return (ppu->lcdc & LCDC_BG) && (ppu->lcdc & LCDC_WIN) && ppu->ly >= ppu->wy &&
+           ppu->wx < SCREEN_WIDTH + 7;
+}
+
+static void render_line(struct gb *gb)
+{
+    struct ppu *ppu = &gb->ppu;
+    uint8_t *out = line_shades(ppu);
+    uint8_t bg_buf[8 + SCREEN_WIDTH + 8];
+    uint8_t *bg = &bg_buf[8];
+    uint8_t obj_color[SCREEN_WIDTH];
+    uint8_t obj_attr[SCREEN_WIDTH];
+
+    // on DMG the BG enable bit also turns off the window
+    if (ppu->lcdc & LCDC_BG) {
+        fetch_map_row(gb, bg, (ppu->lcdc & LCDC_BG_MAP) ? 0x9c00 : 0x9800,
+                    ppu->scy + ppu->ly, ppu->scx, SCREEN_WIDTH);
+        if (window_on_line(ppu)) {
+            int start = ppu->wx < 7 ? 0 : ppu->wx - 7;
+
+            fetch_map_row(gb, &bg[start], (ppu->lcdc & LCDC_WIN_MAP) ? 0x9c00 : 0x9800,
+                        ppu->window_line, start - (ppu->wx - 7), SCREEN_WIDTH - start);
+            ppu->window_line++;
+        }
+    } else {
+        memset(bg, 0, SCREEN_WIDTH);
+    }
+
+    if ((ppu->lcdc & LCDC_OBJ) && render_sprites(gb, obj_color, obj_attr))
+        ppu->kernels->merge(out, bg, obj_color, obj_attr, ppu->bgp, ppu->obp, SCREEN_WIDTH);
+    else
+        ppu->kernels->palette(out, bg, ppu->bgp, SCREEN_WIDTH);
+    emit_line(ppu);
+}
+
+/*******************************************************
+ *                    Pixel FIFO                       *
+ *******************************************************/
+
+static void fifo_start(struct gb *gb, uint64_t when)
+{
+    struct ppu *ppu = &gb->ppu;
+    struct ppu_fifo *f = &ppu->fifo;
+
+    memset(f, 0, sizeof(struct ppu_fifo));
+    f->cycle = when;
+    f->delay = FETCH_DOTS;
+    f->discard = ppu->scx & 7;
+    f->fetch_x = ppu->scx / 8;
+    if (ppu->lcdc & LCDC_OBJ)
+        f->n_sprites = oam_scan(gb, f->sprites);
+}
+
+// one dot of the background fetcher: tile number, low plane, high plane, then push when the FIFO is empty
+static void fifo_fetch(struct gb *gb)
+{
+    struct ppu *ppu = &gb->ppu;
+    struct ppu_fifo *f = &ppu->fifo;
+    uint8_t y = f->window ? ppu->window_line : ppu->scy + ppu->ly;
+
+    if (f->fetch_step == 1) {
+        uint16_t map = (f->window ? (ppu->lcdc & LCDC_WIN_MAP) : (ppu->lcdc & LCDC_BG_MAP)) ? 0x9c00 : 0x9800;
+
+        f->tile_id = gb->mem[map + (y / 8) * 32 + (f->fetch_x & 31)];
+    }
+    if (f->fetch_step < FETCH_DOTS) {
+        f->fetch_step++;
+        return;
+    }
+    if (f->bg_size)
+        return;
+    if (ppu->lcdc & LCDC_BG)
+        memcpy(f->bg, bg_tile_row(ppu, f->tile_id, y), 8);
+    else
+        memset(f->bg, 0, 8);
+    f->bg_head = 0;
+    f->bg_size = 8;
+    f->fetch_step = 0;
+    f->fetch_x++;
+}
+
+// mix the next sprite into the sprite FIFO, pixels already there win
+static void fifo_load_sprite(struct gb *gb)
+{
+    struct ppu_fifo *f = &gb->ppu.fifo;
+    const struct ppu_sprite *s = &f->sprites[f->next_sprite++];
+    const uint8_t *pixels = obj_tile_row(&gb->ppu, s);
+    int skip = f->x + 8 - s->x;
+
+    for (int px = skip; px < 8; px++) {
+        uint8_t c = pixels[(s->attr & OBJ_X_FLIP) ? 7 - px : px];
+
+        if (c && !f->obj_color[px - skip]) {
+            f->obj_color[px - skip] = c;
+            f->obj_attr[px - skip] = s->attr;
+        }
+    }
+}
+
+static void fifo_output(struct gb *gb, uint8_t bg)
+{
+    struct ppu *ppu = &gb->ppu;
+    struct ppu_fifo *f = &ppu->fifo;
+    uint8_t obj = f->obj_color[0];
+    uint8_t attr = f->obj_attr[0];
+    uint8_t shade;
+
+    memmove(f->obj_color, f->obj_color + 1, 7);
+    memmove(f->obj_attr, f->obj_attr + 1, 7);
+    f->obj_color[7] = 0;
+    if (!ppu->drawing) {
+        f->x++;
+        return;
+    }
+    if (obj && !((attr & OBJ_BG_PRIORITY) && bg))
+        shade = ppu->obp[!!(attr & OBJ_PALETTE)] >> (2 * obj);
+    else
+        shade = ppu->bgp >> (2 * bg);
+    line_shades(ppu)[f->x++] = shade & 0x03;
+}
+
+static void fifo_dot(struct gb *gb)
+{
+    struct ppu *ppu = &gb->ppu;
+    struct ppu_fifo *f = &ppu->fifo;
+
+    if (f->delay) {
+        f->delay--;
+        return;
+    }
+    // the same rule as the scanline renderer, with BG off there is no window line to count
+    if (!f->window && window_on_line(ppu) && f->x + 7 >= ppu->wx && !f->discard) {
+        f->window = true;
+        f->bg_size = 0;
+        f->fetch_step = 0;
+        f->fetch_x = 0;
+        // WX below 7 starts the window off the left edge
+        if (ppu->wx < 7)
+            f->discard = 7 - ppu->wx;
+    }
+    // a sprite waits for the background tile being fetched, then takes FETCH_DOTS of its own
+    if (f->next_sprite < f->n_sprites && f->sprites[f->next_sprite].x <= f->x + 8) {
+        if (!f->sprite_dots && (f->fetch_step < FETCH_DOTS || !f->bg_size)) {
+            fifo_fetch(gb);
+            return;
+        }
+        if (++f->sprite_dots == FETCH_DOTS) {
+            fifo_load_sprite(gb);
+            f->sprite_dots = 0;
+        }
+        return;
+    }
+    fifo_fetch(gb);
+    if (!f->bg_size)
+        return;
+    f->bg_size--;
+    if (f->discard) {
+        f->bg_head++;
+        f->discard--;
+        return;
+    }
+    fifo_output(gb, f->bg[f->bg_head++]);
+    if (f->x == SCREEN_WIDTH) {
+        f->done = true;
+        if (ppu->drawing)
+            emit_line(ppu);
+        if (f->window)
+            ppu->window_line++;
+    }
+}
+
+// run mode 3 up to the current cycle
+static void fifo_sync(struct gb *gb)
+{
+    struct ppu_fifo *f = &gb->ppu.fifo;
+
+    if (gb->ppu.renderer != PPU_FIFO || gb->ppu.mode != PPU_DRAW)
+        return;
+    while (!f->done && f->cycle < gb->sched.now) {
+        fifo_dot(gb);
+        f->cycle++;
+    }
+}
+
+/*******************************************************
+ *                       Timing                        *
+ *******************************************************/
+
+static void update_stat(struct gb *gb)
+{
+    struct ppu *ppu = &gb->ppu;
+    bool line = false;
+
+    if (ppu->lcdc & LCDC_ON) {
+        line = ((ppu->stat & 0x40) && ppu->ly == ppu->lyc) ||
+               ((ppu->stat & 0x08) && ppu->mode == PPU_HBLANK) ||
+               ((ppu->stat & 0x10) && ppu->mode == PPU_VBLANK) ||
+               ((ppu->stat & 0x20) && ppu->mode == PPU_OAM);
+    }
+    if (line && !ppu->stat_line)
+        cpu_request_interrupt(gb, INT_STAT);
+    ppu->stat_line = line;
+}
+
+static void start_line(struct gb *gb, uint64_t when)
+{
+    struct ppu *ppu = &gb->ppu;
+
+    ppu->line_start = when;
+    if (ppu->ly == 0) {
+        ppu->drawing = ppu->render || ppu->render_once;
+        ppu->render_once = false;
+        if (ppu->output_pending) {
+            ppu->output = ppu->next_output;
+            ppu->output_pending = false;
+        }
+        if (ppu->drawing) {
+            ppu->obs.row = 0;
+            memset(ppu->obs.acc, 0, sizeof(ppu->obs.acc));
+        }
+    }
+    if (ppu->ly < VBLANK_LINE) {
+        ppu->mode = PPU_OAM;
+        sched_add(gb, SCHED_PPU, when + OAM_CYCLES);
+        return;
+    }
+    if (ppu->ly == VBLANK_LINE) {
+        ppu->mode = PPU_VBLANK;
+        ppu->frames++;
+        memcpy(ppu->dirty, ppu->dirty_next, sizeof(ppu->dirty));
+        memset(ppu->dirty_next, 0, sizeof(ppu->dirty_next));
+        cpu_request_interrupt(gb, INT_VBLANK);
+    }
+    sched_add(gb, SCHED_PPU, when + LINE_CYCLES);
+}
+
+void ppu_event(struct gb *gb, uint64_t late)
+{
+    struct ppu *ppu = &gb->ppu;
+    uint64_t when = gb->sched.now - late;
+
+    switch (ppu->mode) {
+    case PPU_OAM:
+        ppu->mode = PPU_DRAW;
+        if (ppu->renderer == PPU_FIFO)
+            fifo_start(gb, when);
+        sched_add(gb, SCHED_PPU, when + DRAW_CYCLES);
+        break;
+    case PPU_DRAW:
+        if (ppu->renderer == PPU_FIFO) {
+            fifo_sync(gb);
+            // each pixel left takes at least a dot
+            if (!ppu->fifo.done) {
+                sched_add(gb, SCHED_PPU, gb->sched.now + SCREEN_WIDTH - ppu->fifo.x);
+                return;
+            }
+        } else if (ppu->drawing) {
+            render_line(gb);
+        } else if (window_on_line(ppu)) {
+            ppu->window_line++;
+        }
+        ppu->mode = PPU_HBLANK;
+        sched_add(gb, SCHED_PPU, ppu->line_start + LINE_CYCLES);
+        break;
+    default:
+        if (++ppu->ly == LINES) {
+            ppu->ly = 0;
+            ppu->window_line = 0;
+        }
+        start_line(gb, when);
+        break;
+    }
+    update_stat(gb);
+}
+
+// takes effect from the next frame
+void ppu_set_render(struct gb *gb, bool enabled)
+{
+    gb->ppu.render = enabled;
+}
+
+/*
+ * Draw the next whole frame even if rendering is off. Returns the value
+ * ppu.frames will have once it is in the framebuffer, as long as the LCD
+ * stays on.
+ */
+uint64_t ppu_render_next_frame(struct gb *gb)
+{
+    struct ppu *ppu = &gb->ppu;
+
+    ppu->render_once = true;
+    if (ppu->ly < VBLANK_LINE && (ppu->lcdc & LCDC_ON))
+        return ppu->frames + 2;
+    return ppu->frames + 1;
+}
+
+/*******************************************************
+ *                     Registers                       *
+ *******************************************************/
+
+uint8_t ppu_read(struct gb *gb, uint16_t addr)
+{
+    struct ppu *ppu = &gb->ppu;
+
+    switch (addr) {
+    case 0xff40: return ppu->lcdc;
+    case 0xff41: return 0x80 | ppu->stat | (ppu->ly == ppu->lyc) << 2 | ppu->mode;
+    case 0xff42: return ppu->scy;
+    case 0xff43: return ppu->scx;
+    case 0xff44: return ppu->ly;
+    case 0xff45: return ppu->lyc;
+    case 0xff47: return ppu->bgp;
+    case 0xff48: return ppu->obp[0];
+    case 0xff49: return ppu->obp[1];
+    case 0xff4a: return ppu->wy;
+    case 0xff4b: return ppu->wx;
+    default: return gb->mem[addr];
+    }
+}
+
+// OAM DMA, done at once rather than over 160 M-cycles
+static void oam_dma(struct gb *gb, uint8_t page)
+{
+    for (int i = 0; i < 0xa0; i++)
+        mmu_write(gb, 0xfe00 + i, mmu_read(gb, (page << 8) | i));
+}
+
+void ppu_write(struct gb *gb, uint16_t addr, uint8_t val)
+{
+    struct ppu *ppu = &gb->ppu;
+
+    fifo_sync(gb);
+    switch (addr) {
+    case 0xff40:
+        if ((val ^ ppu->lcdc) & LCDC_ON) {
+            ppu->ly = 0;
+            ppu->window_line = 0;
+            ppu->mode = PPU_HBLANK;
+            sched_cancel(gb, SCHED_PPU);
+        }
+        ppu->lcdc = val;
+        if ((val & LCDC_ON) && gb->sched.slot[SCHED_PPU] < 0)
+            start_line(gb, gb->sched.now);
+        break;
+    case 0xff41: ppu->stat = val & 0x78; break;
+    case 0xff42: ppu->scy = val; break;
+    case 0xff43: ppu->scx = val; break;
+    case 0xff45: ppu->lyc = val; break;
+    case 0xff46: oam_dma(gb, val); break;
+    case 0xff47: ppu->bgp = val; break;
+    case 0xff48: ppu->obp[0] = val; break;
+    case 0xff49: ppu->obp[1] = val; break;
+    case 0xff4a: ppu->wy = val; break;
+    case 0xff4b: ppu->wx = val; break;
+    default: break;
+    }
+    update_stat(gb);
+}
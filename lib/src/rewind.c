@@ -0,0 +1,279 @@
+#include "rewind.h"
+#include "state.h"
+
+/*
+ * Rewind: one savestate per captured frame, kept in a fixed budget.
+ *
+ * Each state is stored as its XOR with the state captured before it, and
+ * every keyframe_interval captures as itself. Consecutive frames differ in a
+ * few hundred bytes, so the XOR is almost all zero words and a zero-run
+ * coder over 64-bit words shrinks it to about that many bytes at close to
+ * memory speed.
+ *
+ * The newest state is kept in full. Stepping back XORs the newest delta into
+ * it, and when the newest record is a keyframe the state before it is
+ * rebuilt from the keyframe before that, so one step back never decodes more
+ * than keyframe_interval records. Records live in a byte ring; making room
+ * drops the oldest keyframe together with the deltas that need it.
+ *
+ * Record format: a run of (zero words, literal words) varint pairs, each
+ * followed by the literal words. Trailing zero words are left out.
+ */
+
+static inline uint64_t load_word(const uint8_t *p, size_t i)
+{
+    uint64_t w;
+
+    memcpy(&w, p + i * 8, 8);
+    return w;
+}
+
+static inline uint64_t xor_word(const uint8_t *a, const uint8_t *b, size_t i)
+{
+    return b ? load_word(a, i) ^ load_word(b, i) : load_word(a, i);
+}
+
+static uint8_t *put_varint(uint8_t *p, size_t v)
+{
+    while (v >= 0x80) {
+        *p++ = v | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+static const uint8_t *get_varint(const uint8_t *p, size_t *v)
+{
+    size_t shift = 0;
+
+    *v = 0;
+    do {
+        *v |= (size_t)(*p & 0x7f) << shift;
+        shift += 7;
+    } while (*p++ & 0x80);
+    return p;
+}
+
+// worst case is alternating zero and literal words, two bytes of counts per 16 bytes
+static size_t encode_bound(size_t words)
+{
+    return words * 8 + words + 16;
+}
+
+// encodes a ^ b, or a alone when b is NULL, returns the bytes written
+static size_t encode(uint8_t *out, const uint8_t *a, const uint8_t *b, size_t words)
+{
+    uint8_t *p = out;
+    size_t i = 0;
+
+    while (i < words) {
+        size_t zeros = i, lits;
+
+        while (i < words && !xor_word(a, b, i))
+            i++;
+        if (i == words)
+            break;
+        zeros = i - zeros;
+        lits = i;
+        while (i < words && xor_word(a, b, i))
+            i++;
+        lits = i - lits;
+        p = put_varint(p, zeros);
+        p = put_varint(p, lits);
+        for (size_t j = i - lits; j < i; j++) {
+            uint64_t w = xor_word(a, b, j);
+
+            memcpy(p, &w, 8);
+            p += 8;
+        }
+    }
+    return p - out;
+}
+
+// XORs a record into buf
+static void decode(uint8_t *buf, const uint8_t *in, size_t size)
+{
+    const uint8_t *end = in + size;
+    uint8_t *p = buf;
+
+    while (in < end) {
+        size_t zeros, lits;
+
+        in = get_varint(in, &zeros);
+        in = get_varint(in, &lits);
+        p += zeros * 8;
+        for (size_t j = 0; j < lits; j++) {
+            uint64_t w = load_word(p, 0) ^ load_word(in, 0);
+
+            memcpy(p, &w, 8);
+            p += 8;
+            in += 8;
+        }
+    }
+}
+
+/*******************************************************
+ *                        Ring                         *
+ *******************************************************/
+
+static struct rewind_entry *entry(struct rewind *rw, int n)
+{
+    return &rw->entries[(rw->first + n) % rw->max_entries];
+}
+
+// drops the oldest keyframe and the deltas that depend on it
+static void evict(struct rewind *rw)
+{
+    do {
+        rw->first = (rw->first + 1) % rw->max_entries;
+        rw->count--;
+    } while (rw->count && !entry(rw, 0)->keyframe);
+    if (!rw->count)
+        rw->head = 0;
+}
+
+// offset with size contiguous free bytes, evicting as needed
+static uint32_t reserve(struct rewind *rw, uint32_t size)
+{
+    while (rw->count) {
+        uint32_t tail = entry(rw, 0)->offset;
+
+        if (tail < rw->head) {
+            // in use from tail to head, free around the end of the ring
+            if (rw->head + size <= rw->data_size)
+                return rw->head;
+            if (size <= tail)
+                return 0;
+        } else if (rw->head + size <= tail) {
+            return rw->head;
+        }
+        evict(rw);
+    }
+    return 0;
+}
+
+/*******************************************************
+ *                      Interface                      *
+ *******************************************************/
+
+// budget covers the encoded states and their index, two full states come on top of it
+struct rewind *rewind_create(struct gb *gb, size_t budget, int keyframe_interval)
+{
+    struct rewind *rw;
+    size_t state_size = gb_state_size(gb);
+    size_t words = (state_size + 7) / 8;
+    size_t max_entries = budget / 128;
+    size_t data_size = budget - max_entries * sizeof(struct rewind_entry);
+
+    if (keyframe_interval < 1 || keyframe_interval > REWIND_KEYFRAME_MAX) {
+        printf("[ERROR] Rewind keyframe interval %d out of range\n", keyframe_interval);
+        return NULL;
+    }
+    // room for a keyframe and the delta written next to it at the very least
+    if (max_entries < 2 || data_size < 2 * encode_bound(words) || data_size > UINT32_MAX) {
+        printf("[ERROR] Rewind budget of %zu bytes does not fit states of %zu bytes\n", budget,
+                    state_size);
+        return NULL;
+    }
+    rw = calloc(1, sizeof(struct rewind));
+    if (!rw) {
+        printf("[ERROR] Can't allocate the rewind buffer\n");
+        return NULL;
+    }
+    rw->current = calloc(words, 8);
+    rw->scratch = calloc(words, 8);
+    rw->data = malloc(data_size);
+    rw->entries = malloc(max_entries * sizeof(struct rewind_entry));
+    if (!rw->current || !rw->scratch || !rw->data || !rw->entries) {
+        printf("[ERROR] Can't allocate the rewind buffer\n");
+        rewind_destroy(rw);
+        return NULL;
+    }
+    rw->gb = gb;
+    rw->state_size = state_size;
+    rw->words = words;
+    rw->data_size = data_size;
+    rw->max_entries = max_entries;
+    rw->keyframe_interval = keyframe_interval;
+    return rw;
+}
+
+void rewind_destroy(struct rewind *rw)
+{
+    if (!rw)
+        return;
+    free(rw->current);
+    free(rw->scratch);
+    free(rw->data);
+    free(rw->entries);
+    free(rw);
+}
+
+// stores the current state, meant to be called once a frame
+void rewind_capture(struct rewind *rw)
+{
+    struct rewind_entry *e;
+    uint32_t offset;
+    uint16_t since_key = 0;
+    uint8_t *swap;
+    bool keyframe;
+
+    gb_save_state(rw->gb, rw->scratch, rw->state_size);
+    if (rw->count == rw->max_entries)
+        evict(rw);
+    offset = reserve(rw, encode_bound(rw->words));
+    // evicting may have taken the state the delta would be against
+    if (rw->count) {
+        since_key = entry(rw, rw->count - 1)->since_key + 1;
+        if (since_key >= rw->keyframe_interval)
+            since_key = 0;
+    }
+    keyframe = !since_key;
+
+    e = entry(rw, rw->count);
+    e->offset = offset;
+    e->size = encode(rw->data + offset, rw->scratch, keyframe ? NULL : rw->current, rw->words);
+    e->since_key = since_key;
+    e->keyframe = keyframe;
+    rw->count++;
+    rw->head = offset + e->size;
+    rw->encoded += e->size;
+    rw->captures++;
+
+    swap = rw->current;
+    rw->current = rw->scratch;
+    rw->scratch = swap;
+}
+
+// goes back to the state captured before the newest one, which is forgotten
+bool rewind_step_back(struct rewind *rw)
+{
+    struct rewind_entry *newest;
+
+    if (rw->count < 2)
+        return false;
+    newest = entry(rw, rw->count - 1);
+    if (!newest->keyframe) {
+        decode(rw->current, rw->data + newest->offset, newest->size);
+    } else {
+        int last = rw->count - 2;
+        int key = last - entry(rw, last)->since_key;
+
+        memset(rw->current, 0, rw->words * 8);
+        for (int n = key; n <= last; n++) {
+            struct rewind_entry *e = entry(rw, n);
+
+            decode(rw->current, rw->data + e->offset, e->size);
+        }
+    }
+    rw->head = newest->offset;
+    rw->count--;
+    return gb_load_state(rw->gb, rw->current, rw->state_size);
+}
+
+// how many times rewind_step_back() can go back
+int rewind_frames(struct rewind *rw)
+{
+    return rw->count ? rw->count - 1 : 0;
+}
@@ -1,23 +1,147 @@
 #include "rom.h"
+#include "mbc.h"
 
-void rom_load(struct gb *gb, char *rom_path)
+#if defined(__unix__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/*
+ * ROM files are mapped read-only where the platform allows it, so instances
+ * running the same cartridge share its pages with each other and with the
+ * page cache. Elsewhere the file is read into a single heap copy.
+ */
+
+static bool map_file(struct rom_image *image, const char *rom_path)
 {
-    FILE *fp = fopen(rom_path, "r");
+#if defined(__unix__)
+    struct stat st;
+    int fd = open(rom_path, O_RDONLY);
+    void *data;
 
-    if (!fp) {
-        printf("Can't open the rom file. Path: %s\n", rom_path);
-        return;
+    if (fd < 0)
+        return false;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size <= 0 || st.st_size > UINT32_MAX) {
+        close(fd);
+        return false;
     }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
+    image->data = data;
+    image->size = st.st_size;
+    image->mapped = true;
+    return true;
+#else
+    (void)image;
+    (void)rom_path;
+    return false;
+#endif
+}
+
+static bool read_file(struct rom_image *image, const char *rom_path)
+{
+    FILE *fp = fopen(rom_path, "rb");
+    long size;
+
+    if (!fp)
+        return false;
     fseek(fp, 0, SEEK_END);
-    gb->rom.info.size = ftell(fp);
+    size = ftell(fp);
     rewind(fp);
-    
-    gb->rom.data = malloc(sizeof(uint8_t) * gb->rom.info.size);
-    if (!gb->rom.data) {
+    if (size <= 0) {
+        fclose(fp);
+        return false;
+    }
+    image->data = malloc(size);
+    if (!image->data) {
         printf("Can't allocate memory for rom\n");
         exit(EXIT_FAILURE);
     }
-    fread(gb->rom.data, sizeof(uint8_t), gb->rom.info.size, fp);
-    gb->rom.info.loaded = true;
+    image->size = fread(image->data, sizeof(uint8_t), size, fp);
+    image->mapped = false;
     fclose(fp);
-}
\ No newline at end of file
+    return true;
+}
+
+// the returned image holds one reference
+struct rom_image *rom_open(const char *rom_path)
+{
+    struct rom_image *image = malloc(sizeof(struct rom_image));
+
+    if (!image) {
+        printf("Can't allocate memory for rom\n");
+        return NULL;
+    }
+    if (!map_file(image, rom_path) && !read_file(image, rom_path)) {
+        printf("Can't open the rom file. Path: %s\n", rom_path);
+        free(image);
+        return NULL;
+    }
+    atomic_init(&image->refs, 1);
+    return image;
+}
+
+// an image of a cartridge already in memory, such as one generated by a test
+struct rom_image *rom_from_buffer(const uint8_t *data, uint32_t size)
+{
+    struct rom_image *image = malloc(sizeof(struct rom_image));
+
+    if (!image || !size || !(image->data = malloc(size))) {
+        printf("Can't allocate memory for rom\n");
+        free(image);
+        return NULL;
+    }
+    memcpy(image->data, data, size);
+    image->size = size;
+    image->mapped = false;
+    atomic_init(&image->refs, 1);
+    return image;
+}
+
+struct rom_image *rom_retain(struct rom_image *image)
+{
+    atomic_fetch_add_explicit(&image->refs, 1, memory_order_relaxed);
+    return image;
+}
+
+void rom_release(struct rom_image *image)
+{
+    if (!image || atomic_fetch_sub_explicit(&image->refs, 1, memory_order_acq_rel) != 1)
+        return;
+#if defined(__unix__)
+    if (image->mapped)
+        munmap(image->data, image->size);
+    else
+        free(image->data);
+#else
+    free(image->data);
+#endif
+    free(image);
+}
+
+// run the cartridge in image, the instance keeps its own reference
+void rom_attach(struct gb *gb, struct rom_image *image)
+{
+    struct rom_image *old = gb->rom.image;
+
+    gb->rom.image = rom_retain(image);
+    gb->rom.data = image->data;
+    gb->rom.info.size = image->size;
+    gb->rom.info.loaded = true;
+    mbc_init(gb);
+    rom_release(old);
+}
+
+void rom_load(struct gb *gb, char *rom_path)
+{
+    struct rom_image *image = rom_open(rom_path);
+
+    if (!image)
+        return;
+    rom_attach(gb, image);
+    rom_release(image);
+}
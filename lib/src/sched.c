@@ -0,0 +1,130 @@
+#include "sched.h"
+#include "timer.h"
+#include "mbc.h"
+#include "ppu.h"
+
+/*
+ * Event scheduler: peripherals register the cycle of their next interesting
+ * change instead of being ticked every M-cycle. Pending events sit in a binary
+ * min-heap keyed on their deadline; the CPU only bumps sched.now and calls
+ * sched_dispatch() once it crosses sched.next.
+ */
+static const sched_fn sched_handlers[SCHED_EVENT_COUNT] = {
+    [SCHED_TIMER] = timer_overflow,
+    [SCHED_SAVE] = mbc_save_event,
+    [SCHED_PPU] = ppu_event,
+};
+
+static void heap_set(struct scheduler *s, int i, struct sched_entry entry)
+{
+    s->heap[i] = entry;
+    s->slot[entry.event] = i;
+}
+
+static void sift_up(struct scheduler *s, int i)
+{
+    struct sched_entry entry = s->heap[i];
+
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+
+        if (s->heap[parent].when <= entry.when)
+            break;
+        heap_set(s, i, s->heap[parent]);
+        i = parent;
+    }
+    heap_set(s, i, entry);
+}
+
+static void sift_down(struct scheduler *s, int i)
+{
+    struct sched_entry entry = s->heap[i];
+
+    while (2 * i + 1 < s->size) {
+        int child = 2 * i + 1;
+
+        if (child + 1 < s->size && s->heap[child + 1].when < s->heap[child].when)
+            child++;
+        if (entry.when <= s->heap[child].when)
+            break;
+        heap_set(s, i, s->heap[child]);
+        i = child;
+    }
+    heap_set(s, i, entry);
+}
+
+static void heap_remove(struct scheduler *s, int i)
+{
+    s->slot[s->heap[i].event] = -1;
+    if (--s->size == i)
+        return;
+    heap_set(s, i, s->heap[s->size]);
+    if (i > 0 && s->heap[i].when < s->heap[(i - 1) / 2].when)
+        sift_up(s, i);
+    else
+        sift_down(s, i);
+}
+
+static void update_next(struct scheduler *s)
+{
+    s->next = s->size ? s->heap[0].when : SCHED_NEVER;
+}
+
+void sched_init(struct gb *gb)
+{
+    struct scheduler *s = &gb->sched;
+
+    s->now = 0;
+    s->next = SCHED_NEVER;
+    s->size = 0;
+    for (int i = 0; i < SCHED_EVENT_COUNT; i++)
+        s->slot[i] = -1;
+}
+
+// (re)schedule event at absolute cycle when, replacing any pending instance
+void sched_add(struct gb *gb, sched_event_t event, uint64_t when)
+{
+    struct scheduler *s = &gb->sched;
+    int i = s->slot[event];
+
+    if (i < 0) {
+        i = s->size++;
+        heap_set(s, i, (struct sched_entry){ when, event });
+        sift_up(s, i);
+    } else {
+        uint64_t old = s->heap[i].when;
+
+        s->heap[i].when = when;
+        if (when < old)
+            sift_up(s, i);
+        else
+            sift_down(s, i);
+    }
+    update_next(s);
+}
+
+void sched_cancel(struct gb *gb, sched_event_t event)
+{
+    struct scheduler *s = &gb->sched;
+
+    if (s->slot[event] < 0)
+        return;
+    heap_remove(s, s->slot[event]);
+    update_next(s);
+}
+
+void sched_dispatch(struct gb *gb)
+{
+    struct scheduler *s = &gb->sched;
+
+    while (s->size && s->heap[0].when <= s->now) {
+        struct sched_entry entry = s->heap[0];
+
+        heap_remove(s, 0);
+        update_next(s);
+        sched_handlers[entry.event](gb, s->now - entry.when);
+    }
+    update_next(s);
+    // events may raise interrupts, let cached code notice
+    gb->cpu.block_exit = true;
+}
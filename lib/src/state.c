@@ -0,0 +1,707 @@
+#include "state.h"
+#include "block.h"
+#include "mbc.h"
+#include "mmu.h"
+#include "ppu.h"
+#include "sched.h"
+
+/*
+ * Savestates: a header, then sections made of a tag, a payload length and
+ * the payload. Everything is little-endian.
+ *
+ *   header  "GBST", version, flags, ROM size and header checksums
+ *   CPU     registers, lazy flags, mode and interrupt state
+ *   MEM     VRAM, WRAM, OAM, I/O and HRAM, all 64 KiB when there is no ROM
+ *   TIMR    divider and TIMA
+ *   SCHD    cycle counter and pending events
+ *   PPU     registers, timing and the pixel FIFO
+ *   MBC     mapper registers and clock, only with a ROM
+ *   CRAM    cartridge RAM, only when the cartridge has some
+ *   IDLE    the loop the idle skipper is watching, optional
+ *
+ * Loading skips the sections it does not know and checks the whole state
+ * before touching the instance. Only machine state is stored: the page
+ * table, the decoded tiles and the cached blocks are rebuilt from it, and
+ * only where the memory behind them changed, so going back to a state close
+ * to the current one is cheap. Settings of the instance (renderer, outputs,
+ * observations, rendering on or off, save file) are left as they are.
+ */
+
+#define STATE_MAGIC         TAG('G', 'B', 'S', 'T')
+#define STATE_FLAT          0x0001      // no ROM, MEM holds the whole address space
+
+#define TAG(a, b, c, d)     ((uint32_t)(a) | (uint32_t)(b) << 8 | (uint32_t)(c) << 16 | (uint32_t)(d) << 24)
+#define TAG_CPU             TAG('C', 'P', 'U', ' ')
+#define TAG_MEM             TAG('M', 'E', 'M', ' ')
+#define TAG_TIMER           TAG('T', 'I', 'M', 'R')
+#define TAG_SCHED           TAG('S', 'C', 'H', 'D')
+#define TAG_PPU             TAG('P', 'P', 'U', ' ')
+#define TAG_MBC             TAG('M', 'B', 'C', ' ')
+#define TAG_CART_RAM        TAG('C', 'R', 'A', 'M')
+#define TAG_IDLE            TAG('I', 'D', 'L', 'E')
+
+struct mem_range {
+    uint32_t addr;
+    uint32_t len;
+};
+
+// what MEM holds with a cartridge, the rest is ROM, cartridge RAM or echo
+static const struct mem_range cart_ranges[] = {
+    { 0x8000, 0x2000 },
+    { 0xc000, 0x2000 },
+    { 0xfe00, 0x0200 },
+};
+
+static const struct mem_range flat_range = { 0x0000, GB_MEM_SIZE };
+
+static bool is_flat(struct gb *gb)
+{
+    return !gb->rom.data;
+}
+
+static const struct mem_range *mem_ranges(struct gb *gb, int *count)
+{
+    *count = is_flat(gb) ? 1 : sizeof(cart_ranges) / sizeof(cart_ranges[0]);
+    return is_flat(gb) ? &flat_range : cart_ranges;
+}
+
+static uint32_t mem_size(struct gb *gb)
+{
+    int count;
+    const struct mem_range *ranges = mem_ranges(gb, &count);
+    uint32_t size = 0;
+
+    for (int i = 0; i < count; i++)
+        size += ranges[i].len;
+    return size;
+}
+
+// header checksum and global checksum, to refuse states made with another game
+static uint32_t rom_checksum(struct gb *gb)
+{
+    const uint8_t *rom = gb->rom.data;
+
+    if (!rom || gb->rom.info.size < 0x150)
+        return 0;
+    return rom[0x14d] | rom[0x14e] << 8 | rom[0x14f] << 16;
+}
+
+/*******************************************************
+ *                       Saving                        *
+ *******************************************************/
+
+// counts every byte, only stores those that fit
+struct writer {
+    uint8_t *buf;
+    size_t size;
+    size_t pos;
+};
+
+static void put(struct writer *w, const void *data, size_t len)
+{
+    if (w->pos + len <= w->size)
+        memcpy(&w->buf[w->pos], data, len);
+    w->pos += len;
+}
+
+static void put_le(struct writer *w, uint64_t val, int bytes)
+{
+    uint8_t le[8];
+
+    for (int i = 0; i < bytes; i++)
+        le[i] = val >> (8 * i);
+    put(w, le, bytes);
+}
+
+#define put8(w, v)      put_le(w, v, 1)
+#define put16(w, v)     put_le(w, v, 2)
+#define put32(w, v)     put_le(w, v, 4)
+#define put64(w, v)     put_le(w, v, 8)
+
+// returns where the payload starts, for end_section() to fill in its length
+static size_t begin_section(struct writer *w, uint32_t tag)
+{
+    put32(w, tag);
+    put32(w, 0);
+    return w->pos;
+}
+
+static void end_section(struct writer *w, size_t start)
+{
+    uint32_t len = w->pos - start;
+
+    if (w->pos <= w->size) {
+        for (int i = 0; i < 4; i++)
+            w->buf[start - 4 + i] = len >> (8 * i);
+    }
+}
+
+static void save_cpu(struct gb *gb, struct writer *w)
+{
+    struct cpu *cpu = &gb->cpu;
+    struct cpu_register *r = &cpu->regs;
+    size_t start = begin_section(w, TAG_CPU);
+
+    put8(w, r->a);
+    put8(w, r->b);
+    put8(w, r->c);
+    put8(w, r->d);
+    put8(w, r->e);
+    put8(w, r->f);
+    put8(w, r->h);
+    put8(w, r->l);
+    put16(w, r->pc);
+    put16(w, r->sp);
+    put8(w, cpu->flags.op);
+    put16(w, cpu->flags.x);
+    put16(w, cpu->flags.y);
+    put32(w, cpu->flags.result);
+    put8(w, cpu->flags.carry);
+    put8(w, cpu->mode);
+    put8(w, cpu->ime);
+    put8(w, cpu->ei_delay);
+    put64(w, cpu->halt_cycles);
+    end_section(w, start);
+}
+
+static void save_mem(struct gb *gb, struct writer *w)
+{
+    size_t start = begin_section(w, TAG_MEM);
+    int count;
+    const struct mem_range *ranges = mem_ranges(gb, &count);
+
+    // page by page, a forked instance may still be reading some from shared memory
+    for (int i = 0; i < count; i++) {
+        for (uint32_t addr = ranges[i].addr; addr < ranges[i].addr + ranges[i].len; addr += 0x100)
+            put(w, mmu_mem_page(gb, addr >> 8), 0x100);
+    }
+    end_section(w, start);
+}
+
+static void save_timer(struct gb *gb, struct writer *w)
+{
+    size_t start = begin_section(w, TAG_TIMER);
+
+    put64(w, gb->timer.div_base);
+    put64(w, gb->timer.tima_sync);
+    put8(w, gb->timer.tima);
+    put8(w, gb->timer.tma);
+    put8(w, gb->timer.tac);
+    end_section(w, start);
+}
+
+static void save_sched(struct gb *gb, struct writer *w)
+{
+    struct scheduler *s = &gb->sched;
+    size_t start = begin_section(w, TAG_SCHED);
+
+    put64(w, s->now);
+    put8(w, s->size);
+    // unused slots are written too so that the state size does not change
+    for (int i = 0; i < SCHED_EVENT_COUNT; i++) {
+        put8(w, i < s->size ? s->heap[i].event : 0);
+        put64(w, i < s->size ? s->heap[i].when : 0);
+    }
+    end_section(w, start);
+}
+
+static void save_ppu(struct gb *gb, struct writer *w)
+{
+    struct ppu *ppu = &gb->ppu;
+    struct ppu_fifo *f = &ppu->fifo;
+    size_t start = begin_section(w, TAG_PPU);
+
+    put8(w, ppu->lcdc);
+    put8(w, ppu->stat);
+    put8(w, ppu->scy);
+    put8(w, ppu->scx);
+    put8(w, ppu->ly);
+    put8(w, ppu->lyc);
+    put8(w, ppu->bgp);
+    put8(w, ppu->obp[0]);
+    put8(w, ppu->obp[1]);
+    put8(w, ppu->wy);
+    put8(w, ppu->wx);
+    put8(w, ppu->mode);
+    put8(w, ppu->window_line);
+    put8(w, ppu->stat_line);
+    put64(w, ppu->line_start);
+    put64(w, ppu->frames);
+    put64(w, f->cycle);
+    put8(w, f->done);
+    put8(w, f->window);
+    put8(w, f->x);
+    put8(w, f->delay);
+    put8(w, f->discard);
+    put8(w, f->fetch_step);
+    put8(w, f->fetch_x);
+    put8(w, f->tile_id);
+    put(w, f->bg, 8);
+    put8(w, f->bg_head);
+    put8(w, f->bg_size);
+    put(w, f->obj_color, 8);
+    put(w, f->obj_attr, 8);
+    put8(w, f->sprite_dots);
+    put8(w, f->n_sprites);
+    put8(w, f->next_sprite);
+    for (int i = 0; i < PPU_OBJ_PER_LINE; i++) {
+        put8(w, f->sprites[i].y);
+        put8(w, f->sprites[i].x);
+        put8(w, f->sprites[i].tile);
+        put8(w, f->sprites[i].attr);
+    }
+    end_section(w, start);
+}
+
+static void save_mbc(struct gb *gb, struct writer *w)
+{
+    struct mbc *mbc = &gb->mbc;
+    size_t start = begin_section(w, TAG_MBC);
+
+    put8(w, mbc->type);
+    put8(w, mbc->ram_enabled);
+    put8(w, mbc->mode);
+    put16(w, mbc->rom_select);
+    put8(w, mbc->ram_select);
+    put(w, mbc->rtc.regs, RTC_REGS);
+    put(w, mbc->rtc.latched, RTC_REGS);
+    put8(w, mbc->rtc.latch);
+    put64(w, mbc->rtc.sync);
+    end_section(w, start);
+    if (mbc->ram_size) {
+        start = begin_section(w, TAG_CART_RAM);
+        put(w, mbc->ram, mbc->ram_size);
+        end_section(w, start);
+    }
+}
+
+// so that a loaded state skips the same loop iterations as the run it was taken from
+static void save_idle(struct gb *gb, struct writer *w)
+{
+    size_t start = begin_section(w, TAG_IDLE);
+
+    put32(w, gb->idle.last_key);
+    put64(w, gb->idle.last_now);
+    put64(w, gb->idle.last_deadline);
+    end_section(w, start);
+}
+
+static size_t write_state(struct gb *gb, struct writer *w)
+{
+    put32(w, STATE_MAGIC);
+    put16(w, STATE_VERSION);
+    put16(w, is_flat(gb) ? STATE_FLAT : 0);
+    put32(w, gb->rom.info.size);
+    put32(w, rom_checksum(gb));
+    save_cpu(gb, w);
+    save_mem(gb, w);
+    save_timer(gb, w);
+    save_sched(gb, w);
+    save_ppu(gb, w);
+    if (!is_flat(gb))
+        save_mbc(gb, w);
+    save_idle(gb, w);
+    return w->pos;
+}
+
+// bytes gb_save_state() needs, fixed for a given instance
+size_t gb_state_size(struct gb *gb)
+{
+    struct writer w = { NULL, 0, 0 };
+
+    return write_state(gb, &w);
+}
+
+// returns the bytes written, 0 when buf is too small
+size_t gb_save_state(struct gb *gb, void *buf, size_t size)
+{
+    struct writer w = { buf, size, 0 };
+    size_t len = write_state(gb, &w);
+
+    return len <= size ? len : 0;
+}
+
+/*******************************************************
+ *                       Loading                       *
+ *******************************************************/
+
+struct reader {
+    const uint8_t *p;
+    size_t left;
+    bool error;     // read past the end, what was read is zeros
+};
+
+static void get(struct reader *r, void *data, size_t len)
+{
+    if (len > r->left) {
+        memset(data, 0, len);
+        r->error = true;
+        return;
+    }
+    memcpy(data, r->p, len);
+    r->p += len;
+    r->left -= len;
+}
+
+static uint64_t get_le(struct reader *r, int bytes)
+{
+    uint8_t le[8];
+    uint64_t val = 0;
+
+    get(r, le, bytes);
+    for (int i = 0; i < bytes; i++)
+        val |= (uint64_t)le[i] << (8 * i);
+    return val;
+}
+
+#define get8(r)         ((uint8_t)get_le(r, 1))
+#define get16(r)        ((uint16_t)get_le(r, 2))
+#define get32(r)        ((uint32_t)get_le(r, 4))
+#define get64(r)        get_le(r, 8)
+
+// everything read from a state before any of it is applied
+struct loaded {
+    struct cpu cpu;
+    const uint8_t *mem;
+    struct timer timer;
+    uint64_t now;
+    int n_events;
+    struct sched_entry events[SCHED_EVENT_COUNT];
+    uint8_t ppu_regs[11];
+    uint8_t ppu_mode;
+    uint8_t window_line;
+    bool stat_line;
+    uint64_t line_start;
+    uint64_t frames;
+    struct ppu_fifo fifo;
+    bool has_mbc;
+    struct mbc mbc;
+    const uint8_t *cart_ram;
+    struct idle idle;
+};
+
+static bool load_cpu(struct reader *r, struct loaded *s)
+{
+    struct cpu_register *regs = &s->cpu.regs;
+
+    regs->a = get8(r);
+    regs->b = get8(r);
+    regs->c = get8(r);
+    regs->d = get8(r);
+    regs->e = get8(r);
+    regs->f = get8(r);
+    regs->h = get8(r);
+    regs->l = get8(r);
+    regs->pc = get16(r);
+    regs->sp = get16(r);
+    s->cpu.flags.op = get8(r);
+    s->cpu.flags.x = get16(r);
+    s->cpu.flags.y = get16(r);
+    s->cpu.flags.result = get32(r);
+    s->cpu.flags.carry = get8(r);
+    s->cpu.mode = get8(r);
+    s->cpu.ime = get8(r);
+    s->cpu.ei_delay = get8(r);
+    s->cpu.halt_cycles = get64(r);
+    return s->cpu.flags.op <= FLAGS_BIT && s->cpu.mode <= STOP;
+}
+
+static bool load_timer(struct reader *r, struct loaded *s)
+{
+    s->timer.div_base = get64(r);
+    s->timer.tima_sync = get64(r);
+    s->timer.tima = get8(r);
+    s->timer.tma = get8(r);
+    s->timer.tac = get8(r);
+    return true;
+}
+
+static bool load_sched(struct reader *r, struct loaded *s)
+{
+    s->now = get64(r);
+    s->n_events = get8(r);
+    if (s->n_events > SCHED_EVENT_COUNT)
+        return false;
+    for (int i = 0; i < s->n_events; i++) {
+        s->events[i].event = get8(r);
+        s->events[i].when = get64(r);
+        if (s->events[i].event >= SCHED_EVENT_COUNT)
+            return false;
+    }
+    return true;
+}
+
+static bool load_ppu(struct reader *r, struct loaded *s)
+{
+    struct ppu_fifo *f = &s->fifo;
+
+    get(r, s->ppu_regs, sizeof(s->ppu_regs));
+    s->ppu_mode = get8(r);
+    s->window_line = get8(r);
+    s->stat_line = get8(r);
+    s->line_start = get64(r);
+    s->frames = get64(r);
+    f->cycle = get64(r);
+    f->done = get8(r);
+    f->window = get8(r);
+    f->x = get8(r);
+    f->delay = get8(r);
+    f->discard = get8(r);
+    f->fetch_step = get8(r);
+    f->fetch_x = get8(r);
+    f->tile_id = get8(r);
+    get(r, f->bg, 8);
+    f->bg_head = get8(r);
+    f->bg_size = get8(r);
+    get(r, f->obj_color, 8);
+    get(r, f->obj_attr, 8);
+    f->sprite_dots = get8(r);
+    f->n_sprites = get8(r);
+    f->next_sprite = get8(r);
+    for (int i = 0; i < PPU_OBJ_PER_LINE; i++) {
+        f->sprites[i].y = get8(r);
+        f->sprites[i].x = get8(r);
+        f->sprites[i].tile = get8(r);
+        f->sprites[i].attr = get8(r);
+    }
+    // indices the FIFO follows without checking
+    return s->ppu_mode <= PPU_DRAW && f->x <= SCREEN_WIDTH && f->bg_head + f->bg_size <= 8 &&
+           f->n_sprites <= PPU_OBJ_PER_LINE && f->next_sprite <= f->n_sprites;
+}
+
+static bool load_mbc(struct gb *gb, struct reader *r, struct loaded *s)
+{
+    struct mbc *mbc = &s->mbc;
+
+    s->has_mbc = true;
+    if (get8(r) != gb->mbc.type)
+        return false;
+    mbc->ram_enabled = get8(r);
+    mbc->mode = get8(r);
+    mbc->rom_select = get16(r);
+    mbc->ram_select = get8(r);
+    get(r, mbc->rtc.regs, RTC_REGS);
+    get(r, mbc->rtc.latched, RTC_REGS);
+    mbc->rtc.latch = get8(r);
+    mbc->rtc.sync = get64(r);
+    return true;
+}
+
+static bool load_idle(struct reader *r, struct loaded *s)
+{
+    s->idle.last_key = get32(r);
+    s->idle.last_now = get64(r);
+    s->idle.last_deadline = get64(r);
+    return true;
+}
+
+// walk the sections, false if one is malformed or a required one is missing
+static bool read_state(struct gb *gb, const uint8_t *buf, size_t size, struct loaded *s)
+{
+    struct reader r = { buf, size, false };
+    uint32_t seen = 0;
+
+    if (get32(&r) != STATE_MAGIC || get16(&r) > STATE_VERSION) {
+        printf("[ERROR] Not a savestate or a newer version\n");
+        return false;
+    }
+    if ((get16(&r) & STATE_FLAT) != (is_flat(gb) ? STATE_FLAT : 0) ||
+        get32(&r) != gb->rom.info.size || get32(&r) != rom_checksum(gb)) {
+        printf("[ERROR] The savestate is for another ROM\n");
+        return false;
+    }
+    while (r.left && !r.error) {
+        uint32_t tag = get32(&r);
+        uint32_t len = get32(&r);
+        struct reader section = { r.p, len, false };
+        bool ok = true;
+
+        if (r.error || len > r.left) {
+            r.error = true;
+            break;
+        }
+        r.p += len;
+        r.left -= len;
+        switch (tag) {
+        case TAG_CPU: ok = load_cpu(&section, s); seen |= 1 << 0; break;
+        case TAG_TIMER: ok = load_timer(&section, s); seen |= 1 << 1; break;
+        case TAG_SCHED: ok = load_sched(&section, s); seen |= 1 << 2; break;
+        case TAG_PPU: ok = load_ppu(&section, s); seen |= 1 << 3; break;
+        case TAG_MBC: ok = load_mbc(gb, &section, s); break;
+        case TAG_IDLE: ok = load_idle(&section, s); break;
+        case TAG_MEM:
+            ok = len == mem_size(gb);
+            s->mem = section.p;
+            seen |= 1 << 4;
+            break;
+        case TAG_CART_RAM:
+            ok = len == gb->mbc.ram_size;
+            s->cart_ram = section.p;
+            break;
+        default:
+            break;
+        }
+        if (!ok || section.error) {
+            printf("[ERROR] Bad savestate section %c%c%c%c\n", tag & 0xff, (tag >> 8) & 0xff,
+                        (tag >> 16) & 0xff, tag >> 24);
+            return false;
+        }
+    }
+    if (r.error || seen != 0x1f || (!is_flat(gb) && !s->has_mbc) || (gb->mbc.ram_size && !s->cart_ram)) {
+        printf("[ERROR] Truncated savestate\n");
+        return false;
+    }
+    return true;
+}
+
+// the loaded bytes for addr, NULL when MEM does not cover it
+static const uint8_t *loaded_mem(struct gb *gb, const struct loaded *s, uint32_t addr)
+{
+    int count;
+    const struct mem_range *ranges = mem_ranges(gb, &count);
+    uint32_t offset = 0;
+
+    for (int i = 0; i < count; i++) {
+        if (addr - ranges[i].addr < ranges[i].len)
+            return &s->mem[offset + addr - ranges[i].addr];
+        offset += ranges[i].len;
+    }
+    return NULL;
+}
+
+// drop the cached blocks whose code is about to be overwritten with something else
+static void invalidate_code(struct gb *gb, const struct loaded *s)
+{
+    struct mbc *mbc = &gb->mbc;
+    bool cart_checked = false;
+
+    if (!gb->cpu.blocks)
+        return;
+    for (int page = 0; page < MMU_PAGES; page++) {
+        const uint8_t *host = gb->mmu.read[page];
+        const uint8_t *own = gb->mmu.cow[page] ? gb->mmu.cow[page] : host;
+        const uint8_t *loaded;
+
+        if (!gb->mmu.code[page])
+            continue;
+        if (mbc->ram && host >= mbc->ram && host < mbc->ram + mbc->ram_size) {
+            // blocks from other RAM banks are filed under the same pages, check all of it once
+            if (!cart_checked && memcmp(mbc->ram, s->cart_ram, mbc->ram_size)) {
+                for (int p = 0xa0; p < 0xc0; p++)
+                    block_invalidate_page(gb, p);
+            }
+            cart_checked = true;
+            continue;
+        }
+        // OAM and HRAM pages have no host pointer but are in gb->mem, anything else is ROM
+        if (page >= 0xfe)
+            host = own = &gb->mem[page << 8];
+        else if (!own || own < gb->mem || own >= gb->mem + GB_MEM_SIZE)
+            continue;
+        loaded = loaded_mem(gb, s, own - gb->mem);
+        if (loaded && memcmp(host, loaded, 0x100))
+            block_invalidate_page(gb, page);
+    }
+}
+
+// shared pages of a forked instance stay shared unless the state changes them
+static void load_pages(struct gb *gb, uint32_t addr, const uint8_t *data, uint32_t len)
+{
+    for (uint32_t end = addr + len; addr < end; addr += 0x100, data += 0x100) {
+        uint8_t page = addr >> 8;
+
+        if (gb->mmu.cow[page] == &gb->mem[addr]) {
+            if (!memcmp(gb->mmu.read[page], data, 0x100))
+                continue;
+            mmu_unshare(gb, page);
+        }
+        memcpy(&gb->mem[addr], data, 0x100);
+    }
+}
+
+static void apply_mem(struct gb *gb, const struct loaded *s)
+{
+    int count;
+    const struct mem_range *ranges = mem_ranges(gb, &count);
+    const uint8_t *data = s->mem;
+
+    for (int i = 0; i < count; i++) {
+        uint32_t addr = ranges[i].addr;
+        uint32_t end = addr + ranges[i].len;
+
+        // tile data goes through the PPU so its decoded copy follows
+        if (addr <= 0x8000 && end >= 0x9800) {
+            load_pages(gb, addr, data, 0x8000 - addr);
+            ppu_load_tiles(gb, &data[0x8000 - addr]);
+            load_pages(gb, 0x9800, &data[0x9800 - addr], end - 0x9800);
+        } else {
+            load_pages(gb, addr, data, ranges[i].len);
+        }
+        data += ranges[i].len;
+    }
+}
+
+// leaves gb untouched unless the whole state is valid and for this ROM
+bool gb_load_state(struct gb *gb, const void *buf, size_t size)
+{
+    struct loaded s = { 0 };
+    struct ppu *ppu = &gb->ppu;
+
+    if (!read_state(gb, buf, size, &s))
+        return false;
+    invalidate_code(gb, &s);
+    apply_mem(gb, &s);
+
+    gb->cpu.regs = s.cpu.regs;
+    gb->cpu.flags = s.cpu.flags;
+    gb->cpu.mode = s.cpu.mode;
+    gb->cpu.ime = s.cpu.ime;
+    gb->cpu.ei_delay = s.cpu.ei_delay;
+    gb->cpu.halt_cycles = s.cpu.halt_cycles;
+    gb->cpu.block_exit = true;
+    gb->timer = s.timer;
+
+    // the save file is flushed on the instance's own schedule
+    sched_init(gb);
+    gb->sched.now = s.now;
+    for (int i = 0; i < s.n_events; i++) {
+        if (s.events[i].event != SCHED_SAVE)
+            sched_add(gb, s.events[i].event, s.events[i].when);
+    }
+
+    ppu->lcdc = s.ppu_regs[0];
+    ppu->stat = s.ppu_regs[1];
+    ppu->scy = s.ppu_regs[2];
+    ppu->scx = s.ppu_regs[3];
+    ppu->ly = s.ppu_regs[4];
+    ppu->lyc = s.ppu_regs[5];
+    ppu->bgp = s.ppu_regs[6];
+    ppu->obp[0] = s.ppu_regs[7];
+    ppu->obp[1] = s.ppu_regs[8];
+    ppu->wy = s.ppu_regs[9];
+    ppu->wx = s.ppu_regs[10];
+    ppu->mode = s.ppu_mode;
+    ppu->window_line = s.window_line;
+    ppu->stat_line = s.stat_line;
+    ppu->line_start = s.line_start;
+    ppu->frames = s.frames;
+    ppu->fifo = s.fifo;
+
+    if (s.has_mbc) {
+        struct mbc *mbc = &gb->mbc;
+
+        mbc->ram_enabled = s.mbc.ram_enabled;
+        mbc->mode = s.mbc.mode;
+        mbc->rom_select = s.mbc.rom_select;
+        mbc->ram_select = s.mbc.ram_select;
+        mbc->rtc = s.mbc.rtc;
+        if (mbc->ram_size)
+            memcpy(mbc->ram, s.cart_ram, mbc->ram_size);
+        mbc_restore(gb);
+    }
+    // without an IDLE section last_key is 0, which matches no loop
+    gb->idle.last_key = s.idle.last_key;
+    gb->idle.last_now = s.idle.last_now;
+    gb->idle.last_deadline = s.idle.last_deadline;
+    return true;
+}
@@ -0,0 +1,123 @@
+#include "timer.h"
+#include "sched.h"
+#include "cpu.h"
+
+/*
+ * DIV/TIMA are not ticked: DIV is derived from the cycle counter and TIMA is
+ * caught up on access. The only scheduled event is the next TIMA overflow.
+ */
+#define TIMER_ENABLED(t)    ((t)->tac & 0x04)
+
+// log2 of the T-cycles per TIMA increment for each TAC clock select
+static const uint8_t tac_shift[4] = { 10, 4, 6, 8 };
+
+static uint64_t timer_ticks(struct timer *t, uint64_t when)
+{
+    return (when - t->div_base) >> tac_shift[t->tac & 0x03];
+}
+
+// count the increments since the last sync, the overflow event stops tima wrapping here
+static void timer_sync(struct gb *gb)
+{
+    struct timer *t = &gb->timer;
+
+    if (TIMER_ENABLED(t))
+        t->tima += timer_ticks(t, gb->sched.now) - timer_ticks(t, t->tima_sync);
+    t->tima_sync = gb->sched.now;
+}
+
+static void timer_schedule(struct gb *gb)
+{
+    struct timer *t = &gb->timer;
+    uint64_t tick;
+
+    if (!TIMER_ENABLED(t)) {
+        sched_cancel(gb, SCHED_TIMER);
+        return;
+    }
+    tick = timer_ticks(t, gb->sched.now) + (0x100 - t->tima);
+    sched_add(gb, SCHED_TIMER, t->div_base + (tick << tac_shift[t->tac & 0x03]));
+}
+
+void timer_init(struct gb *gb)
+{
+    struct timer *t = &gb->timer;
+
+    t->div_base = gb->sched.now;
+    t->tima_sync = gb->sched.now;
+    t->tima = 0;
+    t->tma = 0;
+    t->tac = 0;
+    sched_cancel(gb, SCHED_TIMER);
+}
+
+void timer_overflow(struct gb *gb, uint64_t late)
+{
+    struct timer *t = &gb->timer;
+    // increments past the one that overflowed, counted from the reload value
+    uint64_t extra = (timer_ticks(t, gb->sched.now) - timer_ticks(t, t->tima_sync)) - (0x100 - t->tima);
+
+    (void)late;
+    // a late dispatch may have to account for further reloads
+    t->tima = t->tma + extra % (0x100 - t->tma);
+    t->tima_sync = gb->sched.now;
+    cpu_request_interrupt(gb, INT_TIMER);
+    timer_schedule(gb);
+}
+
+uint8_t timer_read(struct gb *gb, uint16_t addr)
+{
+    struct timer *t = &gb->timer;
+
+    switch (addr) {
+    case 0xff04:
+        return ((gb->sched.now - t->div_base) >> 8) & 0xff;
+    case 0xff05:
+        timer_sync(gb);
+        return t->tima;
+    case 0xff06:
+        return t->tma;
+    default:
+        return t->tac | 0xf8;
+    }
+}
+
+void timer_write(struct gb *gb, uint16_t addr, uint8_t val)
+{
+    struct timer *t = &gb->timer;
+
+    timer_sync(gb);
+    switch (addr) {
+    case 0xff04:
+        // resetting the divider while the selected bit is set counts as a falling edge
+        if (TIMER_ENABLED(t) && (((gb->sched.now - t->div_base) >> (tac_shift[t->tac & 0x03] - 1)) & 1)) {
+            if (++t->tima == 0) {
+                t->tima = t->tma;
+                cpu_request_interrupt(gb, INT_TIMER);
+            }
+        }
+        t->div_base = gb->sched.now;
+        break;
+    case 0xff05:
+        t->tima = val;
+        break;
+    case 0xff06:
+        t->tma = val;
+        return;
+    default:
+        t->tac = val & 0x07;
+        break;
+    }
+    timer_schedule(gb);
+}
+
+// cycle of the next DIV or TIMA increment
+uint64_t timer_next_change(struct gb *gb, uint16_t addr)
+{
+    struct timer *t = &gb->timer;
+    int shift = addr == 0xff04 ? 8 : tac_shift[t->tac & 0x03];
+
+    if (addr == 0xff05 && !TIMER_ENABLED(t))
+        return SCHED_NEVER;
+    return t->div_base + ((((gb->sched.now - t->div_base) >> shift) + 1) << shift);
+}
@@ -0,0 +1,298 @@
+#include <common.h>
+#include <gb.h>
+#include <cpu.h>
+#include <mmu.h>
+#include <rom.h>
+#include <block.h>
+
+/*
+ * Differential test of the CPU backends. Random code and data on an MBC1
+ * cartridge run on BACKEND_SWITCH and on another backend must leave the same
+ * registers, cycle count and memory, one instruction at a time and in long
+ * runs through whole blocks. A sweep of the ALU and INC/DEC opcodes over
+ * every operand and flag input then checks F, read back and pushed, against
+ * flags worked out here, which covers the lazy flags of whichever build this
+ * is on every backend including the switch.
+ */
+
+#define DIFF_ROM_SIZE       0x10000
+#define DIFF_PROGRAMS       500
+#define DIFF_STEPS          2000
+#define DIFF_LONG_RUNS      100
+#define DIFF_LONG_COUNT     100000
+#define SWEEP_PC            0xc000
+#define SWEEP_SP            0xdff0
+
+static const char *const backend_names[] = { "switch", "threaded", "cached", "jit" };
+
+static uint64_t seed = 88172645463325252ULL;
+
+static uint32_t next_random(void)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return (uint32_t)seed;
+}
+
+// anything but STOP and HALT, which would end a run early
+static uint8_t random_code(void)
+{
+    uint8_t val = next_random();
+
+    return val == 0x10 || val == 0x76 ? 0x00 : val;
+}
+
+static struct rom_image *random_rom(void)
+{
+    static uint8_t data[DIFF_ROM_SIZE];
+    struct rom_image *rom;
+
+    for (int i = 0; i < DIFF_ROM_SIZE; i++)
+        data[i] = random_code();
+    data[0x147] = 0x03;     // MBC1 with battery-less 8 KiB of RAM
+    data[0x148] = 0x01;
+    data[0x149] = 0x02;
+    rom = rom_from_buffer(data, DIFF_ROM_SIZE);
+    if (!rom)
+        exit(EXIT_FAILURE);
+    return rom;
+}
+
+static struct gb *create_instance(struct rom_image *rom, cpu_backend_t backend, int max_ops)
+{
+    struct gb *gb = gb_create_from_rom(rom, NULL);
+
+    if (!gb)
+        exit(EXIT_FAILURE);
+    cpu_init(gb, backend);
+    if (gb->cpu.blocks)
+        gb->cpu.blocks->max_ops = max_ops;
+    return gb;
+}
+
+// the same random RAM contents and registers in both
+static void randomize(struct gb *a, struct gb *b)
+{
+    struct cpu_register regs = {
+        .a = next_random(), .b = next_random(), .c = next_random(), .d = next_random(),
+        .e = next_random(), .f = next_random() & 0xf0, .h = next_random(), .l = next_random(),
+        .pc = next_random(), .sp = next_random(),
+    };
+
+    // cartridge RAM is enabled for the random data and left to the code afterwards
+    mmu_write(a, 0x0000, 0x0a);
+    mmu_write(b, 0x0000, 0x0a);
+    for (int addr = 0x8000; addr < 0xfe00; addr++) {
+        uint8_t val = random_code();
+
+        mmu_write(a, addr, val);
+        mmu_write(b, addr, val);
+    }
+    for (int addr = 0xff80; addr < 0xffff; addr++) {
+        uint8_t val = random_code();
+
+        mmu_write(a, addr, val);
+        mmu_write(b, addr, val);
+    }
+    a->cpu.regs = regs;
+    b->cpu.regs = regs;
+}
+
+static bool same_state(struct gb *a, struct gb *b)
+{
+    return !memcmp(&a->cpu.regs, &b->cpu.regs, sizeof(struct cpu_register)) &&
+           a->cpu.mode == b->cpu.mode && a->cpu.ime == b->cpu.ime && a->sched.now == b->sched.now;
+}
+
+static bool same_memory(struct gb *a, struct gb *b)
+{
+    return !memcmp(a->mem, b->mem, GB_MEM_SIZE) && a->mbc.ram_size == b->mbc.ram_size &&
+           !memcmp(a->mbc.ram, b->mbc.ram, a->mbc.ram_size);
+}
+
+static void print_state(const char *what, struct gb *gb)
+{
+    struct cpu_register *r = &gb->cpu.regs;
+
+    printf("  %-8s pc: %04x sp: %04x a: %02x b: %02x c: %02x d: %02x e: %02x f: %02x h: %02x l: %02x "
+           "mode %d ime %d cycles %llu\n", what, r->pc, r->sp, r->a, r->b, r->c, r->d, r->e, r->f,
+           r->h, r->l, gb->cpu.mode, gb->cpu.ime, (unsigned long long)gb->sched.now);
+}
+
+// one instruction at a time, max_ops 1 runs every instruction as its own block
+static int compare_steps(cpu_backend_t backend, int max_ops)
+{
+    int failures = 0;
+
+    for (int program = 0; program < DIFF_PROGRAMS; program++) {
+        struct rom_image *rom = random_rom();
+        struct gb *a = create_instance(rom, BACKEND_SWITCH, max_ops);
+        struct gb *b = create_instance(rom, backend, max_ops);
+
+        rom_release(rom);
+        randomize(a, b);
+        for (int step = 0; step < DIFF_STEPS; step++) {
+            uint16_t pc = a->cpu.regs.pc;
+            uint64_t na = cpu_run(a, 1);
+            uint64_t nb = cpu_run(b, 1);
+
+            if (na != nb || !same_state(a, b)) {
+                if (!failures++) {
+                    printf("%s (blocks of %d) diverged in program %d at step %d from pc %04x\n",
+                                backend_names[backend], max_ops, program, step, pc);
+                    print_state("switch", a);
+                    print_state(backend_names[backend], b);
+                }
+                break;
+            }
+            if (!na)
+                break;
+        }
+        if (!same_memory(a, b) && !failures++)
+            printf("%s (blocks of %d) left different memory in program %d\n", backend_names[backend],
+                        max_ops, program);
+        gb_destroy(a);
+        gb_destroy(b);
+    }
+    return failures;
+}
+
+// long runs through whole blocks, with code overwriting itself along the way
+static int compare_runs(cpu_backend_t backend)
+{
+    int failures = 0;
+
+    for (int run = 0; run < DIFF_LONG_RUNS; run++) {
+        struct rom_image *rom = random_rom();
+        struct gb *a = create_instance(rom, BACKEND_SWITCH, BLOCK_MAX_OPS);
+        struct gb *b = create_instance(rom, backend, BLOCK_MAX_OPS);
+        uint64_t na, nb;
+
+        rom_release(rom);
+        randomize(a, b);
+        na = cpu_run(a, DIFF_LONG_COUNT);
+        nb = cpu_run(b, DIFF_LONG_COUNT);
+        if ((na != nb || !same_state(a, b) || !same_memory(a, b)) && !failures++) {
+            printf("%s diverged in long run %d (%llu and %llu instructions)\n",
+                        backend_names[backend], run, (unsigned long long)na, (unsigned long long)nb);
+            print_state("switch", a);
+            print_state(backend_names[backend], b);
+        }
+        gb_destroy(a);
+        gb_destroy(b);
+    }
+    return failures;
+}
+
+// A and F after op (one of the 8-bit ALU ops on B, INC A or DEC A) from a, b and f
+static void alu_reference(uint8_t op, uint8_t a, uint8_t b, uint8_t f, uint8_t *ra, uint8_t *rf)
+{
+    int carry = (f >> 4) & 1;
+    int r;
+
+    switch (op) {
+    case 0x3c:
+        *ra = a + 1;
+        *rf = (*ra ? 0 : 0x80) | ((a & 0xf) == 0xf ? 0x20 : 0) | (f & 0x10);
+        return;
+    case 0x3d:
+        *ra = a - 1;
+        *rf = (*ra ? 0 : 0x80) | 0x40 | ((a & 0xf) == 0 ? 0x20 : 0) | (f & 0x10);
+        return;
+    case 0x80:
+    case 0x88:
+        carry = op == 0x88 ? carry : 0;
+        r = a + b + carry;
+        *ra = r;
+        *rf = (*ra ? 0 : 0x80) | ((a & 0xf) + (b & 0xf) + carry > 0xf ? 0x20 : 0) | (r > 0xff ? 0x10 : 0);
+        return;
+    case 0x90:
+    case 0x98:
+    case 0xb8:
+        carry = op == 0x98 ? carry : 0;
+        r = a - b - carry;
+        *ra = op == 0xb8 ? a : (uint8_t)r;
+        *rf = ((uint8_t)r ? 0 : 0x80) | 0x40 | ((a & 0xf) < (b & 0xf) + carry ? 0x20 : 0) | (r < 0 ? 0x10 : 0);
+        return;
+    case 0xa0:
+        *ra = a & b;
+        *rf = (*ra ? 0 : 0x80) | 0x20;
+        return;
+    case 0xa8:
+        *ra = a ^ b;
+        *rf = *ra ? 0 : 0x80;
+        return;
+    default:
+        *ra = a | b;
+        *rf = *ra ? 0 : 0x80;
+        return;
+    }
+}
+
+// every input of each op followed by PUSH AF, so F is checked both read back and as pushed
+static int sweep_flags(cpu_backend_t backend)
+{
+    static const uint8_t ops[] = { 0x80, 0x88, 0x90, 0x98, 0xa0, 0xa8, 0xb0, 0xb8, 0x3c, 0x3d };
+    struct gb *gb = gb_create();
+    int failures = 0;
+
+    if (!gb)
+        exit(EXIT_FAILURE);
+    mmu_map_flat(gb);
+    cpu_init(gb, backend);
+    for (size_t i = 0; i < sizeof(ops); i++) {
+        mmu_write(gb, SWEEP_PC, ops[i]);
+        mmu_write(gb, SWEEP_PC + 1, 0xf5);
+        for (int x = 0; x < 256; x++) {
+            for (int y = 0; y < 256; y++) {
+                for (int f = 0; f < 0x100; f += 0x10) {
+                    uint8_t ra, rf;
+
+                    gb->cpu.regs.a = x;
+                    gb->cpu.regs.b = y;
+                    gb->cpu.regs.f = f;
+                    gb->cpu.regs.pc = SWEEP_PC;
+                    gb->cpu.regs.sp = SWEEP_SP;
+                    cpu_run(gb, 2);
+                    alu_reference(ops[i], x, y, f, &ra, &rf);
+                    if ((gb->cpu.regs.a != ra || gb->cpu.regs.f != rf || gb->mem[SWEEP_SP - 1] != ra ||
+                         gb->mem[SWEEP_SP - 2] != rf) && !failures++)
+                        printf("%s: op %02x a %02x b %02x f %02x gave a %02x f %02x pushed %02x %02x, "
+                               "expected a %02x f %02x\n", backend_names[backend], ops[i], x, y, f,
+                               gb->cpu.regs.a, gb->cpu.regs.f, gb->mem[SWEEP_SP - 1], gb->mem[SWEEP_SP - 2],
+                               ra, rf);
+                }
+            }
+        }
+    }
+    gb_destroy(gb);
+    return failures;
+}
+
+int main(int argc, char *argv[])
+{
+    int first = BACKEND_THREADED, last = BACKEND_JIT, failures = 0;
+
+    if (argc > 1) {
+        for (first = BACKEND_THREADED; first <= BACKEND_JIT; first++) {
+            if (!strcmp(argv[1], backend_names[first]))
+                break;
+        }
+        if (first > BACKEND_JIT) {
+            fprintf(stderr, "Usage: %s [threaded|cached|jit]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        last = first;
+    }
+    failures = sweep_flags(BACKEND_SWITCH);
+    printf("%-8s %s\n", backend_names[BACKEND_SWITCH], failures ? "FAILED" : "ok");
+    for (int backend = first; backend <= last; backend++) {
+        int backend_failures = compare_steps(backend, 1) + compare_steps(backend, BLOCK_MAX_OPS) +
+                               compare_runs(backend) + sweep_flags(backend);
+
+        printf("%-8s %s\n", backend_names[backend], backend_failures ? "FAILED" : "ok");
+        failures += backend_failures;
+    }
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,407 @@
+#include <time.h>
+#include <common.h>
+#include <gb.h>
+#include <cpu.h>
+#include <mmu.h>
+#include <rom.h>
+#include <ppu.h>
+#include <pixel.h>
+#include <state.h>
+#include <rewind.h>
+#include <pool.h>
+
+#define BENCH_INSTRUCTIONS  50000000ULL
+#define BENCH_FRAMES        6000
+#define BENCH_INSTANCES     1000
+#define BENCH_LINES         2000000
+#define BENCH_STATES        200000
+#define BENCH_REWIND        (16 << 20)
+#define BENCH_FORKS         64
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct gb *bench_create_config(struct rom_image *rom, cpu_backend_t backend,
+                                     const struct gb_config *config)
+{
+    struct gb *gb = gb_create_from_rom(rom, config);
+
+    if (!gb)
+        exit(EXIT_FAILURE);
+    cpu_init(gb, backend);
+    gb->cpu.regs.pc = 0x100;
+    gb->cpu.regs.sp = 0xfffe;
+    return gb;
+}
+
+static struct gb *bench_create(struct rom_image *rom, cpu_backend_t backend)
+{
+    return bench_create_config(rom, backend, NULL);
+}
+
+// run until frames worth of cycles have gone by, returns the instructions executed
+static uint64_t run_frames(struct gb *gb, uint64_t frames)
+{
+    return cpu_run_until(gb, frames * FRAME_CYCLES);
+}
+
+static void bench_dispatch(struct rom_image *rom)
+{
+    static const struct {
+        const char *name;
+        cpu_backend_t backend;
+    } backends[] = {
+        { "switch",   BACKEND_SWITCH },
+        { "threaded", BACKEND_THREADED },
+        { "cached",   BACKEND_CACHED },
+        { "jit",      BACKEND_JIT },
+    };
+
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        struct gb *gb = bench_create(rom, backends[i].backend);
+        double start = now();
+        uint64_t n = cpu_run(gb, BENCH_INSTRUCTIONS);
+        double elapsed = now() - start;
+
+        printf("%-10s %12llu instructions %8.3f s %8.2f MIPS\n", backends[i].name,
+                    (unsigned long long)n, elapsed, n / elapsed / 1e6);
+        gb_destroy(gb);
+    }
+}
+
+// emulated frames per second, for titles that mostly wait in HALT or in polling loops
+static void bench_frames(struct rom_image *rom)
+{
+    for (int skip = 0; skip <= 1; skip++) {
+        struct gb *gb = bench_create(rom, BACKEND_THREADED);
+        uint64_t n, frames;
+        double start = now();
+        double elapsed;
+
+        gb->idle.enabled = skip;
+        n = run_frames(gb, BENCH_FRAMES);
+        elapsed = now() - start;
+        frames = gb->sched.now / FRAME_CYCLES;
+        printf("idle skip %-3s %llu frames %12llu instructions %8.3f s %10.1f fps %5.1f%% halted "
+                    "%8llu cycles/frame skipped\n", skip ? "on" : "off", (unsigned long long)frames,
+                    (unsigned long long)n, elapsed, frames / elapsed,
+                    100.0 * gb->cpu.halt_cycles / gb->sched.now,
+                    (unsigned long long)(frames ? gb->idle.skipped / frames : 0));
+        gb_destroy(gb);
+    }
+}
+
+// the same frames through the fast scanline renderer and the dot-accurate FIFO, drawn, headless
+// and with 84x84 observations
+static void bench_renderers(struct rom_image *rom)
+{
+    static const struct {
+        const char *name;
+        ppu_renderer_t renderer;
+        bool render;
+        bool observe;
+    } renderers[] = {
+        { "scanline",          PPU_SCANLINE, true,  false },
+        { "scanline headless", PPU_SCANLINE, false, false },
+        { "scanline 84x84",    PPU_SCANLINE, true,  true },
+        { "fifo",              PPU_FIFO,     true,  false },
+        { "fifo headless",     PPU_FIFO,     false, false },
+    };
+    static uint8_t ring[4 * 84 * 84];
+
+    for (size_t i = 0; i < sizeof(renderers) / sizeof(renderers[0]); i++) {
+        struct gb_config config = { .renderer = renderers[i].renderer };
+        struct gb *gb = bench_create_config(rom, BACKEND_THREADED, &config);
+        double start = now();
+        double elapsed;
+        uint64_t frames;
+
+        ppu_set_render(gb, renderers[i].render);
+        if (renderers[i].observe)
+            ppu_set_observation(gb, ring, 4, 84, 84, PPU_OBS_GRAY, PPU_OBS_AREA);
+        run_frames(gb, BENCH_FRAMES);
+        elapsed = now() - start;
+        frames = gb->ppu.frames;
+        printf("%-18s %llu frames %8.3f s %10.1f fps\n", renderers[i].name, (unsigned long long)frames,
+                    elapsed, frames / elapsed);
+        gb_destroy(gb);
+    }
+}
+
+// instance startup, loading the file every time versus sharing one image
+static void bench_instances(char *rom_path, struct rom_image *rom)
+{
+    // the pool twice, the second time over pages its first instances faulted in
+    static const char *const modes[] = { "per-file", "shared", "pool", "reused" };
+    static struct gb *gbs[BENCH_INSTANCES];
+    struct gb_pool *pool = gb_pool_create(BENCH_INSTANCES);
+    struct gb *template;
+    double start, elapsed;
+
+    if (!pool)
+        exit(EXIT_FAILURE);
+    for (int mode = 0; mode < 4; mode++) {
+        start = now();
+        for (int i = 0; i < BENCH_INSTANCES; i++) {
+            if (mode == 0) {
+                gbs[i] = gb_create();
+                if (gbs[i])
+                    rom_load(gbs[i], rom_path);
+            } else if (mode == 1) {
+                gbs[i] = gb_create_from_rom(rom, NULL);
+            } else {
+                gbs[i] = gb_create_in(pool, NULL);
+                if (gbs[i])
+                    rom_attach(gbs[i], rom);
+            }
+            if (!gbs[i])
+                exit(EXIT_FAILURE);
+        }
+        elapsed = now() - start;
+        printf("%-8s %d instances %8.3f s %8.1f us/instance\n", modes[mode],
+                    BENCH_INSTANCES, elapsed, elapsed / BENCH_INSTANCES * 1e6);
+        if (mode == 3)
+            break;
+        for (int i = 0; i < BENCH_INSTANCES; i++)
+            gb_destroy(gbs[i]);
+    }
+    printf("pool     %zu MiB %s pages\n", pool->size >> 20, pool->huge ? "huge" : "transparent huge");
+
+    // the pool's instances played a frame, put them all back to the same start
+    template = bench_create(rom, BACKEND_CACHED);
+    for (int i = 0; i < BENCH_INSTANCES; i++) {
+        cpu_init(gbs[i], BACKEND_CACHED);
+        run_frames(gbs[i], 1);
+    }
+    start = now();
+    for (int i = 0; i < BENCH_INSTANCES; i++) {
+        if (!gb_reset_from(gbs[i], template))
+            exit(EXIT_FAILURE);
+    }
+    elapsed = now() - start;
+    printf("reset    %d instances %8.3f s %8.1f us/instance\n",
+                BENCH_INSTANCES, elapsed, elapsed / BENCH_INSTANCES * 1e6);
+    for (int i = 0; i < BENCH_INSTANCES; i++)
+        gb_destroy(gbs[i]);
+    gb_destroy(template);
+    gb_pool_destroy(pool);
+}
+
+// savestates of a running game: saving, loading back the same moment, and rolling back a frame
+static void bench_states(struct rom_image *rom)
+{
+    struct gb *gb = bench_create(rom, BACKEND_CACHED);
+    size_t size;
+    uint8_t *buf;
+    double start, elapsed;
+
+    run_frames(gb, 60);
+    size = gb_state_size(gb);
+    buf = malloc(size);
+    if (!buf)
+        exit(EXIT_FAILURE);
+    printf("state size %zu bytes\n", size);
+
+    start = now();
+    for (int i = 0; i < BENCH_STATES; i++)
+        gb_save_state(gb, buf, size);
+    elapsed = now() - start;
+    printf("save      %8.3f us\n", elapsed / BENCH_STATES * 1e6);
+
+    start = now();
+    for (int i = 0; i < BENCH_STATES; i++)
+        gb_load_state(gb, buf, size);
+    elapsed = now() - start;
+    printf("load      %8.3f us\n", elapsed / BENCH_STATES * 1e6);
+
+    // the memory differs by a frame's worth of changes on every load
+    start = now();
+    for (int i = 0; i < BENCH_STATES / 100; i++) {
+        cpu_run_until(gb, gb->sched.now + FRAME_CYCLES);
+        gb_load_state(gb, buf, size);
+    }
+    elapsed = now() - start;
+    printf("rollback  %8.3f us per frame run and loaded\n", elapsed / (BENCH_STATES / 100) * 1e6);
+    free(buf);
+    gb_destroy(gb);
+}
+
+// a frame captured after every frame run, then all of them stepped back through
+static void bench_rewind(struct rom_image *rom)
+{
+    static const int intervals[] = { 1, 15, 60 };
+
+    for (size_t i = 0; i < sizeof(intervals) / sizeof(intervals[0]); i++) {
+        struct gb *gb = bench_create(rom, BACKEND_CACHED);
+        struct rewind *rw = rewind_create(gb, BENCH_REWIND, intervals[i]);
+        double capture = 0, back, start;
+        int frames;
+
+        if (!rw)
+            exit(EXIT_FAILURE);
+        for (int f = 0; f < BENCH_FRAMES; f++) {
+            run_frames(gb, f + 1);
+            start = now();
+            rewind_capture(rw);
+            capture += now() - start;
+        }
+        frames = rewind_frames(rw);
+        start = now();
+        while (rewind_step_back(rw))
+            ;
+        back = now() - start;
+        printf("keyframe every %-3d %6.0f bytes/frame %5d frames held capture %7.3f us step back %7.3f us\n",
+                    intervals[i], (double)rw->encoded / rw->captures, frames,
+                    capture / BENCH_FRAMES * 1e6, frames ? back / frames * 1e6 : 0);
+        rewind_destroy(rw);
+        gb_destroy(gb);
+    }
+}
+
+// resident memory of the process in KiB, 0 where it can't be read
+static long resident_kib(void)
+{
+    FILE *fp = fopen("/proc/self/statm", "r");
+    long size, resident = 0;
+
+    if (fp) {
+        if (fscanf(fp, "%ld %ld", &size, &resident) != 2)
+            resident = 0;
+        fclose(fp);
+    }
+    return resident * 4;
+}
+
+// children forked from a running game, then each run for a frame
+static void bench_fork(struct rom_image *rom)
+{
+    static struct gb *children[BENCH_FORKS];
+    struct gb *gb = bench_create(rom, BACKEND_THREADED);
+    double start, fork, step;
+    long base, forked, stepped;
+    int shared = 0;
+
+    run_frames(gb, 60);
+    base = resident_kib();
+    start = now();
+    for (int i = 0; i < BENCH_FORKS; i++) {
+        children[i] = gb_fork(gb);
+        if (!children[i])
+            exit(EXIT_FAILURE);
+    }
+    fork = now() - start;
+    forked = resident_kib();
+    start = now();
+    for (int i = 0; i < BENCH_FORKS; i++) {
+        run_frames(children[i], 61);
+        shared += mmu_shared_pages(children[i]);
+    }
+    step = now() - start;
+    stepped = resident_kib();
+    printf("fork      %8.3f us/child %6.1f KiB/child resident\n", fork / BENCH_FORKS * 1e6,
+                (double)(forked - base) / BENCH_FORKS);
+    printf("one frame %8.3f us/child %6.1f KiB/child resident %6.1f pages/child still shared\n",
+                step / BENCH_FORKS * 1e6, (double)(stepped - base) / BENCH_FORKS,
+                (double)shared / BENCH_FORKS);
+    for (int i = 0; i < BENCH_FORKS; i++)
+        gb_destroy(children[i]);
+    gb_destroy(gb);
+}
+
+// per-scanline cost of each pixel kernel set the host supports
+static void bench_render(void)
+{
+    static const struct pixel_kernels *sets[] = {
+        &pixel_scalar,
+#if defined(HAVE_PIXEL_SIMD)
+        &pixel_sse2,
+        &pixel_avx2,
+#endif
+    };
+    static const uint8_t obp[2] = { 0xe4, 0x1b };
+    uint8_t bg[SCREEN_WIDTH], obj[SCREEN_WIDTH], attr[SCREEN_WIDTH], out[SCREEN_WIDTH];
+    uint32_t seed = 1;
+    unsigned int sum = 0;
+
+    for (int x = 0; x < SCREEN_WIDTH; x++) {
+        seed = seed * 1103515245 + 12345;
+        bg[x] = (seed >> 16) & 0x03;
+        obj[x] = (seed >> 18) & 0x03;
+        attr[x] = (seed >> 20) & 0x90;
+    }
+    for (size_t i = 0; i < sizeof(sets) / sizeof(sets[0]); i++) {
+        const struct pixel_kernels *k = sets[i];
+        double start, palette, merge, decode;
+
+        if (!pixel_supported(k))
+            continue;
+        start = now();
+        for (int n = 0; n < BENCH_LINES; n++) {
+            k->palette(out, bg, n, SCREEN_WIDTH);
+            sum += out[n % SCREEN_WIDTH];
+        }
+        palette = now() - start;
+        start = now();
+        for (int n = 0; n < BENCH_LINES; n++) {
+            k->merge(out, bg, obj, attr, n, obp, SCREEN_WIDTH);
+            sum += out[n % SCREEN_WIDTH];
+        }
+        merge = now() - start;
+        // a line's worth of tile rows
+        start = now();
+        for (int n = 0; n < BENCH_LINES; n++) {
+            for (int x = 0; x < SCREEN_WIDTH; x += 8)
+                k->decode(&out[x], n, x);
+            sum += out[n % SCREEN_WIDTH];
+        }
+        decode = now() - start;
+        printf("%-8s palette %6.1f ns/line merge %6.1f ns/line decode %6.1f ns/line\n", k->name,
+                    palette / BENCH_LINES * 1e9, merge / BENCH_LINES * 1e9, decode / BENCH_LINES * 1e9);
+    }
+    // keep the results alive
+    if (sum == 1)
+        printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct rom_image *rom;
+
+    if (argc == 2 && !strcmp(argv[1], "render")) {
+        bench_render();
+        return 0;
+    }
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s dispatch|frames|renderers|instances|states|rewind|fork <rom> or %s render\n", argv[0], argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    rom = rom_open(argv[2]);
+    if (!rom)
+        exit(EXIT_FAILURE);
+
+    if (!strcmp(argv[1], "dispatch")) {
+        bench_dispatch(rom);
+    } else if (!strcmp(argv[1], "frames")) {
+        bench_frames(rom);
+    } else if (!strcmp(argv[1], "renderers")) {
+        bench_renderers(rom);
+    } else if (!strcmp(argv[1], "instances")) {
+        bench_instances(argv[2], rom);
+    } else if (!strcmp(argv[1], "states")) {
+        bench_states(rom);
+    } else if (!strcmp(argv[1], "rewind")) {
+        bench_rewind(rom);
+    } else if (!strcmp(argv[1], "fork")) {
+        bench_fork(rom);
+    } else {
+        fprintf(stderr, "Unknown benchmark %s\n", argv[1]);
+        exit(EXIT_FAILURE);
+    }
+    rom_release(rom);
+    return 0;
+}
@@ -1,8 +1,37 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <common.h>
 #include <gb.h>
 #include <cpu.h>
+#include <block.h>
 #include <cjson/cJSON.h>
 
+/*
+ * Runs the SM83 single instruction tests, one JSON file of cases per opcode.
+ * Given a directory, its files are shared out to worker threads. Each worker
+ * keeps one instance for all its cases: a case writes its RAM, runs one
+ * instruction and checks the result, then the instance is put back to the
+ * template's state by rewriting the same addresses and copying the CPU and
+ * scheduler, with gb_reset_from() at the start of every file. Every failing
+ * case is counted and the first one of each file is printed.
+ *
+ * Parsing the JSON takes far longer than running it, so "convert" turns each
+ * file into a .bin of fixed-size struct test_case records behind a short
+ * header, in host byte order. Those are mapped and run in place.
+ */
+
+#define TEST_MAX_MEM        16
+#define TEST_MAX_CYCLES     8
+#define TEST_NAME_SIZE      16
+
+#define VECTOR_MAGIC        "SM83VEC"
+#define VECTOR_VERSION      1
+
 struct cpu_state {
     uint16_t pc;
     uint16_t sp;
@@ -19,117 +48,178 @@ struct cpu_state {
     struct mem {
         uint16_t addr;
         uint8_t val;
-    } mem[100];
-    int mem_index;
+    } mem[TEST_MAX_MEM];
+    uint8_t mem_index;
+};
+
+typedef enum BUS_FLAGS {
+    BUS_READ = (1U << 0),
+    BUS_WRITE = (1U << 1),
+    BUS_MEM = (1U << 2),    // memory request, as opposed to an internal cycle
+} bus_flags_t;
+
+// one M-cycle of the expected bus activity, flags 0 when the bus is idle
+struct bus_cycle {
+    uint16_t addr;
+    uint8_t val;
+    uint8_t flags;
+};
+
+struct test_case {
+    char name[TEST_NAME_SIZE];
+    struct cpu_state initial;
+    struct cpu_state final;
+    struct bus_cycle cycles[TEST_MAX_CYCLES];
+    uint8_t n_cycles;
 };
 
-void read_json(char buffer[1000][1024], FILE *fp)
+struct vector_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;   // sizeof(struct test_case) of the converter
+    uint32_t count;
+    uint32_t reserved;
+};
+
+struct test_run {
+    char **files;
+    int n_files;
+    atomic_int next;        // next file to hand out
+    cpu_backend_t backend;
+    const char *convert_dir;    // where converted files go, NULL to run the tests
+    pthread_mutex_t print_lock;
+};
+
+struct test_worker {
+    pthread_t thread;
+    struct test_run *run;
+    int files;
+    int cases;
+    int failures;
+    int failed_files;
+};
+
+static int get_value(const cJSON *state, const char *key)
 {
-    for (int i = 0; i < 1000; i++) {
-        int j = 0, times = 0, c;
+    const cJSON *item = cJSON_GetObjectItemCaseSensitive(state, key);
 
-        while (times < 3) {
-            if ((c = fgetc(fp)) == '}')
-                times++;
-            buffer[i][j++] = c;
-        }
-        buffer[i][j++] = '\0';
-        fgetc(fp);  // read the , character
-    }
+    return item ? item->valueint : 0;
 }
 
-void setup_test(char *json_buffer, struct gb *gb, char *instr, struct cpu_state *initial_state, 
-                                struct cpu_state *final_state)
+static bool parse_state(const cJSON *json, struct cpu_state *state)
 {
-    uint16_t state_buffer[12], mem_buffer[2];
-    cJSON *element = NULL, *tmp = NULL, *j = NULL;
-    int i, k;
+    const cJSON *pair, *ram = cJSON_GetObjectItemCaseSensitive(json, "ram");
 
-    cJSON *test = cJSON_Parse(json_buffer);
-    if (!test) {
-        const char *error_ptr = cJSON_GetErrorPtr();
-        if (error_ptr != NULL)
-            printf("Error: %s\n", error_ptr);
-        cJSON_Delete(test);
+    if (!json)
+        return false;
+    state->pc = get_value(json, "pc");
+    state->sp = get_value(json, "sp");
+    state->a = get_value(json, "a");
+    state->b = get_value(json, "b");
+    state->c = get_value(json, "c");
+    state->d = get_value(json, "d");
+    state->e = get_value(json, "e");
+    state->f = get_value(json, "f");
+    state->h = get_value(json, "h");
+    state->l = get_value(json, "l");
+    state->ime = get_value(json, "ime");
+    state->ei = get_value(json, "ei");
+    state->mem_index = 0;
+    cJSON_ArrayForEach(pair, ram)
+    {
+        if (state->mem_index == TEST_MAX_MEM || cJSON_GetArraySize(pair) < 2)
+            return false;
+        state->mem[state->mem_index].addr = cJSON_GetArrayItem(pair, 0)->valueint;
+        state->mem[state->mem_index].val = cJSON_GetArrayItem(pair, 1)->valueint;
+        state->mem_index++;
     }
+    return true;
+}
 
-    cJSON *name = cJSON_GetObjectItemCaseSensitive(test, "name");
-    if (cJSON_IsString(name)) {
-        strcpy(instr, name->valuestring);
-    }
-    cJSON *initial = cJSON_GetObjectItemCaseSensitive(test, "initial");
-    if (initial) {
-        tmp = initial->child;
-        i = 0;
+// [addr, val, "rwm"] with '-' for the flags not set, or null for an idle cycle
+static bool parse_cycles(const cJSON *json, struct test_case *test)
+{
+    const cJSON *cycle;
 
-        while (tmp->next) {
-            state_buffer[i++] = tmp->valueint;
-            tmp = tmp->next;
-        }
-        cJSON_ArrayForEach(element, tmp)
-        {
-            k = 0;
-            cJSON_ArrayForEach(j, element)
-            {
-                mem_buffer[k++] = j->valueint;
-            }
-            gb->mem[mem_buffer[0]] = mem_buffer[1];
-            initial_state->mem[initial_state->mem_index].addr = mem_buffer[0];
-            initial_state->mem[initial_state->mem_index].val = mem_buffer[1];
-            initial_state->mem_index++;
-        }
-    }
-    initial_state->pc = gb->cpu.regs.pc = state_buffer[0];
-    initial_state->sp = gb->cpu.regs.sp = state_buffer[1];
-    initial_state->a = gb->cpu.regs.a = state_buffer[2];
-    initial_state->b = gb->cpu.regs.b = state_buffer[3];
-    initial_state->c = gb->cpu.regs.c = state_buffer[4];
-    initial_state->d = gb->cpu.regs.d = state_buffer[5];
-    initial_state->e = gb->cpu.regs.e = state_buffer[6];
-    initial_state->f = gb->cpu.regs.f = state_buffer[7];
-    initial_state->h = gb->cpu.regs.h = state_buffer[8];
-    initial_state->l = gb->cpu.regs.l = state_buffer[9];
-
-    cJSON *final = cJSON_GetObjectItemCaseSensitive(test, "final");
-    if (final) {
-        tmp = final->child;
-        i = 0;
-
-        while (tmp->next) {
-            state_buffer[i++] = tmp->valueint;
-            tmp = tmp->next;
-        }
-        cJSON_ArrayForEach(element, tmp)
-        {
-            k = 0;
-            cJSON_ArrayForEach(j, element)
-            {
-                mem_buffer[k++] = j->valueint;
-            }
-            final_state->mem[final_state->mem_index].addr = mem_buffer[0];
-            final_state->mem[final_state->mem_index].val = mem_buffer[1];
-            final_state->mem_index++;
-        }
-        final_state->a = state_buffer[0];
-        final_state->b = state_buffer[1];
-        final_state->c = state_buffer[2];
-        final_state->d = state_buffer[3];
-        final_state->e = state_buffer[4];
-        final_state->f = state_buffer[5];
-        final_state->h = state_buffer[6];
-        final_state->l = state_buffer[7];
-        final_state->pc = state_buffer[8];
-        final_state->sp = state_buffer[9];
+    test->n_cycles = 0;
+    cJSON_ArrayForEach(cycle, json)
+    {
+        struct bus_cycle *bus = &test->cycles[test->n_cycles];
+        const cJSON *kind = cJSON_GetArrayItem(cycle, 2);
+
+        if (test->n_cycles == TEST_MAX_CYCLES)
+            return false;
+        test->n_cycles++;
+        memset(bus, 0, sizeof(struct bus_cycle));
+        if (cJSON_GetArraySize(cycle) < 3 || !cJSON_IsString(kind))
+            continue;
+        bus->addr = cJSON_GetArrayItem(cycle, 0)->valueint;
+        bus->val = cJSON_GetArrayItem(cycle, 1)->valueint;
+        if (strchr(kind->valuestring, 'r'))
+            bus->flags |= BUS_READ;
+        if (strchr(kind->valuestring, 'w'))
+            bus->flags |= BUS_WRITE;
+        if (strchr(kind->valuestring, 'm'))
+            bus->flags |= BUS_MEM;
     }
-    cJSON_Delete(test);
+    return true;
+}
+
+static bool parse_case(const cJSON *json, struct test_case *test)
+{
+    const cJSON *name = cJSON_GetObjectItemCaseSensitive(json, "name");
+
+    memset(test, 0, sizeof(struct test_case));
+    if (cJSON_IsString(name))
+        snprintf(test->name, sizeof(test->name), "%s", name->valuestring);
+    return parse_state(cJSON_GetObjectItemCaseSensitive(json, "initial"), &test->initial) &&
+           parse_state(cJSON_GetObjectItemCaseSensitive(json, "final"), &test->final) &&
+           parse_cycles(cJSON_GetObjectItemCaseSensitive(json, "cycles"), test);
+}
+
+static void setup_test(struct gb *gb, const struct cpu_state *initial_state)
+{
+    // through the MMU, so code cached by an earlier case at the same address is dropped
+    for (int i = 0; i < initial_state->mem_index; i++)
+        mmu_write(gb, initial_state->mem[i].addr, initial_state->mem[i].val);
+    gb->cpu.regs.pc = initial_state->pc;
+    gb->cpu.regs.sp = initial_state->sp;
+    gb->cpu.regs.a = initial_state->a;
+    gb->cpu.regs.b = initial_state->b;
+    gb->cpu.regs.c = initial_state->c;
+    gb->cpu.regs.d = initial_state->d;
+    gb->cpu.regs.e = initial_state->e;
+    gb->cpu.regs.f = initial_state->f;
+    gb->cpu.regs.h = initial_state->h;
+    gb->cpu.regs.l = initial_state->l;
+}
+
+// put back what a case can change, cheaper than gb_reset_from() for every case
+static void clean_test(struct gb *gb, const struct gb *template, const struct cpu_state *initial_state,
+                       const struct cpu_state *final_state)
+{
+    struct block_cache *blocks = gb->cpu.blocks;
+    struct jit *jit = gb->cpu.jit;
+
+    for (int i = 0; i < initial_state->mem_index; i++)
+        mmu_write(gb, initial_state->mem[i].addr, template->mem[initial_state->mem[i].addr]);
+    for (int i = 0; i < final_state->mem_index; i++)
+        mmu_write(gb, final_state->mem[i].addr, template->mem[final_state->mem[i].addr]);
+    gb->cpu = template->cpu;
+    gb->cpu.blocks = blocks;
+    gb->cpu.jit = jit;
+    gb->sched = template->sched;
+    gb->timer = template->timer;
+    gb->idle = template->idle;
 }
 
-int check_test(struct gb *gb, struct cpu_state *final_state)
+static int check_test(struct gb *gb, const struct cpu_state *final_state)
 {
     int ret = 0;
 
     // check register
-    if (gb->cpu.regs.a != final_state->a || gb->cpu.regs.b != final_state->b || gb->cpu.regs.c != final_state->c ||
+    if (gb->cpu.regs.pc != final_state->pc || gb->cpu.regs.sp != final_state->sp ||
+       gb->cpu.regs.a != final_state->a || gb->cpu.regs.b != final_state->b || gb->cpu.regs.c != final_state->c ||
        gb->cpu.regs.d != final_state->d || gb->cpu.regs.e != final_state->e || gb->cpu.regs.f != final_state->f ||
        gb->cpu.regs.h != final_state->h || gb->cpu.regs.l != final_state->l)
         ret = 1;
@@ -142,83 +232,406 @@ int check_test(struct gb *gb, struct cpu_state *final_state)
     return ret;
 }
 
-int main(int argc, char *argv[])
+static void print_failure(struct gb *gb, const struct test_case *test)
 {
-    char json_buffer[1000][1024];
-    uint16_t cpu_state_buffer[12];
-    struct gb *gb = NULL;
-    struct cpu_state final_state, initial_state;
+    const struct cpu_state *initial_state = &test->initial;
+    const struct cpu_state *final_state = &test->final;
 
-    if (argc < 2) {
-        fprintf(stderr, "Missing json file path\n");
-        exit(EXIT_FAILURE);
+    printf("Test failed.\n");
+    printf("Instructions: %s", test->name);
+    printf("\n---------------------------------\n");
+    printf("Initial state:\n");
+    printf("pc: %04x sp: %04x a: %02x b: %02x c: %02x d: %02x e: %02x f: %02x h: %02x l: %02x\n",
+                initial_state->pc, initial_state->sp, initial_state->a, initial_state->b,
+                initial_state->c, initial_state->d, initial_state->e, initial_state->f,
+                initial_state->h, initial_state->l);
+    printf("mem: ");
+    for (int i = 0; i < initial_state->mem_index; i++)
+        printf("%04x - %02x ", initial_state->mem[i].addr, initial_state->mem[i].val);
+    printf("\n---------------------------------\n");
+    printf("CPU state:\n");
+    printf("pc: %04x sp: %04x a: %02x b: %02x c: %02x d: %02x e: %02x f: %02x h: %02x l: %02x\n",
+                gb->cpu.regs.pc, gb->cpu.regs.sp, gb->cpu.regs.a, gb->cpu.regs.b,
+                gb->cpu.regs.c, gb->cpu.regs.d, gb->cpu.regs.e, gb->cpu.regs.f,
+                gb->cpu.regs.h, gb->cpu.regs.l);
+    printf("mem: ");
+    for (int i = 0; i < final_state->mem_index; i++)
+        printf("%04x - %02x ", final_state->mem[i].addr, gb->mem[final_state->mem[i].addr]);
+    printf("\n---------------------------------\n");
+    printf("final state:\n");
+    printf("pc: %04x sp: %04x a: %02x b: %02x c: %02x d: %02x e: %02x f: %02x h: %02x l: %02x\n",
+                final_state->pc, final_state->sp, final_state->a, final_state->b,
+                final_state->c, final_state->d, final_state->e, final_state->f,
+                final_state->h, final_state->l);
+    printf("mem: ");
+    for (int i = 0; i < final_state->mem_index; i++)
+        printf("%04x - %02x ", final_state->mem[i].addr, final_state->mem[i].val);
+    printf("\n");
+    printf("cycles: ");
+    for (int i = 0; i < test->n_cycles; i++) {
+        const struct bus_cycle *bus = &test->cycles[i];
+
+        if (!bus->flags)
+            printf("idle ");
+        else
+            printf("%04x %02x %c%c%c ", bus->addr, bus->val, bus->flags & BUS_READ ? 'r' : '-',
+                        bus->flags & BUS_WRITE ? 'w' : '-', bus->flags & BUS_MEM ? 'm' : '-');
+    }
+    printf("\n");
+}
+
+static char *read_file(const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    char *data = NULL;
+    long size;
+
+    if (!fp)
+        return NULL;
+    if (!fseek(fp, 0, SEEK_END) && (size = ftell(fp)) >= 0 && !fseek(fp, 0, SEEK_SET)) {
+        data = malloc(size + 1);
+        if (data && fread(data, 1, size, fp) == (size_t)size) {
+            data[size] = '\0';
+        } else {
+            free(data);
+            data = NULL;
+        }
+    }
+    fclose(fp);
+    return data;
+}
+
+// all the cases of a JSON file, NULL if any of them does not fit a record
+static struct test_case *load_json(struct test_run *run, const char *path, int *count)
+{
+    char *text = read_file(path);
+    cJSON *tests = text ? cJSON_Parse(text) : NULL;
+    struct test_case *cases;
+    const cJSON *test;
+    int n = 0;
+
+    free(text);
+    cases = tests ? malloc(cJSON_GetArraySize(tests) * sizeof(struct test_case) + 1) : NULL;
+    if (!cases) {
+        pthread_mutex_lock(&run->print_lock);
+        fprintf(stderr, "Can't read the tests in %s\n", path);
+        pthread_mutex_unlock(&run->print_lock);
+        cJSON_Delete(tests);
+        return NULL;
+    }
+    cJSON_ArrayForEach(test, tests)
+    {
+        if (!parse_case(test, &cases[n++])) {
+            pthread_mutex_lock(&run->print_lock);
+            fprintf(stderr, "Bad test %d in %s\n", n, path);
+            pthread_mutex_unlock(&run->print_lock);
+            free(cases);
+            cJSON_Delete(tests);
+            return NULL;
+        }
+    }
+    cJSON_Delete(tests);
+    *count = n;
+    return cases;
+}
+
+// the records of a converted file, mapped read-only, size is set for munmap()
+static const struct test_case *map_vectors(struct test_run *run, const char *path, int *count, size_t *size)
+{
+    const struct vector_header *header;
+    struct stat st;
+    void *data;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) || (size_t)st.st_size < sizeof(struct vector_header)) {
+        if (fd >= 0)
+            close(fd);
+        pthread_mutex_lock(&run->print_lock);
+        fprintf(stderr, "Can't read the tests in %s\n", path);
+        pthread_mutex_unlock(&run->print_lock);
+        return NULL;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return NULL;
+    header = data;
+    if (memcmp(header->magic, VECTOR_MAGIC, sizeof(header->magic)) || header->version != VECTOR_VERSION ||
+        header->record_size != sizeof(struct test_case) ||
+        (size_t)st.st_size != sizeof(struct vector_header) + (size_t)header->count * sizeof(struct test_case)) {
+        pthread_mutex_lock(&run->print_lock);
+        fprintf(stderr, "%s is not a test vector file of this build, convert it again\n", path);
+        pthread_mutex_unlock(&run->print_lock);
+        munmap(data, st.st_size);
+        return NULL;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    *count = header->count;
+    *size = st.st_size;
+    return (const struct test_case *)(header + 1);
+}
+
+static void run_cases(struct test_worker *w, struct gb *gb, const struct gb *template, const char *path,
+                      const struct test_case *cases, int count)
+{
+    struct test_run *run = w->run;
+    int failures = 0;
+
+    gb_reset_from(gb, template);
+    for (int i = 0; i < count; i++) {
+        setup_test(gb, &cases[i].initial);
+        cpu_run(gb, 1);
+        if (check_test(gb, &cases[i].final) && !failures++) {
+            pthread_mutex_lock(&run->print_lock);
+            printf("testing file %s\n", path);
+            print_failure(gb, &cases[i]);
+            pthread_mutex_unlock(&run->print_lock);
+        }
+        clean_test(gb, template, &cases[i].initial, &cases[i].final);
+    }
+    if (failures) {
+        pthread_mutex_lock(&run->print_lock);
+        printf("%s: %d of %d tests failed\n", path, failures, count);
+        pthread_mutex_unlock(&run->print_lock);
+        w->failed_files++;
+    }
+    w->cases += count;
+    w->failures += failures;
+}
+
+static bool has_suffix(const char *name, const char *suffix)
+{
+    size_t len = strlen(name), n = strlen(suffix);
+
+    return len > n && !strcmp(name + len - n, suffix);
+}
+
+static void run_file(struct test_worker *w, struct gb *gb, const struct gb *template, const char *path)
+{
+    struct test_case *parsed;
+    const struct test_case *mapped;
+    size_t size;
+    int count;
+
+    w->files++;
+    if (has_suffix(path, ".bin")) {
+        mapped = map_vectors(w->run, path, &count, &size);
+        if (!mapped) {
+            w->failed_files++;
+            return;
+        }
+        run_cases(w, gb, template, path, mapped, count);
+        munmap((struct vector_header *)mapped - 1, size);
+    } else {
+        parsed = load_json(w->run, path, &count);
+        if (!parsed) {
+            w->failed_files++;
+            return;
+        }
+        run_cases(w, gb, template, path, parsed, count);
+        free(parsed);
     }
+}
+
+// path's cases as convert_dir/<name>.bin
+static void convert_file(struct test_worker *w, const char *path)
+{
+    struct test_run *run = w->run;
+    struct vector_header header = { .magic = VECTOR_MAGIC, .version = VECTOR_VERSION,
+                                    .record_size = sizeof(struct test_case) };
+    const char *base = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    struct test_case *cases;
+    char *out;
+    FILE *fp;
+    int count;
+    bool ok;
 
-    fprintf(stdout, "testing file %s\n", argv[1]);
-    FILE *fp = fopen(argv[1], "r");
-    if (!fp) {
-        fprintf(stderr, "Can't open file %s\n", argv[1]);
+    w->files++;
+    cases = load_json(run, path, &count);
+    if (!cases) {
+        w->failed_files++;
+        return;
+    }
+    out = malloc(strlen(run->convert_dir) + strlen(base) + 6);
+    if (!out) {
+        pthread_mutex_lock(&run->print_lock);
+        fprintf(stderr, "Can't convert %s, out of memory\n", path);
+        pthread_mutex_unlock(&run->print_lock);
+        w->failed_files++;
+        free(cases);
+        return;
+    }
+    sprintf(out, "%s/%.*s.bin", run->convert_dir, (int)(strlen(base) - (has_suffix(base, ".json") ? 5 : 0)), base);
+    header.count = count;
+    fp = fopen(out, "wb");
+    ok = fp && fwrite(&header, sizeof(header), 1, fp) == 1 &&
+         fwrite(cases, sizeof(struct test_case), count, fp) == (size_t)count;
+    if (fp && fclose(fp))
+        ok = false;
+    if (!ok) {
+        pthread_mutex_lock(&run->print_lock);
+        fprintf(stderr, "Can't write %s\n", out);
+        pthread_mutex_unlock(&run->print_lock);
+        w->failed_files++;
+    }
+    w->cases += count;
+    free(out);
+    free(cases);
+}
+
+static struct gb *create_instance(cpu_backend_t backend)
+{
+    struct gb *gb = gb_create();
+
+    if (!gb)
         exit(EXIT_FAILURE);
+    mmu_map_flat(gb);
+    cpu_init(gb, backend);
+    // one instruction per block, so each vector runs translated code
+    if (gb->cpu.blocks)
+        gb->cpu.blocks->max_ops = 1;
+    return gb;
+}
+
+static void *worker_main(void *arg)
+{
+    struct test_worker *w = arg;
+    struct test_run *run = w->run;
+    struct gb *template = NULL, *gb = NULL;
+    int index;
+
+    if (!run->convert_dir) {
+        template = create_instance(run->backend);
+        gb = create_instance(run->backend);
     }
-    fgetc(fp);      // read [ character
+    while ((index = atomic_fetch_add(&run->next, 1)) < run->n_files) {
+        if (run->convert_dir)
+            convert_file(w, run->files[index]);
+        else
+            run_file(w, gb, template, run->files[index]);
+    }
+    if (gb) {
+        gb_destroy(gb);
+        gb_destroy(template);
+    }
+    return NULL;
+}
 
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
 
-    // read 1000 json tests per file
-    final_state.mem_index = 0;
-    initial_state.mem_index = 0;
-    read_json(json_buffer, fp);
+// the .json (and unless json_only .bin) files in path, sorted, or path itself if it is a file
+static char **list_files(const char *path, bool json_only, int *count)
+{
+    struct stat st;
+    struct dirent *entry;
+    char **files = NULL;
+    DIR *dir;
 
-    // setup and run the test
-    int ret = 0;
-    char name[1000];
-    for (int i = 0; i < 1000; i++) {
-        gb = gb_create();
-        final_state.mem_index = 0;
-        initial_state.mem_index = 0;
-        setup_test(json_buffer[i], gb, name, &initial_state, &final_state);
-        cpu_step(gb); 
-
-        // check if the result is ok or not
-        if (check_test(gb, &final_state)) {
-            printf("Test failed.\n");
-            printf("Instructions: %s", name);
-            printf("\n---------------------------------\n");
-            printf("Initial state:\n");
-            printf("pc: %04x sp: %04x a: %02x b: %02x c: %02x d: %02x e: %02x f: %02x h: %02x l: %02x\n", 
-                        initial_state.pc, initial_state.sp, initial_state.a, initial_state.b,
-                        initial_state.c, initial_state.d, initial_state.e, initial_state.f, 
-                        initial_state.h, initial_state.l);
-            printf("mem: ");
-            for (int i = 0; i < final_state.mem_index; i++) {
-                printf("%04x - %02x ", final_state.mem[i].addr, final_state.mem[i].val);
-            }
-            printf("\n---------------------------------\n");
-            printf("CPU state:\n");
-            printf("pc: %04x sp: %04x a: %02x b: %02x c: %02x d: %02x e: %02x f: %02x h: %02x l: %02x\n",
-                        gb->cpu.regs.pc, gb->cpu.regs.sp, gb->cpu.regs.a, gb->cpu.regs.b,
-                        gb->cpu.regs.c, gb->cpu.regs.d, gb->cpu.regs.e, gb->cpu.regs.f, 
-                        gb->cpu.regs.h, gb->cpu.regs.l);
-            printf("mem: ");
-            for (int i = 0; i < final_state.mem_index; i++) {
-                printf("%04x - %02x ", final_state.mem[i].addr, gb->mem[final_state.mem[i].addr]);
-            }
-            printf("\n---------------------------------\n");
-            printf("final state:\n");
-            printf("pc: %04x sp: %04x a: %02x b: %02x c: %02x d: %02x e: %02x f: %02x h: %02x l: %02x\n", 
-                        final_state.pc, final_state.sp, final_state.a, final_state.b,
-                        final_state.c, final_state.d, final_state.e, final_state.f, 
-                        final_state.h, final_state.l);
-            printf("mem: ");
-            for (int i = 0; i < final_state.mem_index; i++) {
-                printf("%04x - %02x ", final_state.mem[i].addr, final_state.mem[i].val);
-            }
-            printf("\n");
-            ret = 1;
+    *count = 0;
+    if (stat(path, &st)) {
+        fprintf(stderr, "Can't open %s\n", path);
+        return NULL;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        files = malloc(sizeof(char *));
+        files[0] = strdup(path);
+        *count = 1;
+        return files;
+    }
+    dir = opendir(path);
+    if (!dir) {
+        fprintf(stderr, "Can't open directory %s\n", path);
+        return NULL;
+    }
+    while ((entry = readdir(dir))) {
+        size_t len = strlen(entry->d_name);
+
+        if (!has_suffix(entry->d_name, ".json") && (json_only || !has_suffix(entry->d_name, ".bin")))
+            continue;
+        files = realloc(files, (*count + 1) * sizeof(char *));
+        files[*count] = malloc(strlen(path) + len + 2);
+        sprintf(files[*count], "%s/%s", path, entry->d_name);
+        (*count)++;
+    }
+    closedir(dir);
+    qsort(files, *count, sizeof(char *), compare_names);
+    return files;
+}
+
+int main(int argc, char *argv[])
+{
+    struct test_run run = { 0 };
+    struct test_worker *workers;
+    int threads = 0, files = 0, cases = 0, failures = 0, failed_files = 0;
+    const char *tests;
+
+    if (argc < 2 || (!strcmp(argv[1], "convert") && argc < 4)) {
+        fprintf(stderr, "Usage: %s <tests> [switch|threaded|cached|jit] [threads]\n"
+                        "       %s convert <json tests> <output directory> [threads]\n"
+                        "tests are .json or converted .bin files, or a directory of them\n", argv[0], argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    run.backend = BACKEND_SWITCH;
+    if (!strcmp(argv[1], "convert")) {
+        tests = argv[2];
+        run.convert_dir = argv[3];
+        if (argc > 4)
+            threads = atoi(argv[4]);
+    } else {
+        tests = argv[1];
+        if (argc > 2 && !strcmp(argv[2], "threaded"))
+            run.backend = BACKEND_THREADED;
+        else if (argc > 2 && !strcmp(argv[2], "cached"))
+            run.backend = BACKEND_CACHED;
+        else if (argc > 2 && !strcmp(argv[2], "jit"))
+            run.backend = BACKEND_JIT;
+        if (argc > 3)
+            threads = atoi(argv[3]);
+    }
+    if (threads < 1)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1)
+        threads = 1;
+
+    // converting only reads JSON, .bin files next to it may be earlier output
+    run.files = list_files(tests, run.convert_dir != NULL, &run.n_files);
+    if (!run.n_files) {
+        fprintf(stderr, "No tests in %s\n", tests);
+        exit(EXIT_FAILURE);
+    }
+    if (threads > run.n_files)
+        threads = run.n_files;
+    atomic_init(&run.next, 0);
+    pthread_mutex_init(&run.print_lock, NULL);
+    workers = calloc(threads, sizeof(struct test_worker));
+    if (!workers)
+        exit(EXIT_FAILURE);
+    for (int t = 0; t < threads; t++) {
+        workers[t].run = &run;
+        if (pthread_create(&workers[t].thread, NULL, worker_main, &workers[t])) {
+            fprintf(stderr, "Can't start test thread %d\n", t);
             exit(EXIT_FAILURE);
         }
-        gb_destroy(gb);
     }
-    if (!ret)
-        printf("test %s ok.\n", argv[1]);
-    return 0;
-}
\ No newline at end of file
+    for (int t = 0; t < threads; t++) {
+        pthread_join(workers[t].thread, NULL);
+        files += workers[t].files;
+        cases += workers[t].cases;
+        failures += workers[t].failures;
+        failed_files += workers[t].failed_files;
+    }
+    if (run.convert_dir)
+        printf("%d tests in %d files converted, %d files failed\n", cases, files, failed_files);
+    else
+        printf("%d tests in %d files, %d failed in %d files\n", cases, files, failures, failed_files);
+
+    pthread_mutex_destroy(&run.print_lock);
+    for (int i = 0; i < run.n_files; i++)
+        free(run.files[i]);
+    free(run.files);
+    free(workers);
+    return failures || failed_files ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,428 @@
+#include <common.h>
+#include <gb.h>
+#include <cpu.h>
+#include <mmu.h>
+#include <rom.h>
+#include <sched.h>
+#include <state.h>
+#include <rewind.h>
+#include <batch.h>
+
+/*
+ * Round trips through savestates, rewind, fork, reset and batches. A small
+ * generated cartridge keeps the LCD, the timer and both their interrupts
+ * busy while it switches ROM banks, halts and writes WRAM and cartridge RAM,
+ * so every part of the machine moves between frames. Whatever an instance
+ * goes through, running it on must end in the same state, byte for byte, as
+ * a reference brought to the same point by loading a savestate. The
+ * scanline and FIFO renderers must also agree on a window that LCDC.0 hides
+ * for a few lines at a time.
+ */
+
+#define STATE_ROM_SIZE      0x20000     // 8 banks of MBC1
+#define STATE_FRAMES        30
+#define STATE_REWIND        (4 << 20)
+#define STATE_BATCH         6
+
+static const char *const backend_names[] = { "switch", "threaded", "cached", "jit" };
+
+static const uint8_t vblank_handler[] = {
+    0xf5,                   // push af
+    0xfa, 0x00, 0xc1,       // ld a,(c100)
+    0x3c,                   // inc a
+    0xea, 0x00, 0xc1,       // ld (c100),a
+    0xf1,                   // pop af
+    0xd9,                   // reti
+};
+
+static const uint8_t timer_handler[] = {
+    0xf5,                   // push af
+    0xfa, 0x01, 0xc1,       // ld a,(c101)
+    0xc6, 0x03,             // add a,03
+    0xea, 0x01, 0xc1,       // ld (c101),a
+    0xf1,                   // pop af
+    0xd9,                   // reti
+};
+
+static const uint8_t program[] = {
+    0xf3,                   // di
+    0x31, 0xfe, 0xff,       // ld sp,fffe
+    0x3e, 0x0a,             // ld a,0a
+    0xea, 0x00, 0x00,       // ld (0000),a      cartridge RAM on
+    0x3e, 0x05,             // ld a,05
+    0xe0, 0x07,             // ldh (07),a       timer on, every 16 cycles
+    0xe0, 0xff,             // ldh (ff),a       VBlank and timer interrupts
+    0x3e, 0x91,             // ld a,91
+    0xe0, 0x40,             // ldh (40),a       LCD on
+    0x21, 0x00, 0xc0,       // ld hl,c000
+    0xfb,                   // ei
+    // loop:
+    0xfa, 0x01, 0xc1,       // ld a,(c101)
+    0xe6, 0x07,             // and 07
+    0x3c,                   // inc a
+    0xea, 0x00, 0x20,       // ld (2000),a      ROM bank 1 to 8
+    0xfa, 0x00, 0x40,       // ld a,(4000)
+    0x86,                   // add a,(hl)
+    0x22,                   // ld (hl+),a
+    0x7d,                   // ld a,l
+    0x26, 0xa0,             // ld h,a0
+    0x77,                   // ld (hl),a
+    0x26, 0xc0,             // ld h,c0
+    0x76,                   // halt
+    0x18, 0xe9,             // jr loop
+};
+
+// with a different header checksum when foreign, so states of one don't load into the other
+static struct rom_image *test_rom(bool foreign)
+{
+    static uint8_t data[STATE_ROM_SIZE];
+    struct rom_image *rom;
+
+    memset(data, 0, sizeof(data));
+    memcpy(&data[0x40], vblank_handler, sizeof(vblank_handler));
+    memcpy(&data[0x50], timer_handler, sizeof(timer_handler));
+    data[0x100] = 0x00;     // nop
+    data[0x101] = 0xc3;     // jp 0150
+    data[0x102] = 0x50;
+    data[0x103] = 0x01;
+    data[0x147] = 0x02;     // MBC1 with 8 KiB of RAM
+    data[0x148] = 0x02;
+    data[0x149] = 0x02;
+    data[0x14d] = foreign ? 0x5a : 0xa5;
+    memcpy(&data[0x150], program, sizeof(program));
+    for (int bank = 1; bank < STATE_ROM_SIZE / 0x4000; bank++)
+        data[bank * 0x4000] = bank * 0x11;
+    rom = rom_from_buffer(data, STATE_ROM_SIZE);
+    if (!rom)
+        exit(EXIT_FAILURE);
+    return rom;
+}
+
+static struct gb *create_instance(struct rom_image *rom, cpu_backend_t backend)
+{
+    struct gb *gb = gb_create_from_rom(rom, NULL);
+
+    if (!gb)
+        exit(EXIT_FAILURE);
+    cpu_init(gb, backend);
+    gb->cpu.regs.pc = 0x100;
+    gb->cpu.regs.sp = 0xfffe;
+    return gb;
+}
+
+static void run_frames(struct gb *gb, int frames)
+{
+    cpu_run_until(gb, gb->sched.now + (uint64_t)frames * FRAME_CYCLES);
+}
+
+static uint8_t *save(struct gb *gb)
+{
+    size_t size = gb_state_size(gb);
+    uint8_t *buf = malloc(size);
+
+    if (!buf || gb_save_state(gb, buf, size) != size)
+        exit(EXIT_FAILURE);
+    return buf;
+}
+
+static bool same_state(struct gb *a, struct gb *b)
+{
+    size_t size = gb_state_size(a);
+    uint8_t *sa, *sb;
+    bool same;
+
+    if (gb_state_size(b) != size)
+        return false;
+    sa = save(a);
+    sb = save(b);
+    same = !memcmp(sa, sb, size);
+    free(sa);
+    free(sb);
+    return same;
+}
+
+static int report(const char *what, cpu_backend_t backend, bool ok)
+{
+    if (!ok)
+        printf("%s on %s differs\n", what, backend_names[backend]);
+    return !ok;
+}
+
+// save, run, load and run again must end in the same state as the first run
+static int check_round_trip(struct rom_image *rom, cpu_backend_t backend)
+{
+    struct gb *gb = create_instance(rom, backend);
+    struct gb *ref = create_instance(rom, backend);
+    size_t size;
+    uint8_t *start;
+    int failures;
+
+    run_frames(gb, STATE_FRAMES);
+    size = gb_state_size(gb);
+    start = save(gb);
+    run_frames(gb, STATE_FRAMES);
+    if (!gb_load_state(ref, start, size))
+        exit(EXIT_FAILURE);
+    run_frames(ref, STATE_FRAMES);
+    failures = report("run after load", backend, same_state(gb, ref));
+    // and loading into an instance that already ran through the same frames
+    if (!gb_load_state(gb, start, size))
+        exit(EXIT_FAILURE);
+    run_frames(gb, STATE_FRAMES);
+    failures += report("run after reload", backend, same_state(gb, ref));
+    free(start);
+    gb_destroy(gb);
+    gb_destroy(ref);
+    return failures;
+}
+
+// truncated states and states of another ROM are refused and leave the instance alone
+static int check_rejects(struct rom_image *rom)
+{
+    struct rom_image *other = test_rom(true);
+    struct gb *gb = create_instance(rom, BACKEND_SWITCH);
+    struct gb *foreign = create_instance(other, BACKEND_SWITCH);
+    size_t size, foreign_size;
+    uint8_t *before, *foreign_state, *after;
+    int failures = 0;
+
+    rom_release(other);
+    run_frames(gb, STATE_FRAMES);
+    run_frames(foreign, STATE_FRAMES);
+    size = gb_state_size(gb);
+    foreign_size = gb_state_size(foreign);
+    before = save(gb);
+    foreign_state = save(foreign);
+    for (size_t cut = 0; cut < size; cut = cut < 16 ? cut + 4 : cut * 2) {
+        if (gb_load_state(gb, before, cut) && !failures++)
+            printf("a state cut to %zu of %zu bytes was loaded\n", cut, size);
+    }
+    if (gb_load_state(gb, before, size - 1) && !failures++)
+        printf("a state missing its last byte was loaded\n");
+    if (gb_load_state(gb, foreign_state, foreign_size) && !failures++)
+        printf("a state of another ROM was loaded\n");
+    after = save(gb);
+    if (memcmp(before, after, size) && !failures++)
+        printf("a refused state changed the instance\n");
+    free(before);
+    free(foreign_state);
+    free(after);
+    gb_destroy(gb);
+    gb_destroy(foreign);
+    return failures;
+}
+
+// stepping back through captured frames lands on exactly the states saved along the way
+static int check_rewind(struct rom_image *rom, cpu_backend_t backend)
+{
+    struct gb *gb = create_instance(rom, backend);
+    struct rewind *rw = rewind_create(gb, STATE_REWIND, 8);
+    size_t size = gb_state_size(gb);
+    uint8_t *states[STATE_FRAMES];
+    int failures = 0;
+
+    if (!rw)
+        exit(EXIT_FAILURE);
+    for (int frame = 0; frame < STATE_FRAMES; frame++) {
+        run_frames(gb, 1);
+        rewind_capture(rw);
+        states[frame] = save(gb);
+    }
+    for (int frame = STATE_FRAMES - 2; frame >= 0; frame--) {
+        uint8_t *now;
+
+        if (!rewind_step_back(rw)) {
+            failures += report("rewind step", backend, false);
+            break;
+        }
+        now = save(gb);
+        failures += report("rewound state", backend, !memcmp(now, states[frame], size));
+        free(now);
+    }
+    if (rewind_step_back(rw))
+        failures += report("rewind past the oldest frame", backend, false);
+    for (int frame = 0; frame < STATE_FRAMES; frame++)
+        free(states[frame]);
+    rewind_destroy(rw);
+    gb_destroy(gb);
+    return failures;
+}
+
+// what one side writes after a fork or reset must not show up on the other
+static void diverge(struct gb *gb)
+{
+    for (int addr = 0xc200; addr < 0xc300; addr++)
+        mmu_write(gb, addr, addr);
+    mmu_write(gb, 0xa100, 0x42);
+}
+
+static int check_fork(struct rom_image *rom, cpu_backend_t backend)
+{
+    struct gb *parent = create_instance(rom, backend);
+    struct gb *ref = create_instance(rom, backend);
+    struct gb *child;
+    size_t size;
+    uint8_t *start;
+    int failures = 0;
+
+    run_frames(parent, STATE_FRAMES);
+    size = gb_state_size(parent);
+    start = save(parent);
+    child = gb_fork(parent);
+    if (!child || !gb_load_state(ref, start, size))
+        exit(EXIT_FAILURE);
+    failures += report("fork", backend, same_state(parent, child));
+    diverge(child);
+    run_frames(child, STATE_FRAMES);
+    run_frames(parent, STATE_FRAMES);
+    run_frames(ref, STATE_FRAMES);
+    failures += report("forked parent", backend, same_state(parent, ref));
+    // the child against the same change made on a copy that was never forked
+    gb_load_state(ref, start, size);
+    diverge(ref);
+    run_frames(ref, STATE_FRAMES);
+    failures += report("fork child", backend, same_state(child, ref));
+    free(start);
+    gb_destroy(parent);
+    gb_destroy(child);
+    gb_destroy(ref);
+    return failures;
+}
+
+static int check_reset(struct rom_image *rom, cpu_backend_t backend)
+{
+    struct gb *template = create_instance(rom, backend);
+    struct gb *gb = create_instance(rom, backend);
+    struct gb *ref = create_instance(rom, backend);
+    size_t size;
+    uint8_t *start;
+    int failures = 0;
+
+    run_frames(template, STATE_FRAMES);
+    size = gb_state_size(template);
+    start = save(template);
+    // the instance reset has run elsewhere and holds cached code and dirty memory
+    run_frames(gb, STATE_FRAMES / 2);
+    diverge(gb);
+    for (int round = 0; round < 3; round++) {
+        if (!gb_reset_from(gb, template) || !gb_load_state(ref, start, size))
+            exit(EXIT_FAILURE);
+        failures += report("reset", backend, same_state(gb, template));
+        if (round)
+            diverge(gb);
+        run_frames(gb, STATE_FRAMES);
+        if (round)
+            diverge(ref);
+        run_frames(ref, STATE_FRAMES);
+        failures += report("run after reset", backend, same_state(gb, ref));
+    }
+    // the template never moved
+    gb_load_state(ref, start, size);
+    failures += report("reset template", backend, same_state(template, ref));
+    free(start);
+    gb_destroy(template);
+    gb_destroy(gb);
+    gb_destroy(ref);
+    return failures;
+}
+
+// instances of a batch end up the same whatever thread ran them
+static int check_batch(struct rom_image *rom, cpu_backend_t backend)
+{
+    struct batch *a = batch_create(rom, STATE_BATCH, 1, backend, NULL);
+    struct batch *b = batch_create(rom, STATE_BATCH, 3, backend, NULL);
+    int failures = 0;
+
+    if (!a || !b)
+        exit(EXIT_FAILURE);
+    for (int round = 1; round <= 3; round++) {
+        batch_run(a, round * STATE_FRAMES / 3);
+        batch_run(b, round * STATE_FRAMES / 3);
+    }
+    for (int i = 0; i < STATE_BATCH; i++) {
+        failures += report("batch instance", backend,
+                           same_state(batch_instance(a, i), batch_instance(a, 0)) &&
+                           same_state(batch_instance(a, i), batch_instance(b, i)));
+    }
+    batch_destroy(a);
+    batch_destroy(b);
+    return failures;
+}
+
+// a scene with the window over part of the screen, every tile row different
+static struct gb *window_scene(ppu_renderer_t renderer)
+{
+    struct gb_config config = { .renderer = renderer };
+    struct gb *gb = gb_create_config(&config);
+
+    if (!gb)
+        exit(EXIT_FAILURE);
+    for (int addr = 0x8000; addr < 0x9000; addr++)
+        mmu_write(gb, addr, addr * 7 >> 3);
+    for (int addr = 0x9800; addr < 0x9c00; addr++)
+        mmu_write(gb, addr, addr);
+    for (int addr = 0x9c00; addr < 0xa000; addr++)
+        mmu_write(gb, addr, addr * 3);
+    mmu_write(gb, 0xff47, 0xe4);
+    mmu_write(gb, 0xff4a, 16);          // WY
+    mmu_write(gb, 0xff4b, 47);          // WX
+    mmu_write(gb, 0xff40, 0xf1);        // LCD, window from 9c00, tiles from 8000, BG
+    return gb;
+}
+
+/*
+ * LCDC.0 turned off and back on in HBlank every few lines, which on DMG also
+ * hides the window. Both renderers must draw the same frames and skip the
+ * same window lines while it is off.
+ */
+static int check_renderers(void)
+{
+    struct gb *gb[2] = { window_scene(PPU_SCANLINE), window_scene(PPU_FIFO) };
+    uint8_t window_line[2][SCREEN_HEIGHT];
+    int failures = 0;
+
+    for (int frame = 0; frame < 2; frame++) {
+        for (int i = 0; i < 2; i++) {
+            struct ppu *ppu = &gb[i]->ppu;
+            uint64_t frames = ppu->frames;
+
+            for (int line = 0; line < SCREEN_HEIGHT; line++) {
+                while (ppu->ly != line || ppu->mode != PPU_HBLANK)
+                    sched_advance(gb[i], 4);
+                window_line[i][line] = ppu->window_line;
+                mmu_write(gb[i], 0xff40, (line / 5) % 2 ? 0xf0 : 0xf1);
+            }
+            while (ppu->frames == frames)
+                sched_advance(gb[i], 4);
+        }
+        if (memcmp(window_line[0], window_line[1], SCREEN_HEIGHT) && !failures++)
+            printf("the renderers counted different window lines in frame %d\n", frame);
+        if (memcmp(gb[0]->ppu.framebuffer, gb[1]->ppu.framebuffer, sizeof(gb[0]->ppu.framebuffer)) &&
+            !failures++)
+            printf("the renderers drew different pixels in frame %d\n", frame);
+    }
+    gb_destroy(gb[0]);
+    gb_destroy(gb[1]);
+    return failures;
+}
+
+int main(void)
+{
+    struct rom_image *rom = test_rom(false);
+    int failures = check_rejects(rom);
+    int renderer_failures = check_renderers();
+
+    printf("%-8s %s\n", "rejects", failures ? "FAILED" : "ok");
+    printf("%-8s %s\n", "renderers", renderer_failures ? "FAILED" : "ok");
+    failures += renderer_failures;
+    for (int backend = BACKEND_SWITCH; backend <= BACKEND_JIT; backend++) {
+        int backend_failures = check_round_trip(rom, backend) + check_rewind(rom, backend) +
+                               check_fork(rom, backend) + check_reset(rom, backend) +
+                               check_batch(rom, backend);
+
+        printf("%-8s %s\n", backend_names[backend], backend_failures ? "FAILED" : "ok");
+        failures += backend_failures;
+    }
+    rom_release(rom);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,8 +1,15 @@
 #!/bin/bash
 
-for test_file in /home/lda/jsmoo/misc/tests/GeneratedTests/sm83/v1/*.json; do 
-	../build/testing/cpu_test "$test_file"
-	if [ $? -eq 1 ]; then
-		exit 1
-	fi
-done
\ No newline at end of file
+tests=/home/lda/jsmoo/misc/tests/GeneratedTests/sm83/v1
+vectors=../build/testing/sm83
+
+# parsing the JSON is the slow part, convert it once and run the binary vectors from then on
+if [ ! -d "$vectors" ]; then
+	mkdir -p "$vectors" && ../build/testing/cpu_test convert "$tests" "$vectors" || exit 1
+fi
+# every opcode file in one run, across all CPUs, failures are listed as they come
+../build/testing/cpu_test "$vectors" "$@" || exit 1
+# the other backends against the switch interpreter on random code
+../build/testing/backend_test || exit 1
+# savestates, rewind, fork, reset and batches brought back to the same point by different routes
+../build/testing/state_test || exit 1
@@ -1,19 +1,85 @@
+#include <time.h>
 #include "cpu.h"
 #include "rom.h"
+#include "mbc.h"
+#include "batch.h"
+
+// game.gb -> game.sav, next to the ROM
+static void open_save(struct gb *gb, const char *rom_path)
+{
+    size_t len = strlen(rom_path);
+    const char *dot = strrchr(rom_path, '.');
+    char *sav_path = malloc(len + 5);
+
+    if (!sav_path)
+        return;
+    if (dot && !strchr(dot, '/'))
+        len = dot - rom_path;
+    memcpy(sav_path, rom_path, len);
+    strcpy(sav_path + len, ".sav");
+    mbc_open_save(gb, sav_path);
+    free(sav_path);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// --batch <instances> <frames> <rom> [threads]: independent instances on every CPU, no save files
+static int run_batch(int argc, char *argv[])
+{
+    struct rom_image *rom;
+    struct batch *batch;
+    int instances, threads;
+    uint64_t frames, total;
+    double start, elapsed;
+
+    if (argc < 5) {
+        printf("Usage: %s --batch <instances> <frames> <rom> [threads]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    instances = atoi(argv[2]);
+    frames = strtoull(argv[3], NULL, 10);
+    threads = argc > 5 ? atoi(argv[5]) : 0;
+    rom = rom_open(argv[4]);
+    if (!rom)
+        return EXIT_FAILURE;
+    batch = batch_create(rom, instances, threads, BACKEND_THREADED, NULL);
+    rom_release(rom);
+    if (!batch)
+        return EXIT_FAILURE;
+    start = now();
+    total = batch_run(batch, frames);
+    elapsed = now() - start;
+    printf("%d instances x %llu frames on %d threads: %.3f s, %.1f frames/s, %.1fx real time\n",
+                instances, (unsigned long long)frames, batch->threads, elapsed, total / elapsed,
+                total / elapsed / (CPU_FREQ / (double)FRAME_CYCLES));
+    batch_destroy(batch);
+    return EXIT_SUCCESS;
+}
 
 int main(int argc, char *argv[])
 {
-    struct gb *gb = gb_create();
+    struct gb *gb;
 
     if (argc < 2) {
         printf("Need to supply a ROM file to run\n");
         exit(EXIT_SUCCESS);
     }
+    if (!strcmp(argv[1], "--batch"))
+        return run_batch(argc, argv);
 
+    gb = gb_create();
     if (!gb)
         exit(EXIT_FAILURE);
-    cpu_init(gb);
+    cpu_init(gb, BACKEND_THREADED);
     rom_load(gb, argv[1]);
+    if (gb->mbc.battery)
+        open_save(gb, argv[1]);
     while (1) {
         cpu_step(gb);
     }